@@ -0,0 +1,398 @@
+/*
+ * Background compression and retention of data files
+ *
+ * A worker thread at idle CPU and I/O priority looks after data_dir:
+ * day files older than COMPRESSAFTER days are gzipped, checked against
+ * the original and only then replaced, and the oldest files are
+ * deleted, with their .ozq sidecars, to keep within RETAINDAYS and
+ * RETAINMB. The export spool counts towards RETAINMB too, though it
+ * is left to the exporter to trim. The worker runs
+ * when write_file() moves to a new day, after a reload, and hourly.
+ * Its reads and writes are throttled to ARCHIVEKBPS so that it never
+ * competes with the recorder threads for the card.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#include "archive.h"
+#include "export.h"
+#include "summary.h"
+#include "timeutil.h"
+
+#define ARCHIVE_INTERVAL 3600 /* seconds between passes if not kicked */
+#define ARCHIVE_CHUNK 65536
+#define MAX_DAY_FILES 4096
+
+/* Not in glibc's headers */
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+struct day_file {
+  char name[NAME_MAX + 1];
+  time_t day; /* start of the file's day (UTC) */
+  off_t size;
+  off_t sidecar_size; /* of its .ozq, 0 if there is none */
+  int compressed;
+};
+
+/* Settings copied from the caller's configuration snapshot, so the
+   worker never holds on to a snapshot */
+
+struct archive_settings {
+  char data_dir[_POSIX_PATH_MAX];
+  int compress_after;
+  int retain_days;
+  int retain_mb;
+  int kbps;
+};
+
+static pthread_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t archive_cond = PTHREAD_COND_INITIALIZER;
+static struct archive_settings settings;
+static int kicked = 0;
+
+static void copy_settings(const struct ozone_config *cfg)
+{
+  strcpy(settings.data_dir, cfg->data_dir);
+  settings.compress_after = cfg->compress_after;
+  settings.retain_days = cfg->retain_days;
+  settings.retain_mb = cfg->retain_mb;
+  settings.kbps = cfg->archive_kbps;
+}
+
+/* Sleep as needed to keep the average rate since t0 within kbps */
+
+static void throttle(const struct timespec *t0, double bytes, int kbps)
+{
+  double ahead = bytes / (kbps * 1024.0) - time_since(t0);
+
+  if (ahead > 0)
+    usleep((useconds_t)(ahead * 1.0E6));
+}
+
+/* Compress path to path.gz, check the result and remove the original.
+   Returns 0 on success. */
+
+static int compress_file(const struct archive_settings *s, const char *name)
+{
+  char path[_POSIX_PATH_MAX], tmp[_POSIX_PATH_MAX], gz[_POSIX_PATH_MAX];
+  static char buf[ARCHIVE_CHUNK], check[ARCHIVE_CHUNK];
+  struct timespec t0;
+  double done = 0;
+  FILE *fp;
+  gzFile gzf;
+  size_t n;
+  int ok = 1;
+
+  if ((snprintf(path, sizeof(path), "%s/%s", s->data_dir, name)
+       >= (int)sizeof(path))
+      || (snprintf(gz, sizeof(gz), "%s/%s.gz", s->data_dir, name)
+	  >= (int)sizeof(gz))
+      || (snprintf(tmp, sizeof(tmp), "%s/.%s.gz.tmp", s->data_dir, name)
+	  >= (int)sizeof(tmp))) {
+    fprintf(stderr, "archive: path too long for %s\n", name);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "archive: cannot open %s\n", path);
+    return 1;
+  }
+
+  gzf = gzopen(tmp, "wb6");
+  if (gzf == NULL) {
+    fprintf(stderr, "archive: cannot create %s\n", tmp);
+    fclose(fp);
+    return 1;
+  }
+
+  while (ok && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    if (gzwrite(gzf, buf, n) != (int)n)
+      ok = 0;
+    done += n;
+    throttle(&t0, done, s->kbps);
+  }
+
+  if ((gzclose(gzf) != Z_OK) || ferror(fp))
+    ok = 0;
+
+  /* Read the compressed file back and compare */
+
+  if (ok) {
+    rewind(fp);
+    gzf = gzopen(tmp, "rb");
+    ok = gzf != NULL;
+    while (ok && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      if ((gzread(gzf, check, n) != (int)n) || (memcmp(buf, check, n) != 0))
+	ok = 0;
+      done += n;
+      throttle(&t0, done, s->kbps);
+    }
+    if (ok && ((gzread(gzf, check, 1) != 0) || ferror(fp)))
+      ok = 0;
+    if (gzf != NULL)
+      gzclose(gzf);
+  }
+
+  fclose(fp);
+
+  if (!ok || (rename(tmp, gz) != 0)) {
+    fprintf(stderr, "archive: could not compress %s, keeping it\n", path);
+    unlink(tmp);
+    return 1;
+  }
+
+  unlink(path);
+
+  fprintf(stderr, "archive: compressed %s in %.0f s\n", name,
+	  time_since(&t0));
+
+  return 0;
+}
+
+/* Data file names are YYYYMMDD_sNNN.ozo, possibly with .gz */
+
+static int parse_name(const char *name, struct day_file *f)
+{
+  struct tm tm;
+  int vsrt, len, ext;
+
+  memset(&tm, 0, sizeof(tm));
+  if ((sscanf(name, "%4d%2d%2d_s%d.ozo%n", &tm.tm_year, &tm.tm_mon,
+	      &tm.tm_mday, &vsrt, &len) != 4))
+    return 1;
+
+  ext = strlen(name) - len;
+  if ((ext != 0) && ((ext != 3) || (strcmp(&name[len], ".gz") != 0)))
+    return 1;
+
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+
+  if (snprintf(f->name, sizeof(f->name), "%s", name) >= (int)sizeof(f->name))
+    return 1;
+  f->day = timegm(&tm);
+  f->compressed = ext != 0;
+
+  return 0;
+}
+
+/* The path and size of a day file's sidecar. Returns 0 if there is
+   one. */
+
+static int sidecar(const struct archive_settings *s, const char *name,
+		   char *path, size_t len, off_t *size)
+{
+  char qname[NAME_MAX + 1];
+  struct stat st;
+
+  if ((summary_path(name, qname, sizeof(qname)) != 0)
+      || (snprintf(path, len, "%s/%s", s->data_dir, qname) >= (int)len)
+      || (stat(path, &st) != 0))
+    return 1;
+
+  *size = st.st_size;
+  return 0;
+}
+
+/* Bytes in the export spool, if there is one */
+
+static off_t spool_size(const struct archive_settings *s)
+{
+  char dir_path[_POSIX_PATH_MAX], path[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  off_t size = 0;
+  DIR *dir;
+
+  if (snprintf(dir_path, sizeof(dir_path), "%s/%s", s->data_dir,
+	       EXPORT_SPOOL_DIR) >= (int)sizeof(dir_path))
+    return 0;
+
+  dir = opendir(dir_path);
+  if (dir == NULL)
+    return 0;
+
+  while ((de = readdir(dir)) != NULL)
+    if ((snprintf(path, sizeof(path), "%s/%s", dir_path, de->d_name)
+	 < (int)sizeof(path)) && (stat(path, &st) == 0)
+	&& S_ISREG(st.st_mode))
+      size += st.st_size;
+
+  closedir(dir);
+  return size;
+}
+
+static int older_first(const void *a, const void *b)
+{
+  const struct day_file *fa = a, *fb = b;
+
+  return (fa->day > fb->day) - (fa->day < fb->day);
+}
+
+static void archive_pass(const struct archive_settings *s)
+{
+  static struct day_file files[MAX_DAY_FILES];
+  char path[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+  int num_files = 0, n;
+  time_t today = time(NULL);
+  off_t total = 0;
+
+  today -= today % 86400;
+
+  dir = opendir(s->data_dir);
+  if (dir == NULL) {
+    fprintf(stderr, "archive: cannot open %s\n", s->data_dir);
+    return;
+  }
+
+  while (((de = readdir(dir)) != NULL) && (num_files < MAX_DAY_FILES)) {
+    if (parse_name(de->d_name, &files[num_files]) != 0)
+      continue;
+    if ((snprintf(path, sizeof(path), "%s/%s", s->data_dir, de->d_name)
+	 >= (int)sizeof(path)) || (stat(path, &st) != 0))
+      continue;
+    files[num_files].size = st.st_size;
+    if (sidecar(s, de->d_name, path, sizeof(path),
+		&files[num_files].sidecar_size) != 0)
+      files[num_files].sidecar_size = 0;
+    num_files++;
+  }
+
+  closedir(dir);
+
+  qsort(files, num_files, sizeof(files[0]), older_first);
+
+  /* Today's files are still being written and are never touched */
+
+  for (n = 0; n < num_files; n++) {
+    struct day_file *f = &files[n];
+    int age = (today - f->day) / 86400;
+
+    if ((age < 1) || f->compressed || (s->compress_after <= 0)
+	|| (age < s->compress_after)
+	|| ((s->retain_days > 0) && (age > s->retain_days)))
+      continue;
+
+    if (compress_file(s, f->name) == 0) {
+      strcat(f->name, ".gz");
+      if ((snprintf(path, sizeof(path), "%s/%s", s->data_dir, f->name)
+	   < (int)sizeof(path)) && (stat(path, &st) == 0))
+	f->size = st.st_size;
+      f->compressed = 1;
+    }
+  }
+
+  total = spool_size(s);
+  for (n = 0; n < num_files; n++)
+    total += files[n].size + files[n].sidecar_size;
+
+  for (n = 0; n < num_files; n++) {
+    struct day_file *f = &files[n];
+    int age = (today - f->day) / 86400;
+
+    if (age < 1)
+      break;
+
+    if (!(((s->retain_days > 0) && (age > s->retain_days))
+	  || ((s->retain_mb > 0)
+	      && (total > (off_t)s->retain_mb * 1024 * 1024))))
+      continue;
+
+    if ((snprintf(path, sizeof(path), "%s/%s", s->data_dir, f->name)
+	 < (int)sizeof(path)) && (unlink(path) == 0)) {
+      fprintf(stderr, "archive: removed %s\n", f->name);
+      total -= f->size;
+      if ((sidecar(s, f->name, path, sizeof(path), &f->sidecar_size) == 0)
+	  && (unlink(path) == 0))
+	total -= f->sidecar_size;
+    }
+  }
+}
+
+static void *archive_thread(void *arg)
+{
+  struct sched_param spar;
+  struct archive_settings s;
+  struct timespec deadline;
+
+  /* Lowest CPU and I/O priority */
+
+  spar.sched_priority = 0;
+  if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &spar) != 0)
+    fprintf(stderr, "archive: could not set idle scheduling\n");
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	      IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+    fprintf(stderr, "archive: could not set idle I/O priority\n");
+
+  pthread_mutex_lock(&archive_mutex);
+
+  for (;;) {
+    s = settings;
+    kicked = 0;
+    pthread_mutex_unlock(&archive_mutex);
+
+    if ((s.compress_after > 0) || (s.retain_days > 0) || (s.retain_mb > 0))
+      archive_pass(&s);
+
+    pthread_mutex_lock(&archive_mutex);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ARCHIVE_INTERVAL;
+    while (!kicked)
+      if (pthread_cond_timedwait(&archive_cond, &archive_mutex,
+				 &deadline) == ETIMEDOUT)
+	break;
+  }
+
+  return NULL;
+}
+
+/* Start the worker, which makes a first pass straight away */
+
+int archive_start(const struct ozone_config *cfg)
+{
+  pthread_t thread;
+  int r;
+
+  copy_settings(cfg);
+
+  r = pthread_create(&thread, NULL, archive_thread, NULL);
+  if (r != 0) {
+    fprintf(stderr, "pthread_create(archive_thread): %s\n", strerror(r));
+    return 1;
+  }
+
+  pthread_detach(thread);
+  return 0;
+}
+
+/* Ask the worker for a pass with the given settings */
+
+void archive_kick(const struct ozone_config *cfg)
+{
+  pthread_mutex_lock(&archive_mutex);
+  copy_settings(cfg);
+  kicked = 1;
+  pthread_cond_signal(&archive_cond);
+  pthread_mutex_unlock(&archive_mutex);
+}
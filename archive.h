@@ -0,0 +1,13 @@
+/*
+ * Background compression and retention of data files
+ */
+
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include "config.h"
+
+int archive_start(const struct ozone_config *cfg);
+void archive_kick(const struct ozone_config *cfg);
+
+#endif /* _ARCHIVE_H */
@@ -0,0 +1,219 @@
+/*
+ * Cycle timing and duty-cycle auto-tuning
+ *
+ * The per-phase overheads measured over a few cycles are fitted to a
+ * simple model of the cycle, which is then evaluated for a grid of
+ * candidate shapes. The shape giving the largest fraction of time
+ * on-source, within the memory and cycle length limits, is chosen.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "autotune.h"
+#include "common.h"
+
+/* Candidate read sizes are multiples of both the USB block size and
+   one FFT frame, so no samples are wasted */
+
+#define READ_UNIT (2 * FFT_LEN * 128)
+
+static const int cand_read_units[] = { 4, 8, 16, 32 };
+static const int cand_num_blocks[] = { 1, 2, 4, 8 };
+static const int cand_num_sig_spec[] = { 1, 2, 4, 8, 16, 32 };
+static const int cand_in_queue_len[] = { 2, 3, 4, 8 };
+
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+void autotune_reset(struct autotune *at, const struct cycle_shape *shape)
+{
+  memset(at, 0, sizeof(*at));
+  at->shape = *shape;
+  at->skip = 1; /* first cycle includes buffer setup */
+}
+
+/* The slowest channel holds up the others at the barriers, so combine
+   channels by taking the worst of each phase */
+
+void cycle_timing_worst(struct cycle_timing *worst,
+			const struct cycle_timing *t)
+{
+  if (!t->valid)
+    return;
+
+#define WORST(f) if (t->f > worst->f) worst->f = t->f
+  WORST(total);
+  WORST(cal);
+  WORST(tune);
+  WORST(read);
+  WORST(queue_wait);
+  WORST(drain);
+  WORST(write);
+  WORST(compute);
+  WORST(calibrated);
+#undef WORST
+
+  /* on-source time is that of the least productive channel */
+  if (!worst->valid || (t->bytes < worst->bytes))
+    worst->bytes = t->bytes;
+
+  worst->valid = 1;
+}
+
+void log_duty_cycle(const struct cycle_timing *t, double period)
+{
+  double on_source = t->bytes / (2.0 * SAMPLERATE);
+
+  if (!t->valid || (period <= 0))
+    return;
+
+  fprintf(stderr, "Cycle %.1f s, on-source %.1f s (duty cycle %.1f%%): "
+	  "cal %.1f, tune %.1f, queue %.1f, drain %.1f, write %.2f s\n",
+	  period, on_source, 100.0 * on_source / period, t->cal, t->tune,
+	  t->queue_wait, t->drain, t->write);
+}
+
+void autotune_add(struct autotune *at, const struct cycle_timing *worst,
+		  double period)
+{
+  if (!worst->valid)
+    return;
+
+  if (at->skip > 0) {
+    at->skip--;
+    return;
+  }
+
+  at->sum.total += worst->total;
+  at->sum.cal += worst->cal;
+  at->sum.tune += worst->tune;
+  at->sum.read += worst->read;
+  at->sum.queue_wait += worst->queue_wait;
+  at->sum.drain += worst->drain;
+  at->sum.write += worst->write;
+  at->sum.compute += worst->compute;
+  at->sum.bytes += worst->bytes;
+  at->period_sum += period;
+  at->cycles++;
+  at->cal_cycles += worst->calibrated;
+}
+
+/* Choose the shape with the best predicted duty cycle.
+ * Returns 1 if not enough has been measured yet, 0 otherwise.
+ */
+
+int autotune_choose(const struct autotune *at, const struct ozone_config *cfg,
+		    struct cycle_shape *best)
+{
+  const struct cycle_shape *s0 = &at->shape;
+  const double rate = 2.0 * SAMPLERATE; /* bytes per second */
+  double n, dwells, reads, bytes, cal_frac;
+  double t_dwell, t_read, c, t_cal_fixed, t_fixed, period;
+  double best_duty = 0, best_period = 0;
+  size_t best_mem = 0;
+
+  if ((at->cycles < AUTOTUNE_CYCLES) || (at->sum.bytes <= 0))
+    return 1;
+
+  /* Fit the model to the measured cycles */
+
+  n = at->cycles;
+  dwells = 2.0 * s0->num_sig_spec;
+  reads = dwells * s0->num_blocks;
+  bytes = at->sum.bytes / n;
+
+  t_dwell = at->sum.tune / n / dwells; /* retune and reset */
+  t_read = (at->sum.read / n - bytes / rate) / reads; /* per read */
+  if (t_read < 0)
+    t_read = 0;
+  c = at->sum.compute / n / bytes; /* compute seconds per byte */
+
+  /* cal phase: a read of read_size and its FFT in the cycles with a
+     cal (CALEVERY), plus fixed costs */
+  cal_frac = (double)at->cal_cycles / n;
+  t_cal_fixed = at->sum.cal / n - cal_frac * s0->read_size * (1.0 / rate + c);
+  if (t_cal_fixed < 0)
+    t_cal_fixed = 0;
+
+  /* everything else: writing, barriers, switching the calibrator */
+  period = at->period_sum / n;
+  t_fixed = period - (at->sum.cal + at->sum.tune + at->sum.read
+		      + at->sum.queue_wait + at->sum.drain) / n;
+  if (t_fixed < 0)
+    t_fixed = 0;
+
+  fprintf(stderr, "Auto-tune: per dwell %.3f s, per read %.3f s, "
+	  "compute %.2f s/MB, cal %.2f s + fixed %.2f s\n",
+	  t_dwell, t_read, c * 1048576.0, t_cal_fixed, t_fixed);
+
+  *best = *s0;
+
+  for (size_t i = 0; i < NELEM(cand_read_units); i++)
+    for (size_t j = 0; j < NELEM(cand_num_blocks); j++)
+      for (size_t k = 0; k < NELEM(cand_num_sig_spec); k++)
+	for (size_t l = 0; l < NELEM(cand_in_queue_len); l++) {
+
+	  struct cycle_shape s;
+	  double block, capture, compute, finish, p, duty;
+	  size_t mem;
+
+	  s.read_size = cand_read_units[i] * READ_UNIT;
+	  s.num_blocks = cand_num_blocks[j];
+	  s.num_sig_spec = cand_num_sig_spec[k];
+	  s.in_queue_len = cand_in_queue_len[l];
+
+	  /* a short queue only copes with jitter if computing is well
+	     within real time */
+	  if ((s.in_queue_len < 3) && (c * rate > 0.8))
+	    continue;
+
+	  mem = (size_t)s.read_size * s.in_queue_len;
+	  if (mem > (size_t)cfg->max_buf_mb << 20)
+	    continue;
+
+	  dwells = 2.0 * s.num_sig_spec;
+	  block = (double)s.read_size * s.num_blocks;
+	  bytes = dwells * block;
+
+	  capture = bytes / rate + dwells * (t_dwell + s.num_blocks * t_read);
+	  compute = bytes * c;
+
+	  /* The cycle's spectra are ready when the last read has been
+	     integrated, or if computing is the slower, when the
+	     computational thread has worked through every read since the
+	     first arrived */
+
+	  finish = capture + s.read_size * c;
+	  if (s.read_size / rate + compute > finish)
+	    finish = s.read_size / rate + compute;
+
+	  p = t_fixed + t_cal_fixed + cal_frac * s.read_size * (1.0 / rate + c)
+	    + finish;
+	  if (p > cfg->max_cycle_time)
+	    continue;
+
+	  duty = (bytes / rate) / p;
+
+	  if ((duty > best_duty + 1.0E-4)
+	      || ((duty > best_duty - 1.0E-4) && (mem < best_mem))) {
+	    best_duty = duty;
+	    best_period = p;
+	    best_mem = mem;
+	    *best = s;
+	  }
+	}
+
+  if (best_duty == 0) {
+    fprintf(stderr, "Auto-tune: no shape fits MAXBUFMB and MAXCYCLETIME, "
+	    "keeping current shape\n");
+    return 0;
+  }
+
+  fprintf(stderr, "Auto-tune: measured duty cycle %.1f%%\n",
+	  100.0 * (at->sum.bytes / rate) / at->period_sum);
+  fprintf(stderr, "Auto-tune: chose READSIZE %d NUMBLOCKS %d NUMSIGSPEC %d "
+	  "INQUEUELEN %d (%zu MB, cycle %.1f s, predicted duty cycle %.1f%%)\n",
+	  best->read_size, best->num_blocks, best->num_sig_spec,
+	  best->in_queue_len, best_mem >> 20, best_period, 100.0 * best_duty);
+
+  return 0;
+}
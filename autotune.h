@@ -0,0 +1,46 @@
+/*
+ * Cycle timing and duty-cycle auto-tuning
+ */
+
+#ifndef _AUTOTUNE_H
+#define _AUTOTUNE_H
+
+#include "config.h"
+
+/* Where a recorder thread's time went during one cycle (seconds) */
+
+struct cycle_timing {
+  double total; /* cal on until the record was written */
+  double cal; /* cal on until cal off, including the cal FFT */
+  double tune; /* retuning and buffer resets */
+  double read; /* capturing signal */
+  double queue_wait; /* waiting for space in the input queue */
+  double drain; /* waiting for the last spectra after capture ended */
+  double write; /* writing the record */
+  double compute; /* computational thread busy time */
+  double bytes; /* signal bytes captured */
+  int calibrated; /* the cycle had a cal (CALEVERY) */
+  int valid;
+};
+
+#define AUTOTUNE_CYCLES 3 /* cycles measured before choosing */
+
+struct autotune {
+  int cycles; /* cycles measured so far */
+  int cal_cycles; /* of which with a cal */
+  int skip; /* cycles still to be discarded */
+  struct cycle_shape shape; /* shape the measurements were made with */
+  struct cycle_timing sum; /* worst channel of each cycle, summed */
+  double period_sum; /* cycle periods seen by the main thread, summed */
+};
+
+void autotune_reset(struct autotune *at, const struct cycle_shape *shape);
+void cycle_timing_worst(struct cycle_timing *worst,
+			const struct cycle_timing *t);
+void log_duty_cycle(const struct cycle_timing *t, double period);
+void autotune_add(struct autotune *at, const struct cycle_timing *worst,
+		  double period);
+int autotune_choose(const struct autotune *at, const struct ozone_config *cfg,
+		    struct cycle_shape *best);
+
+#endif /* _AUTOTUNE_H */
@@ -2,60 +2,209 @@
  * Calibrator control functions
  */
 
-#include "calcontrol.h"
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "calcontrol.h"
+#include "timeutil.h"
+
+#define SYSFS_GPIO "/sys/class/gpio/gpio%d"
+#define CONSUMER "ozonespec"
+
+static const char *backend_names[NUM_CAL_BACKENDS] = {
+  "sysfs", "gpiochip", "mock"
+};
 
-#define GPIOPATH "/sys/class/gpio/gpio60"
-#define GPIODIR "/direction"
-#define GPIOVAL "/value"
+/* Only the main thread switches the calibrator; cal_state() may be
+   called from any thread */
 
-FILE *init_cal_control(void)
-{ 
-  char fname[256];
-  FILE *fp;
-  int ret;
+static int backend = -1;
+static int value_fd = -1; /* sysfs value file or requested line */
+static int state = 0;
+static struct cal_event last[2]; /* last switch off and on */
+
+int cal_backend_id(const char *name)
+{
+  for (int n = 0; n < NUM_CAL_BACKENDS; n++)
+    if (strcmp(name, backend_names[n]) == 0)
+      return n;
+
+  return -1;
+}
+
+static int init_sysfs(int gpio)
+{
+  char fname[64];
+  int fd;
 
   /* Set GPIO direction */
 
-  strncpy(fname, GPIOPATH, sizeof(fname) - 1);
-  strncat(fname, GPIODIR, sizeof(fname) - sizeof(GPIODIR));
-  fp = fopen(fname, "w");
-  if(fp == NULL)
+  snprintf(fname, sizeof(fname), SYSFS_GPIO "/direction", gpio);
+  fd = open(fname, O_WRONLY);
+  if ((fd < 0) || (write(fd, "out\n", 4) != 4)) {
     perror(fname);
-  else {
-    ret = fputs("out\n",fp);
-    if(ret == EOF)
-      perror(fname);
-    fclose(fp);
+    if (fd >= 0)
+      close(fd);
+    return -1;
   }
+  close(fd);
 
   /* Open control file */
 
-  strncpy(fname, GPIOPATH, sizeof(fname) - 1);
-  strncat(fname, GPIOVAL, sizeof(fname) - sizeof(GPIODIR));
-  fp = fopen(fname, "w");
-  if(fp == NULL)
+  snprintf(fname, sizeof(fname), SYSFS_GPIO "/value", gpio);
+  fd = open(fname, O_WRONLY);
+  if (fd < 0)
     perror(fname);
 
-  return fp;
- 
+  return fd;
+}
+
+/* Request the line as an output, initially off. The line stays ours
+   until its file descriptor is closed. The v2 interface is used where
+   the kernel headers have it, the v1 line handle otherwise. */
+
+static int init_gpiochip(const char *chip, int line)
+{
+  int chip_fd, fd = -1;
+
+  chip_fd = open(chip, O_RDWR | O_CLOEXEC);
+  if (chip_fd < 0) {
+    perror(chip);
+    return -1;
+  }
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  struct gpio_v2_line_request req;
+
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = line;
+  req.num_lines = 1;
+  req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  req.config.num_attrs = 1;
+  req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  req.config.attrs[0].attr.values = 0;
+  req.config.attrs[0].mask = 1;
+  strncpy(req.consumer, CONSUMER, sizeof(req.consumer) - 1);
+
+  if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) == 0)
+    fd = req.fd;
+#else
+  struct gpiohandle_request req;
+
+  memset(&req, 0, sizeof(req));
+  req.lineoffsets[0] = line;
+  req.lines = 1;
+  req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+  req.default_values[0] = 0;
+  strncpy(req.consumer_label, CONSUMER, sizeof(req.consumer_label) - 1);
+
+  if (ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req) == 0)
+    fd = req.fd;
+#endif
+
+  if (fd < 0)
+    fprintf(stderr, "Cannot request line %d of %s: %s\n", line, chip,
+	    strerror(errno));
+  close(chip_fd);
+
+  return fd;
+}
+
+static int set_line(int on)
+{
+  switch (backend) {
+    case CAL_SYSFS:
+      return write(value_fd, on ? "1\n" : "0\n", 2) == 2 ? 0 : -1;
+
+    case CAL_GPIOCHIP: {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+      struct gpio_v2_line_values v = { .bits = on ? 1 : 0, .mask = 1 };
+
+      return ioctl(value_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v);
+#else
+      struct gpiohandle_data v = { .values = { on ? 1 : 0 } };
+
+      return ioctl(value_fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &v);
+#endif
+    }
+
+    default:
+      return 0;
+  }
 }
 
-void set_cal_state(FILE *fp, int state)
+/* Set up the backend given by the configuration and switch the
+   calibrator off. Returns 0 on success. */
+
+int init_cal_control(const struct ozone_config *cfg)
 {
-  int ret;
-  
-  if (fp == NULL)
-    return;
+  backend = cfg->cal_backend;
 
-  if (state != 0)
-    ret = fputs("1\n", fp);
-  else
-    ret = fputs("0\n", fp);
-  fflush(fp);
+  switch (backend) {
+    case CAL_SYSFS:
+      value_fd = init_sysfs(cfg->cal_gpio);
+      break;
+    case CAL_GPIOCHIP:
+      value_fd = init_gpiochip(cfg->cal_chip, cfg->cal_line);
+      break;
+    case CAL_MOCK:
+      fprintf(stderr, "Using mock calibrator control\n");
+      break;
+  }
+
+  if ((backend != CAL_MOCK) && (value_fd < 0))
+    return 1;
+
+  /* Whatever it was left at, switch it off */
 
-  if (ret == EOF)
-    perror("set_cal_state");
-  
+  state = 1;
+  return set_cal_state(0, NULL);
 }
 
+/* Switch the calibrator on (state != 0) or off. If it already is, the
+   line is left alone and ev gets the switch that put it there.
+   Returns 0 on success. */
+
+int set_cal_state(int on, struct cal_event *ev)
+{
+  int64_t t0;
+
+  on = on != 0;
+
+  if (on != state) {
+    t0 = clock_ns(CLOCK_MONOTONIC);
+    if (set_line(on) != 0) {
+      perror("set_cal_state");
+      return -1;
+    }
+    last[on].state = on;
+    last[on].t_mono = clock_ns(CLOCK_MONOTONIC);
+    last[on].t_real = clock_ns(CLOCK_REALTIME);
+    last[on].latency = last[on].t_mono - t0;
+    __atomic_store_n(&state, on, __ATOMIC_RELEASE);
+  }
+
+  if (ev != NULL)
+    *ev = last[on];
+
+  return 0;
+}
+
+/* The calibrator's state as last set */
+
+int cal_state(void)
+{
+  return __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+}
+
+void close_cal_control(void)
+{
+  set_cal_state(0, NULL);
+  if (value_fd >= 0)
+    close(value_fd);
+  value_fd = -1;
+}
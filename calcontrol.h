@@ -1,15 +1,41 @@
 /*
  * Calibrator control functions
+ *
+ * The calibrator is switched through a GPIO line. CALCTRL selects how:
+ * the legacy sysfs interface (/sys/class/gpio/gpioN/value), a line
+ * requested from a GPIO character device (/dev/gpiochipN), or an
+ * in-process mock for running without the hardware. Every switch is
+ * timestamped, so that the recorder knows when the cal tone came on.
  */
 
 #ifndef _CALCONTROL_H
 #define _CALCONTROL_H
 
-#include <stdio.h>
+#include <stdint.h>
+#include "config.h"
 
-FILE *init_cal_control(void);
-void set_cal_state(FILE *fp, int state);
+/* Backends, selected with CALCTRL */
 
+#define CAL_SYSFS 0 /* /sys/class/gpio (default) */
+#define CAL_GPIOCHIP 1 /* GPIO character device line request */
+#define CAL_MOCK 2 /* no hardware */
+#define NUM_CAL_BACKENDS 3
 
-#endif /* _CALCONTROL_H */
+/* A switch of the calibrator. The line is known to be in its new state
+   from t_mono (t_real) on: both are taken when the backend's call
+   returned, and latency is how long that call took. */
+
+struct cal_event {
+  int state;
+  int64_t t_mono; /* CLOCK_MONOTONIC ns */
+  int64_t t_real; /* CLOCK_REALTIME ns */
+  int64_t latency; /* ns */
+};
 
+int cal_backend_id(const char *name);
+int init_cal_control(const struct ozone_config *cfg);
+int set_cal_state(int state, struct cal_event *ev);
+int cal_state(void);
+void close_cal_control(void);
+
+#endif /* _CALCONTROL_H */
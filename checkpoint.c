@@ -0,0 +1,306 @@
+/*
+ * Checkpoints of the cycle in progress
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "crc32c.h"
+#include "timeutil.h"
+
+#define CKPT_MAGIC 0x504b435a /* "ZCKP" */
+#define CKPT_VERSION 1
+#define CKPT_PAGE 4096 /* slots start on a page of their own */
+
+struct ckpt_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fft_len;
+  uint32_t num_channels;
+  uint32_t slot_size;
+  uint32_t state_size;
+};
+
+struct ckpt_slot {
+  uint64_t generation; /* 0 while the slot is being written */
+  uint32_t crc; /* CRC-32C from in_progress on, with st if in_progress */
+  uint32_t in_progress; /* 0 once the cycle has been recorded */
+  uint32_t config_hash;
+  int32_t channel;
+  char dongle_sn[MAX_SN_LEN];
+  int64_t t_real; /* when written, ns */
+  int64_t t_mono;
+  struct ckpt_state st;
+};
+
+#define SLOT_SIZE \
+  ((sizeof(struct ckpt_slot) + CKPT_PAGE - 1) / CKPT_PAGE * CKPT_PAGE)
+#define FILE_SIZE(n) (CKPT_PAGE + 2 * (size_t)(n) * SLOT_SIZE)
+
+static uint8_t *file = NULL;
+static size_t file_size;
+static int num_channels;
+static uint32_t hash;
+static uint64_t *generation; /* latest per channel */
+static const char (*dongle_sns)[MAX_SN_LEN];
+
+static struct ckpt_slot *slot(int channel, int k)
+{
+  return (struct ckpt_slot *)&file[CKPT_PAGE
+				   + (2 * channel + k) * SLOT_SIZE];
+}
+
+/* The settings an integration in progress depends on: the cycle shape
+   and schedule, and what is integrated */
+
+static uint32_t config_hash(const struct ozone_config *cfg)
+{
+  uint32_t h;
+
+  h = crc32c(0, &cfg->shape, sizeof(cfg->shape));
+  h = crc32c(h, &cfg->line_freq, sizeof(cfg->line_freq));
+  h = crc32c(h, &cfg->sk_mode, sizeof(cfg->sk_mode));
+  h = crc32c(h, &cfg->sk_sigma, sizeof(cfg->sk_sigma));
+  h = crc32c(h, &cfg->num_hires, sizeof(cfg->num_hires));
+  h = crc32c(h, cfg->hires, cfg->num_hires * sizeof(cfg->hires[0]));
+  h = crc32c(h, &cfg->num_targets, sizeof(cfg->num_targets));
+  h = crc32c(h, cfg->targets, cfg->num_targets * sizeof(cfg->targets[0]));
+
+  return h;
+}
+
+static uint32_t slot_crc(const struct ckpt_slot *s)
+{
+  size_t from = offsetof(struct ckpt_slot, in_progress);
+  size_t to = s->in_progress ? sizeof(*s) : offsetof(struct ckpt_slot, st);
+
+  return crc32c(0, (const uint8_t *)s + from, to - from);
+}
+
+static int slot_ok(const struct ckpt_slot *s, int channel)
+{
+  return (s->generation != 0) && (slot_crc(s) == s->crc)
+    && (s->channel == channel);
+}
+
+/* Map the checkpoint file in DATADIR, starting it afresh if it was
+   made for other channels or by another version. Returns 0 on success;
+   without one, recording carries on without checkpoints. */
+
+int ckpt_init(const struct ozone_config *cfg)
+{
+  char path[_POSIX_PATH_MAX];
+  struct ckpt_header *h;
+  struct stat st;
+  int fd, fresh;
+
+  if (cfg->ckpt_interval <= 0)
+    return 0;
+
+  num_channels = cfg->num_channels;
+  dongle_sns = (const char (*)[MAX_SN_LEN])cfg->dongle_sns;
+  hash = config_hash(cfg);
+  file_size = FILE_SIZE(num_channels);
+
+  generation = calloc(num_channels, sizeof(*generation));
+  if (generation == NULL)
+    return 1;
+
+  if (snprintf(path, sizeof(path), "%s/%s", cfg->data_dir, CKPT_FILE)
+      >= (int)sizeof(path)) {
+    fprintf(stderr, "Checkpoint file path too long in %s\n", cfg->data_dir);
+    return 1;
+  }
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if ((fd < 0) || (fstat(fd, &st) != 0)) {
+    fprintf(stderr, "Cannot open checkpoint file %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+
+  fresh = st.st_size != (off_t)file_size;
+  if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, file_size) != 0)) {
+    fprintf(stderr, "Cannot size checkpoint file %s\n", path);
+    close(fd);
+    return 1;
+  }
+
+  file = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    file = NULL;
+    perror("ckpt_init: mmap");
+    return 1;
+  }
+
+  h = (struct ckpt_header *)file;
+  if ((h->magic != CKPT_MAGIC) || (h->version != CKPT_VERSION)
+      || (h->fft_len != FFT_LEN) || (h->num_channels != num_channels)
+      || (h->slot_size != SLOT_SIZE)
+      || (h->state_size != sizeof(struct ckpt_state))) {
+    memset(file, 0, file_size);
+    h->version = CKPT_VERSION;
+    h->fft_len = FFT_LEN;
+    h->num_channels = num_channels;
+    h->slot_size = SLOT_SIZE;
+    h->state_size = sizeof(struct ckpt_state);
+    h->magic = CKPT_MAGIC;
+    fresh = 1;
+  }
+
+  for (int n = 0; n < num_channels; n++)
+    for (int k = 0; k < 2; k++)
+      if (slot_ok(slot(n, k), n) && (slot(n, k)->generation > generation[n]))
+	generation[n] = slot(n, k)->generation;
+
+  fprintf(stderr, "Checkpoints every %d s in %s%s\n", cfg->ckpt_interval,
+	  path, fresh ? " (new)" : "");
+
+  return 0;
+}
+
+/* The latest good slot of a channel, or NULL */
+
+static const struct ckpt_slot *latest(int channel)
+{
+  const struct ckpt_slot *a = slot(channel, 0), *b = slot(channel, 1);
+
+  if (!slot_ok(a, channel))
+    a = NULL;
+  if (!slot_ok(b, channel))
+    b = NULL;
+  if ((a == NULL) || ((b != NULL) && (b->generation > a->generation)))
+    return b;
+  return a;
+}
+
+/* Pick up the cycle in progress when the process stopped. Only if every
+   channel has a checkpoint of the same cycle, recent enough and taken
+   with the same settings and dongle, is it resumed; states[] then gets
+   a copy of each (to be freed by the caller) and time_stamp that of
+   the cycle. Returns 1 if the cycle is to be resumed. */
+
+int ckpt_resume(const struct ozone_config *cfg, struct ckpt_state **states,
+		uint64_t *time_stamp)
+{
+  int64_t now = clock_ns(CLOCK_REALTIME), mono = clock_ns(CLOCK_MONOTONIC);
+  const char *why = NULL;
+  int n;
+
+  for (n = 0; n < num_channels; n++)
+    states[n] = NULL;
+
+  if (file == NULL)
+    return 0;
+
+  for (n = 0; (n < num_channels) && (why == NULL); n++) {
+    const struct ckpt_slot *s = latest(n);
+
+    if ((s == NULL) || !s->in_progress)
+      why = "no cycle in progress";
+    else if (s->config_hash != hash)
+      why = "configuration changed";
+    else if (strncmp(s->dongle_sn, dongle_sns[n], MAX_SN_LEN) != 0)
+      why = "dongles changed";
+    else if ((now - s->t_real > cfg->ckpt_max_age * 1000000000LL)
+	     || (s->t_real > now) || (s->t_mono > mono))
+      why = "too old";
+    else if ((n > 0) && (s->st.time_stamp != *time_stamp))
+      why = "channels in different cycles";
+    else
+      *time_stamp = s->st.time_stamp;
+  }
+
+  if (why != NULL) {
+    if (strcmp(why, "no cycle in progress") != 0)
+      fprintf(stderr, "Checkpoint not resumed: %s\n", why);
+    return 0;
+  }
+
+  for (n = 0; n < num_channels; n++) {
+    states[n] = malloc(sizeof(struct ckpt_state));
+    if (states[n] == NULL) {
+      while (n-- > 0) {
+	free(states[n]);
+	states[n] = NULL;
+      }
+      return 0;
+    }
+    memcpy(states[n], &latest(n)->st, sizeof(struct ckpt_state));
+  }
+
+  fprintf(stderr, "Resuming cycle %llu from checkpoints %.1f s old\n",
+	  (unsigned long long)*time_stamp,
+	  (now - latest(0)->t_real) * 1.0E-9);
+
+  return 1;
+}
+
+/* The older slot, emptied, for the channel's recorder thread to fill
+   in and commit. NULL without checkpoints. */
+
+struct ckpt_state *ckpt_begin(int channel)
+{
+  struct ckpt_slot *s;
+
+  if (file == NULL)
+    return NULL;
+
+  s = slot(channel, generation[channel] % 2);
+  __atomic_store_n(&s->generation, 0, __ATOMIC_RELEASE);
+
+  return &s->st;
+}
+
+static void commit(int channel, struct ckpt_slot *s, int in_progress)
+{
+  s->in_progress = in_progress;
+  s->config_hash = hash;
+  s->channel = channel;
+  memcpy(s->dongle_sn, dongle_sns[channel], MAX_SN_LEN);
+  s->t_real = clock_ns(CLOCK_REALTIME);
+  s->t_mono = clock_ns(CLOCK_MONOTONIC);
+  s->crc = slot_crc(s);
+
+  /* Slot k holds the generations k + 1, k + 3, ... */
+
+  generation[channel]++;
+  __atomic_store_n(&s->generation, generation[channel], __ATOMIC_RELEASE);
+}
+
+/* Make the slot filled in since ckpt_begin() the latest */
+
+void ckpt_commit(int channel)
+{
+  if (file != NULL)
+    commit(channel, slot(channel, generation[channel] % 2), 1);
+}
+
+/* The cycle has been recorded: nothing to resume */
+
+void ckpt_done(int channel)
+{
+  struct ckpt_slot *s;
+
+  if (file == NULL)
+    return;
+
+  s = slot(channel, generation[channel] % 2);
+  __atomic_store_n(&s->generation, 0, __ATOMIC_RELEASE);
+  commit(channel, s, 0);
+}
+
+void ckpt_close(void)
+{
+  if (file != NULL)
+    munmap(file, file_size);
+  file = NULL;
+}
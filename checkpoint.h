@@ -0,0 +1,57 @@
+/*
+ * Checkpoints of the cycle in progress
+ *
+ * With CHECKPOINT set, each recorder thread copies its channel's
+ * integration so far (the cycle's accumulator, cal spectrum, frequency
+ * track and the dwell reached) into a memory-mapped file in DATADIR
+ * at the end of a dwell, at most every CHECKPOINT seconds. Each
+ * channel has two slots, written in turn: a slot's generation is
+ * cleared while it is written and set, one above the other slot's,
+ * once its CRC is in place, so a crash part way through leaves the
+ * other slot good. A completed cycle is marked as such.
+ *
+ * On startup, if every channel has a checkpoint of the same cycle no
+ * older than CHECKPOINTAGE seconds, taken with the same cycle shape,
+ * schedule and integration settings, the first cycle resumes each
+ * channel's integration from the next dwell instead of starting again.
+ */
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdint.h>
+#include "common.h"
+#include "config.h"
+#include "ozofile.h"
+#include "compthread.h"
+#include "freqtrack.h"
+
+#define CKPT_FILE "ozonespec.ckpt"
+
+/* What a recorder thread needs to carry on with a cycle */
+
+struct ckpt_state {
+  uint64_t time_stamp; /* of the cycle */
+  int32_t next_dwell; /* the first not yet recorded */
+  int32_t cal; /* the cycle has a cal */
+  int32_t cal_taken; /* ... already fed to the track */
+  double t_cal; /* CLOCK_MONOTONIC seconds */
+  double t_sig0;
+  uint32_t tuned_freq[2];
+  uint32_t target_tuned[MAX_TARGETS][2];
+  struct ozo_timing rt;
+  struct ozo_cal cb;
+  struct freq_track ftrack;
+  float cal_spec[FFT_LEN];
+  struct cycle_accum accum;
+};
+
+int ckpt_init(const struct ozone_config *cfg);
+int ckpt_resume(const struct ozone_config *cfg, struct ckpt_state **states,
+		uint64_t *time_stamp);
+struct ckpt_state *ckpt_begin(int channel);
+void ckpt_commit(int channel);
+void ckpt_done(int channel);
+void ckpt_close(void);
+
+#endif /* _CHECKPOINT_H */
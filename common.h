@@ -12,7 +12,8 @@
 
 #define MAX_SN_LEN 16
 
-#define MAX_NUM_CHANNELS 8
+#define CALFREQ 1320000000 /* actual calibrator frequency */
+#define CALRXFREQ CALFREQ
 
 /* Realtime scheduling priorities */
 
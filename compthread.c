@@ -3,31 +3,160 @@
  */
 
 #include <pthread.h>
-#include <fftw3.h>
 #include <stdio.h>
 #include "compthread.h"
 #include "signalproc.h"
 #include "common.h"
+#include "timeutil.h"
 #include <string.h>
 
+#define SK_BLOCK_FRACTION 0.1 /* flag a whole block above this fraction of bins */
+
+/* A signal block is complete: flag RFI in it, then integrate it */
+
+static void finish_block(struct comp_thread_context *ctx, int n)
+{
+  struct cycle_accum *a = ctx->accum;
+  const struct ozone_config *cfg = ctx->cfg;
+  int nspec = a->block_nspec;
+  int block_flagged = 0;
+
+  if (cfg->sk_mode != SK_OFF) {
+    int nflag = sk_flag(a->block_spec, a->block_sq, nspec, cfg->sk_sigma,
+			a->sk_flags);
+    a->sk.blocks[n]++;
+    if (nflag > SK_BLOCK_FRACTION * FFT_LEN) {
+      a->sk.blocks_flagged[n]++;
+      block_flagged = 1;
+    }
+  } else
+    memset(a->sk_flags, 0, sizeof(a->sk_flags));
+
+  if (!block_flagged || (cfg->sk_mode != SK_EXCISE)) {
+    for (int r = 0; r < ctx->num_hires; r++) {
+      struct hires_accum *h = &a->hires[r];
+      int len = ctx->hires_fft[r]->len;
+
+      h->spec_int[n] += h->block_nspec;
+      for (int k = 0; k < len; k++)
+	h->spec[n * len + k] += h->block_spec[k];
+    }
+
+    a->spec_int[n] += nspec;
+    for (int k = 0; k < FFT_LEN; k++) {
+      if (a->sk_flags[k]) {
+	a->sk.frames_flagged[n][k] += nspec;
+	if (cfg->sk_mode == SK_EXCISE)
+	  continue;
+      }
+      a->spec[n * FFT_LEN + k] += a->block_spec[k];
+    }
+  }
+
+  memset(a->block_spec, 0, sizeof(a->block_spec));
+  memset(a->block_sq, 0, sizeof(a->block_sq));
+  a->block_nspec = 0;
+
+  for (int r = 0; r < ctx->num_hires; r++) {
+    memset(a->hires[r].block_spec, 0,
+	   ctx->hires_fft[r]->len * sizeof(float));
+    a->hires[r].block_nspec = 0;
+  }
+}
+
+/* (Re)start the pool of threads sharing each chunk's spectra */
+
+static void start_pool(struct comp_thread_context *ctx)
+{
+  spec_pool_free(&ctx->pool);
+  spec_pool_init(&ctx->pool, ctx->cfg->spec_threads);
+  ctx->spec_threads = ctx->cfg->spec_threads;
+}
+
+/* Add a chunk's spectra to the block in progress and its level
+   statistics to the cycle's. The higher resolutions are added to the
+   block directly. */
+
+static void process_chunk(struct comp_thread_context *ctx, int idx)
+{
+  struct cycle_accum *a = ctx->accum;
+  struct spec_res res[MAX_HIRES];
+  int nspec, t, sb;
+
+  /* SPECTHREADS may have changed with the configuration */
+
+  if (ctx->cfg->spec_threads != ctx->spec_threads)
+    start_pool(ctx);
+
+  /* The cal is only used to find the frequency error, which the
+     recorder picks up for its next retune */
+
+  if (ctx->chunk_flags[idx] & CHUNK_CAL) {
+    spec_pool_spectra(&ctx->pool, &ctx->data_buf[idx * ctx->chunk_size],
+		      ctx->chunk_len[idx], ctx->cal_spec, NULL, NULL,
+		      ctx->fft_win, ctx->fft, ctx->fftin, ctx->fftout, NULL,
+		      NULL, 0);
+    a->freq_err = find_freq_error(ctx->cal_spec, SAMPLERATE, CALRXFREQ,
+				  CALFREQ);
+    __atomic_store_n(&a->cal_done, 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  /* An extra target's chunk is simply added to its spectrum */
+
+  t = CHUNK_TARGET_OF(ctx->chunk_flags[idx]);
+  if (t >= 0) {
+    sb = (ctx->chunk_flags[idx] & CHUNK_LOWER) ? 1 : 0;
+    spec_pool_spectra(&ctx->pool, &ctx->data_buf[idx * ctx->chunk_size],
+		      ctx->chunk_len[idx], a->chunk_spec, NULL, &nspec, NULL,
+		      ctx->fft, ctx->fftin, ctx->fftout, NULL, NULL, 0);
+    for (int k = 0; k < FFT_LEN; k++)
+      a->target_spec[t][sb * FFT_LEN + k] += a->chunk_spec[k];
+    a->target_int[t][sb] += nspec;
+    return;
+  }
+
+  for (int r = 0; r < ctx->num_hires; r++) {
+    res[r].fft = ctx->hires_fft[r];
+    res[r].spec = a->hires[r].block_spec;
+    res[r].num_spec = 0;
+  }
+
+  spec_pool_spectra(&ctx->pool, &ctx->data_buf[idx * ctx->chunk_size],
+		    ctx->chunk_len[idx], a->chunk_spec, a->chunk_sq, &nspec,
+		    NULL, ctx->fft, ctx->fftin, ctx->fftout, &a->chunk_stats,
+		    res, ctx->num_hires);
+
+  for (int r = 0; r < ctx->num_hires; r++)
+    a->hires[r].block_nspec += res[r].num_spec;
+
+  for (int k = 0; k < FFT_LEN; k++) {
+    a->block_spec[k] += a->chunk_spec[k];
+    a->block_sq[k] += a->chunk_sq[k];
+  }
+  a->block_nspec += nspec;
+
+  for (int k = 0; k < 256; k++) {
+    a->stats.hist_i[k] += a->chunk_stats.hist_i[k];
+    a->stats.hist_q[k] += a->chunk_stats.hist_q[k];
+  }
+
+  if (ctx->chunk_flags[idx] & CHUNK_END_BLOCK)
+    finish_block(ctx, (ctx->chunk_flags[idx] & CHUNK_LOWER) ? 1 : 0);
+}
+
 void *comp_thread(void *ptarg)
 {
-  fftwf_plan cfplan;
-  fftwf_complex *cfftin, *cfftout;
-  int r, in_queue_out_ptr = 0, out_queue_in_ptr = 0;
+  int r, in_queue_out_ptr = 0;
+  struct timespec t0;
   struct comp_thread_context *ctx;
 
   ctx = (struct comp_thread_context *)ptarg;
 
   fprintf(stderr, "  comp_thread: computation thread alive\n");
 
-  cfplan = init_fft(&cfftin, &cfftout);
-  if (cfplan == NULL) {
-    fprintf(stderr, "  comp_thread: failed to initialise FFT\n");
-    return NULL;
-  }
-
-
+  spec_pool_init(&ctx->pool, ctx->cfg->spec_threads);
+  ctx->spec_threads = ctx->cfg->spec_threads;
 
   while (1) {
 
@@ -39,8 +168,7 @@ void *comp_thread(void *ptarg)
       return NULL;
     }
 
-    while (*(ctx->in_queue_len_p) == 0) {
-      fprintf(stderr, "  comp_thread: waiting for data\n");
+    while ((*(ctx->in_queue_len_p) == 0) && !ctx->quit) {
       r = pthread_cond_wait(ctx->in_queue_cond_p, ctx->in_queue_mutex_p);
       if (r != 0) {
 	fprintf(stderr, "  comp_thread: pthread_cond_wait: %s\n", strerror(r));
@@ -54,23 +182,21 @@ void *comp_thread(void *ptarg)
       return NULL;
     }
 
-    /* Process a block of signal */
+    if (ctx->quit)
+      break;
+
+    /* Process a chunk of signal */
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
-    fprintf(stderr, "  comp_thread: calculating spectrum (%d)\n", 
-	    in_queue_out_ptr);
+    process_chunk(ctx, in_queue_out_ptr);
 
-    calc_spectrum(&ctx->data_buf[in_queue_out_ptr * ctx->sig_size],
-		  ctx->data_buf_sig_len[in_queue_out_ptr],
-		  &ctx->sig_spec_buf[out_queue_in_ptr * FFT_LEN],
-		  &ctx->sig_spec_int[out_queue_in_ptr], NULL,
-		  cfplan, cfftin, cfftout);
+    ctx->busy_time += time_since(&t0);
 
     in_queue_out_ptr = (in_queue_out_ptr + 1) % ctx->max_in_queue_len;
-    out_queue_in_ptr = (out_queue_in_ptr + 1) % (ctx->num_sig_spec * 2);
 
-    /* Indicate that data has been removed from input queue and
-       added to output queue
-    */
+    /* Indicate that the chunk has been integrated and its slot is
+       free again */
 
     r = pthread_mutex_lock(ctx->in_queue_mutex_p);
     if (r != 0) {
@@ -92,31 +218,11 @@ void *comp_thread(void *ptarg)
       return NULL;
     }
 
-    r = pthread_mutex_lock(ctx->out_queue_mutex_p);
-    if (r != 0) {
-      fprintf(stderr, "  comp_thread: pthread_mutex_lock: %s\n", strerror(r));
-      return NULL;
-    }
-
-    (*(ctx->out_queue_len))++;
-
-    r = pthread_mutex_unlock(ctx->out_queue_mutex_p);
-    if (r != 0) {
-      fprintf(stderr, "  comp_thread: pthread_mutex_unlock: %s\n", strerror(r));
-      return NULL;
-    }
-
-    r = pthread_cond_signal(ctx->out_queue_cond_p);
-    if (r != 0) {
-      fprintf(stderr, "pthread_cond_signal: %s\n", strerror(r));
-      return NULL;
-    }
-
   }
 
-  fftwf_free(cfftin);
-  fftwf_free(cfftout);
-  fftwf_destroy_plan(cfplan);
+  spec_pool_free(&ctx->pool);
+
+  fprintf(stderr, "  comp_thread: exiting\n");
 
   return NULL;
 
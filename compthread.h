@@ -7,6 +7,60 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include "signalproc.h"
+#include "config.h"
+#include "ozofile.h"
+#include "specpool.h"
+
+/* Chunk flags */
+
+#define CHUNK_LOWER 1 /* below-line sideband */
+#define CHUNK_END_BLOCK 2 /* last chunk of a signal block */
+#define CHUNK_CAL 4 /* the cycle's cal, for the frequency error only */
+
+/* Chunks of an extra target's dwell carry its index; 0 is the line */
+
+#define CHUNK_TARGET_SHIFT 4
+#define CHUNK_TARGET(t) (((t) + 1) << CHUNK_TARGET_SHIFT)
+#define CHUNK_TARGET_OF(f) (((f) >> CHUNK_TARGET_SHIFT) - 1)
+
+/* A higher resolution's integration, without SK beyond whole blocks */
+
+struct hires_accum {
+  float spec[2 * MAX_HIRES_LEN]; /* integrated power, per sideband */
+  int spec_int[2];
+  float block_spec[MAX_HIRES_LEN]; /* the signal block in progress */
+  int block_nspec;
+};
+
+/* A cycle's results, integrated one chunk (read) at a time. The
+   recorder clears it between cycles, while the computational thread
+   is idle. */
+
+struct cycle_accum {
+  float spec[2 * FFT_LEN]; /* integrated power, per sideband */
+  int spec_int[2]; /* frames integrated */
+  struct sig_stats stats; /* level statistics over every chunk */
+  struct ozo_sk sk; /* RFI flag counts */
+  struct hires_accum hires[MAX_HIRES];
+  /* extra targets, integrated without SK or level statistics */
+  float target_spec[MAX_TARGETS][2 * FFT_LEN];
+  int target_int[MAX_TARGETS][2];
+
+  double freq_err; /* from the cal chunk */
+  int cal_done; /* set (release) once freq_err is valid */
+
+  /* the signal block in progress, for spectral kurtosis */
+  float block_spec[FFT_LEN];
+  float block_sq[FFT_LEN];
+  int block_nspec;
+
+  /* scratch for one chunk */
+  float chunk_spec[FFT_LEN];
+  float chunk_sq[FFT_LEN];
+  struct sig_stats chunk_stats;
+  uint8_t sk_flags[FFT_LEN];
+};
 
 struct comp_thread_context {
 
@@ -14,20 +68,35 @@ struct comp_thread_context {
   pthread_mutex_t *in_queue_mutex_p;
   pthread_cond_t *in_queue_cond_p;
   int *in_queue_len_p;
-  pthread_mutex_t *out_queue_mutex_p;
-  pthread_cond_t *out_queue_cond_p;
-  int *out_queue_len;
 
-  /* input data buffers */
+  /* input queue: a ring of chunks */
   int max_in_queue_len;
-  int sig_size;
+  int chunk_size;
   uint8_t *data_buf;
-  int *data_buf_sig_len;
+  int *chunk_len;
+  int *chunk_flags;
+
+  /* output */
+  struct cycle_accum *accum;
+  float *cal_spec; /* spectrum of the cal chunk */
+  const float *fft_win; /* window for the cal spectrum */
 
-  /* output data buffers */
-  int num_sig_spec;
-  float *sig_spec_buf;
-  int *sig_spec_int;
+  /* set by the recorder each cycle */
+  const struct ozone_config *cfg; /* snapshot in use (SK settings) */
+  const struct fft_backend *fft; /* shared */
+  const struct fft_backend *hires_fft[MAX_HIRES];
+  int num_hires;
+
+  /* this thread's FFT buffers, of MAX_HIRES_LEN points */
+  fft_complex *fftin;
+  fft_complex *fftout;
+
+  /* threads sharing each chunk, SPECTHREADS in all */
+  struct spec_pool pool;
+  int spec_threads; /* as configured when the pool was started */
+
+  double busy_time; /* seconds spent computing, reset by the recorder */
+  int quit; /* set (under in_queue_mutex) to stop the thread */
 
 };
 
@@ -35,4 +104,3 @@ struct comp_thread_context {
 void *comp_thread(void *ptarg);
 
 #endif /* _COMPTHREAD_H */
-
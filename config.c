@@ -5,101 +5,688 @@
 #include <limits.h>
 #include "config.h"
 #include "common.h"
+#include "fftbackend.h"
+#include "calcontrol.h"
 
 #define CONF_FILE "ozonespec.conf"
 #define BUF_LEN 128
 #define WATCHDOG_TIMEOUT 180
+#define DONGLE_TIMEOUT 10
+#define MIN_DONGLE_TIMEOUT 2
+#define READ_SIZE (16384 * 256)
+#define NUM_BLOCKS 4
+#define NUM_SIG_SPEC 8
+#define MAX_IN_QUEUE_LEN 3
+#define USB_BLOCK 512 /* reads must be a multiple of this */
+#define MAX_BUF_MB 64
+#define MAX_CYCLE_TIME 120
+#define SK_MODE SK_FLAG
+#define SK_SIGMA 4.0
+#define ARCHIVE_KBPS 2048
+#define HIRES_BINS 256
+#define CAL_MAX_SIGMA 100.0
+#define CAL_GPIO 60
+#define CAL_CHIP "/dev/gpiochip1" /* GPIO 60 is line 28 of the second bank */
+#define CAL_LINE 28
+#define MAX_CAL_SETTLE_MS 1000
+#define CKPT_MAX_AGE 120
+#define EXPORT_BATCH 60
+#define EXPORT_SPOOL_MB 256
 #define LINEFREQ 1322454500 /* actual line frequency */
 //#define LINEFREQ 1322754500 /* line + 300 kHz for testing */
 //#define LINEFREQ CALFREQ
 
-char dongle_sns[MAX_NUM_CHANNELS][MAX_SN_LEN];
-int num_channels = 0;
-int vsrt_num = 0;
-char data_dir[_POSIX_PATH_MAX] = ".";
-char station_name[MAX_STATION_NAME] = "Test";
-int watchdog_timeout = WATCHDOG_TIMEOUT;
-int keep_cal_on = 0;
-double line_freq = LINEFREQ;
+/* Current snapshot, published with an atomic store. Old snapshots are
+   kept on a list until no reader can still be using them. Only the
+   main thread publishes and reclaims. */
 
-void parse_config(char *key, char *val)
+static struct ozone_config *current_config = NULL;
+static struct ozone_config *retired_configs = NULL;
+static char config_file[_POSIX_PATH_MAX];
+
+static void set_defaults(struct ozone_config *cfg)
+{
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->num_channels = 0;
+  cfg->vsrt_num = 0;
+  strcpy(cfg->data_dir, ".");
+  strcpy(cfg->station_name, "Test");
+  cfg->watchdog_timeout = WATCHDOG_TIMEOUT;
+  cfg->dongle_timeout = DONGLE_TIMEOUT;
+  cfg->keep_cal_on = 0;
+  cfg->cal_every = 1;
+  cfg->cal_max_sigma = CAL_MAX_SIGMA;
+  cfg->cal_backend = CAL_SYSFS;
+  cfg->cal_gpio = CAL_GPIO;
+  strcpy(cfg->cal_chip, CAL_CHIP);
+  cfg->cal_line = CAL_LINE;
+  cfg->cal_settle_ms = 0;
+  cfg->line_freq = LINEFREQ;
+  cfg->shape.read_size = READ_SIZE;
+  cfg->shape.num_blocks = NUM_BLOCKS;
+  cfg->shape.num_sig_spec = NUM_SIG_SPEC;
+  cfg->shape.in_queue_len = MAX_IN_QUEUE_LEN;
+  cfg->autotune = 0;
+  cfg->max_buf_mb = MAX_BUF_MB;
+  cfg->max_cycle_time = MAX_CYCLE_TIME;
+  cfg->sk_mode = SK_MODE;
+  cfg->sk_sigma = SK_SIGMA;
+  cfg->spec_threads = 1;
+  cfg->fft_backend = FFT_FFTW;
+  cfg->fold_out = 0;
+  cfg->num_hires = 0;
+  cfg->hires_bins = HIRES_BINS;
+  cfg->compress_after = 0;
+  cfg->retain_days = 0;
+  cfg->retain_mb = 0;
+  cfg->archive_kbps = ARCHIVE_KBPS;
+  cfg->ckpt_interval = 0;
+  cfg->ckpt_max_age = CKPT_MAX_AGE;
+  cfg->export_host[0] = '\0';
+  strcpy(cfg->export_port, "4455");
+  cfg->export_batch = EXPORT_BATCH;
+  cfg->export_compress = 0;
+  cfg->export_spool_mb = EXPORT_SPOOL_MB;
+}
+
+void parse_config(struct ozone_config *cfg, char *key, char *val)
 {
 
   if (strcmp(key, "DONGLE") == 0) {
-    if (num_channels < MAX_NUM_CHANNELS) {
-      strncpy(&dongle_sns[num_channels][0], val, MAX_SN_LEN);
-      num_channels++;
+    char (*sns)[MAX_SN_LEN];
+
+    sns = realloc(cfg->dongle_sns, (cfg->num_channels + 1) * MAX_SN_LEN);
+    if (sns != NULL) {
+      cfg->dongle_sns = sns;
+      memset(sns[cfg->num_channels], 0, MAX_SN_LEN);
+      strncpy(sns[cfg->num_channels], val, MAX_SN_LEN - 1);
+      cfg->num_channels++;
     }
     else {
-      fprintf(stderr, "Too many channels defined!\n");
+      fprintf(stderr, "Cannot allocate channel %s!\n", val);
     }
 
   }
   else if (strcmp(key, "VSRTNUM") == 0) {
-    vsrt_num = atoi(val);
+    cfg->vsrt_num = atoi(val);
   }
   else if (strcmp(key, "DATADIR") == 0) {
-    strncpy(data_dir, val, _POSIX_PATH_MAX);
+    strncpy(cfg->data_dir, val, _POSIX_PATH_MAX);
   }
   else if (strcmp(key, "STATNAME") == 0) {
     if (strlen(val) > 12)
       fprintf(stderr, "Warning: station name > 12 characters\n");
-    strncpy(station_name, val, MAX_STATION_NAME);
+    strncpy(cfg->station_name, val, MAX_STATION_NAME);
   }
   else if (strcmp(key, "WATCHDOGTIME") == 0) {
-    watchdog_timeout = atoi(val);
-    if (watchdog_timeout < WATCHDOG_TIMEOUT) {
+    cfg->watchdog_timeout = atoi(val);
+    if (cfg->watchdog_timeout < WATCHDOG_TIMEOUT) {
       fprintf(stderr, "Watchdog time-out (%d) too short, setting to minimum (%d)\n",
-	      watchdog_timeout, WATCHDOG_TIMEOUT);
-      watchdog_timeout = WATCHDOG_TIMEOUT;
+	      cfg->watchdog_timeout, WATCHDOG_TIMEOUT);
+      cfg->watchdog_timeout = WATCHDOG_TIMEOUT;
+    }
+  }
+  else if (strcmp(key, "DONGLETIMEOUT") == 0) {
+    cfg->dongle_timeout = atoi(val);
+    if (cfg->dongle_timeout < MIN_DONGLE_TIMEOUT) {
+      fprintf(stderr, "Dongle time-out (%d) too short, setting to minimum (%d)\n",
+	      cfg->dongle_timeout, MIN_DONGLE_TIMEOUT);
+      cfg->dongle_timeout = MIN_DONGLE_TIMEOUT;
     }
   }
   else if (strcmp(key, "VCALSTAYON") == 0) {
-    keep_cal_on = atoi(val);
-    if ((keep_cal_on != 0) && (keep_cal_on != 1)) {
+    cfg->keep_cal_on = atoi(val);
+    if ((cfg->keep_cal_on != 0) && (cfg->keep_cal_on != 1)) {
       fprintf(stderr, "VCALSTAYON must be 0 or 1. Setting to 0.\n");
-      keep_cal_on = 0;
+      cfg->keep_cal_on = 0;
+    }
+  }
+  else if (strcmp(key, "CALEVERY") == 0) {
+    cfg->cal_every = atoi(val);
+    if (cfg->cal_every < 1) {
+      fprintf(stderr, "CALEVERY must be at least 1. Setting to 1.\n");
+      cfg->cal_every = 1;
+    }
+  }
+  else if (strcmp(key, "CALMAXSIGMA") == 0) {
+    cfg->cal_max_sigma = atof(val);
+    if (cfg->cal_max_sigma <= 0) {
+      fprintf(stderr, "CALMAXSIGMA must be positive. Setting to default.\n");
+      cfg->cal_max_sigma = CAL_MAX_SIGMA;
+    }
+  }
+  else if (strcmp(key, "CALCTRL") == 0) {
+    cfg->cal_backend = cal_backend_id(val);
+    if (cfg->cal_backend < 0) {
+      fprintf(stderr, "Unknown CALCTRL %s. Using sysfs.\n", val);
+      cfg->cal_backend = CAL_SYSFS;
+    }
+  }
+  else if (strcmp(key, "CALGPIO") == 0) {
+    cfg->cal_gpio = atoi(val);
+  }
+  else if (strcmp(key, "CALCHIP") == 0) {
+    strncpy(cfg->cal_chip, val, _POSIX_PATH_MAX - 1);
+  }
+  else if (strcmp(key, "CALLINE") == 0) {
+    cfg->cal_line = atoi(val);
+  }
+  else if (strcmp(key, "CALSETTLE") == 0) {
+    cfg->cal_settle_ms = atoi(val);
+    if ((cfg->cal_settle_ms < 0) || (cfg->cal_settle_ms > MAX_CAL_SETTLE_MS)) {
+      fprintf(stderr, "CALSETTLE must be 0 to %d ms. Setting to 0.\n",
+	      MAX_CAL_SETTLE_MS);
+      cfg->cal_settle_ms = 0;
+    }
+  }
+  else if (strcmp(key, "READSIZE") == 0) {
+    cfg->shape.read_size = atoi(val);
+    if ((cfg->shape.read_size < USB_BLOCK)
+	|| (cfg->shape.read_size % USB_BLOCK != 0)) {
+      fprintf(stderr, "READSIZE must be a multiple of %d. Setting to default.\n",
+	      USB_BLOCK);
+      cfg->shape.read_size = READ_SIZE;
+    }
+    else if (cfg->shape.read_size % (2 * FFT_LEN) != 0)
+      fprintf(stderr, "Warning: READSIZE is not a multiple of FFT length\n");
+  }
+  else if (strcmp(key, "NUMBLOCKS") == 0) {
+    cfg->shape.num_blocks = atoi(val);
+    if (cfg->shape.num_blocks < 1) {
+      fprintf(stderr, "NUMBLOCKS must be at least 1. Setting to default.\n");
+      cfg->shape.num_blocks = NUM_BLOCKS;
+    }
+  }
+  else if (strcmp(key, "NUMSIGSPEC") == 0) {
+    cfg->shape.num_sig_spec = atoi(val);
+    if (cfg->shape.num_sig_spec < 1) {
+      fprintf(stderr, "NUMSIGSPEC must be at least 1. Setting to default.\n");
+      cfg->shape.num_sig_spec = NUM_SIG_SPEC;
+    }
+  }
+  else if (strcmp(key, "INQUEUELEN") == 0) {
+    cfg->shape.in_queue_len = atoi(val);
+    if (cfg->shape.in_queue_len < 2) {
+      fprintf(stderr, "INQUEUELEN must be at least 2. Setting to default.\n");
+      cfg->shape.in_queue_len = MAX_IN_QUEUE_LEN;
+    }
+  }
+  else if (strcmp(key, "AUTOTUNE") == 0) {
+    cfg->autotune = atoi(val);
+    if ((cfg->autotune != 0) && (cfg->autotune != 1)) {
+      fprintf(stderr, "AUTOTUNE must be 0 or 1. Setting to 0.\n");
+      cfg->autotune = 0;
+    }
+  }
+  else if (strcmp(key, "MAXBUFMB") == 0) {
+    cfg->max_buf_mb = atoi(val);
+    if (cfg->max_buf_mb < 1) {
+      fprintf(stderr, "MAXBUFMB must be positive. Setting to default.\n");
+      cfg->max_buf_mb = MAX_BUF_MB;
+    }
+  }
+  else if (strcmp(key, "MAXCYCLETIME") == 0) {
+    cfg->max_cycle_time = atoi(val);
+    if (cfg->max_cycle_time < 1) {
+      fprintf(stderr, "MAXCYCLETIME must be positive. Setting to default.\n");
+      cfg->max_cycle_time = MAX_CYCLE_TIME;
+    }
+  }
+  else if (strcmp(key, "SKMODE") == 0) {
+    cfg->sk_mode = atoi(val);
+    if ((cfg->sk_mode < SK_OFF) || (cfg->sk_mode > SK_EXCISE)) {
+      fprintf(stderr, "SKMODE must be 0, 1 or 2. Setting to default.\n");
+      cfg->sk_mode = SK_MODE;
+    }
+  }
+  else if (strcmp(key, "SKSIGMA") == 0) {
+    cfg->sk_sigma = atof(val);
+    if (cfg->sk_sigma <= 0) {
+      fprintf(stderr, "SKSIGMA must be positive. Setting to default.\n");
+      cfg->sk_sigma = SK_SIGMA;
+    }
+  }
+  else if (strcmp(key, "FFTBACKEND") == 0) {
+    cfg->fft_backend = fft_backend_id(val);
+    if (cfg->fft_backend < 0) {
+      fprintf(stderr, "Unknown FFTBACKEND %s. Using fftw.\n", val);
+      cfg->fft_backend = FFT_FFTW;
+    }
+  }
+  else if (strcmp(key, "SPECTHREADS") == 0) {
+    cfg->spec_threads = atoi(val);
+    if ((cfg->spec_threads < 1) || (cfg->spec_threads > MAX_SPEC_THREADS)) {
+      fprintf(stderr, "SPECTHREADS must be 1 to %d. Setting to 1.\n",
+	      MAX_SPEC_THREADS);
+      cfg->spec_threads = 1;
+    }
+  }
+  else if (strcmp(key, "CHECKPOINT") == 0) {
+    cfg->ckpt_interval = atoi(val);
+    if (cfg->ckpt_interval < 0) {
+      fprintf(stderr, "CHECKPOINT must be 0 or more seconds. Setting to 0.\n");
+      cfg->ckpt_interval = 0;
+    }
+  }
+  else if (strcmp(key, "CHECKPOINTAGE") == 0) {
+    cfg->ckpt_max_age = atoi(val);
+    if (cfg->ckpt_max_age < 1) {
+      fprintf(stderr, "CHECKPOINTAGE must be at least 1 s. Setting to %d.\n",
+	      CKPT_MAX_AGE);
+      cfg->ckpt_max_age = CKPT_MAX_AGE;
+    }
+  }
+  else if (strcmp(key, "EXPORT") == 0) {
+    char *colon = strrchr(val, ':');
+
+    if (colon != NULL) {
+      *colon = '\0';
+      strncpy(cfg->export_port, colon + 1, EXPORT_PORT_LEN - 1);
+    }
+    strncpy(cfg->export_host, val, EXPORT_HOST_LEN - 1);
+  }
+  else if (strcmp(key, "EXPORTBATCH") == 0) {
+    cfg->export_batch = atoi(val);
+    if (cfg->export_batch < 1) {
+      fprintf(stderr, "EXPORTBATCH must be at least 1 s. Setting to %d.\n",
+	      EXPORT_BATCH);
+      cfg->export_batch = EXPORT_BATCH;
+    }
+  }
+  else if (strcmp(key, "EXPORTCOMPRESS") == 0) {
+    cfg->export_compress = atoi(val);
+    if ((cfg->export_compress != 0) && (cfg->export_compress != 1)) {
+      fprintf(stderr, "EXPORTCOMPRESS must be 0 or 1. Setting to 0.\n");
+      cfg->export_compress = 0;
+    }
+  }
+  else if (strcmp(key, "EXPORTSPOOLMB") == 0) {
+    cfg->export_spool_mb = atoi(val);
+    if (cfg->export_spool_mb < 1) {
+      fprintf(stderr, "EXPORTSPOOLMB must be at least 1. Setting to %d.\n",
+	      EXPORT_SPOOL_MB);
+      cfg->export_spool_mb = EXPORT_SPOOL_MB;
+    }
+  }
+  else if (strcmp(key, "FOLDOUT") == 0) {
+    cfg->fold_out = atoi(val);
+    if ((cfg->fold_out != 0) && (cfg->fold_out != 1)) {
+      fprintf(stderr, "FOLDOUT must be 0 or 1. Setting to 0.\n");
+      cfg->fold_out = 0;
+    }
+  }
+  else if (strcmp(key, "HIRES") == 0) {
+    char *tok, *save;
+
+    cfg->num_hires = 0;
+    for (tok = strtok_r(val, ",", &save); tok != NULL;
+	 tok = strtok_r(NULL, ",", &save)) {
+      int f = atoi(tok);
+
+      if ((f < 2) || (f > MAX_HIRES_FACTOR) || ((f & (f - 1)) != 0)) {
+	fprintf(stderr, "HIRES factor %s must be a power of two from 2 to "
+		"%d. Ignored.\n", tok, MAX_HIRES_FACTOR);
+	continue;
+      }
+      if (cfg->num_hires == MAX_HIRES) {
+	fprintf(stderr, "At most %d HIRES factors. Ignoring %d.\n",
+		MAX_HIRES, f);
+	continue;
+      }
+      cfg->hires[cfg->num_hires++] = f;
+    }
+  }
+  else if (strcmp(key, "HIRESBINS") == 0) {
+    cfg->hires_bins = atoi(val);
+    if ((cfg->hires_bins < 1) || (cfg->hires_bins > MAX_HIRES_BINS)) {
+      fprintf(stderr, "HIRESBINS must be 1 to %d. Setting to default.\n",
+	      MAX_HIRES_BINS);
+      cfg->hires_bins = HIRES_BINS;
+    }
+  }
+  else if (strcmp(key, "TARGET") == 0) {
+    static const char *roles[] = { "upper", "lower", "switched", "centre" };
+    struct target t;
+    char name[BUF_LEN], role[BUF_LEN];
+    double mhz;
+
+    memset(&t, 0, sizeof(t));
+    t.role = -1;
+    if (sscanf(val, "%[^,],%lf,%[^,],%d,%d", name, &mhz, role,
+	       &t.dwell_reads, &t.reads) != 5) {
+      fprintf(stderr, "TARGET must be name,MHz,role,dwell reads,reads. "
+	      "Ignored.\n");
+      return;
+    }
+    if (strlen(name) >= MAX_TARGET_NAME) {
+      fprintf(stderr, "TARGET %s: name longer than %d characters. Ignored.\n",
+	      name, MAX_TARGET_NAME - 1);
+      return;
+    }
+    for (int k = 0; k < 4; k++)
+      if (strcmp(role, roles[k]) == 0)
+	t.role = k;
+    snprintf(t.name, sizeof(t.name), "%s", name);
+    t.freq = mhz * 1.0E6;
+
+    if (t.role < 0)
+      fprintf(stderr, "TARGET %s: role must be upper, lower, switched or "
+	      "centre. Ignored.\n", t.name);
+    else if ((t.freq <= 0) || (t.freq > 2.5E9))
+      fprintf(stderr, "TARGET %s: frequency out of range. Ignored.\n",
+	      t.name);
+    else if ((t.dwell_reads < 1) || (t.reads < 1))
+      fprintf(stderr, "TARGET %s: reads must be positive. Ignored.\n",
+	      t.name);
+    else if (cfg->num_targets == MAX_TARGETS)
+      fprintf(stderr, "At most %d TARGETs. Ignoring %s.\n", MAX_TARGETS,
+	      t.name);
+    else
+      cfg->targets[cfg->num_targets++] = t;
+  }
+  else if (strcmp(key, "COMPRESSAFTER") == 0) {
+    cfg->compress_after = atoi(val);
+    if (cfg->compress_after < 0) {
+      fprintf(stderr, "COMPRESSAFTER must not be negative. Setting to 0.\n");
+      cfg->compress_after = 0;
+    }
+  }
+  else if (strcmp(key, "RETAINDAYS") == 0) {
+    cfg->retain_days = atoi(val);
+    if (cfg->retain_days < 0) {
+      fprintf(stderr, "RETAINDAYS must not be negative. Setting to 0.\n");
+      cfg->retain_days = 0;
+    }
+  }
+  else if (strcmp(key, "RETAINMB") == 0) {
+    cfg->retain_mb = atoi(val);
+    if (cfg->retain_mb < 0) {
+      fprintf(stderr, "RETAINMB must not be negative. Setting to 0.\n");
+      cfg->retain_mb = 0;
+    }
+  }
+  else if (strcmp(key, "ARCHIVEKBPS") == 0) {
+    cfg->archive_kbps = atoi(val);
+    if (cfg->archive_kbps < 1) {
+      fprintf(stderr, "ARCHIVEKBPS must be positive. Setting to default.\n");
+      cfg->archive_kbps = ARCHIVE_KBPS;
     }
   }
   else if (strcmp(key, "FLINE") == 0) {
-    line_freq = atof(val) * 1.0E6;
-    if ((line_freq < 0) || (line_freq > 2.5E9)) {
+    cfg->line_freq = atof(val) * 1.0E6;
+    if ((cfg->line_freq < 0) || (cfg->line_freq > 2.5E9)) {
       fprintf(stderr, "Line frequency out of range. Setting to default.\n");
-      line_freq = LINEFREQ;
+      cfg->line_freq = LINEFREQ;
     }
   }
 }
 
-int read_config(char *conf_file)
+/* Parse a configuration file into a new snapshot.
+ * Returns NULL if the file cannot be read.
+ */
+
+static struct ozone_config *parse_file(char *file_name)
 {
   FILE *fp;
   char buf[BUF_LEN], key[BUF_LEN], val[BUF_LEN];
-  char *file_name;
-
-  file_name = conf_file != NULL ? conf_file : CONF_FILE;
+  struct ozone_config *cfg;
 
   fp = fopen(file_name, "r");
   if (fp == NULL) {
     fprintf(stderr, "Cannot open %s\n", file_name);
-    return 1;
+    return NULL;
+  }
+
+  cfg = malloc(sizeof(struct ozone_config));
+  if (cfg == NULL) {
+    fprintf(stderr, "Cannot allocate configuration\n");
+    fclose(fp);
+    return NULL;
   }
 
+  set_defaults(cfg);
+
   fprintf(stderr, "Reading configuration from %s\n", file_name);
 
   while (fgets(buf, BUF_LEN, fp) != NULL) {
 
      if ((buf[0] != '*') && (buf[0] != '#') && (buf[0] != '\n')) {
        if (sscanf(buf, "%s %s", key, val) >= 1)
-	 parse_config(key, val);
+	 parse_config(cfg, key, val);
        else
 	 fprintf(stderr, "Format error in %s\n", file_name);
      }
 
   }
 
-  for (int k = 0; k < num_channels; k++)
-    fprintf(stderr, "Channel %d: %s\n", k, &dongle_sns[k][0]);
-
   fclose(fp);
+  return cfg;
+}
+
+static void publish(struct ozone_config *cfg)
+{
+  struct ozone_config *old = current_config;
+
+  cfg->generation = old != NULL ? old->generation + 1 : 1;
+
+  __atomic_store_n(&current_config, cfg, __ATOMIC_RELEASE);
+
+  if (old != NULL) {
+    old->retired = retired_configs;
+    retired_configs = old;
+  }
+}
+
+int read_config(char *conf_file)
+{
+  struct ozone_config *cfg;
+
+  strncpy(config_file, conf_file != NULL ? conf_file : CONF_FILE,
+	  _POSIX_PATH_MAX - 1);
+
+  cfg = parse_file(config_file);
+  if (cfg == NULL) {
+    /* carry on with the defaults, as before */
+    cfg = malloc(sizeof(struct ozone_config));
+    if (cfg == NULL)
+      return 1;
+    set_defaults(cfg);
+    publish(cfg);
+    return 1;
+  }
+
+  for (int k = 0; k < cfg->num_channels; k++)
+    fprintf(stderr, "Channel %d: %s\n", k, &cfg->dongle_sns[k][0]);
+
+  publish(cfg);
+  return 0;
+}
+
+/* Re-read the configuration file used at startup and publish the
+ * result. Settings that can only change with a restart are reported
+ * and kept as they are. Must be called from the main thread.
+ * Returns 0 if a new snapshot was published.
+ */
+
+int reload_config(void)
+{
+  const struct ozone_config *old = current_config;
+  struct ozone_config *cfg;
+  int dongles_changed;
+
+  cfg = parse_file(config_file);
+  if (cfg == NULL) {
+    fprintf(stderr, "Configuration reload failed, keeping current settings\n");
+    return 1;
+  }
+
+  dongles_changed = cfg->num_channels != old->num_channels;
+  for (int k = 0; (k < cfg->num_channels) && !dongles_changed; k++)
+    dongles_changed = strcmp(cfg->dongle_sns[k], old->dongle_sns[k]) != 0;
+
+  if (dongles_changed)
+    fprintf(stderr, "DONGLE changes need a restart, keeping current channels\n");
+
+  /* The channel list read at startup is kept for good */
+
+  free(cfg->dongle_sns);
+  cfg->num_channels = old->num_channels;
+  cfg->dongle_sns = old->dongle_sns;
+
+  /* So is the calibrator's line */
+
+  if ((cfg->cal_backend != old->cal_backend)
+      || (cfg->cal_gpio != old->cal_gpio)
+      || (strcmp(cfg->cal_chip, old->cal_chip) != 0)
+      || (cfg->cal_line != old->cal_line))
+    fprintf(stderr, "CALCTRL changes need a restart, keeping current "
+	    "calibrator control\n");
+
+  cfg->cal_backend = old->cal_backend;
+  cfg->cal_gpio = old->cal_gpio;
+  strcpy(cfg->cal_chip, old->cal_chip);
+  cfg->cal_line = old->cal_line;
+
+  /* The checkpoint file is only set up at startup */
+
+  if ((cfg->ckpt_interval > 0) != (old->ckpt_interval > 0)) {
+    fprintf(stderr, "Turning CHECKPOINT on or off needs a restart\n");
+    cfg->ckpt_interval = old->ckpt_interval;
+  }
+
+  /* So is the export worker: the collector can change, but not whether
+     there is one */
+
+  if ((cfg->export_host[0] == '\0') != (old->export_host[0] == '\0')) {
+    fprintf(stderr, "Turning EXPORT on or off needs a restart\n");
+    strcpy(cfg->export_host, old->export_host);
+    strcpy(cfg->export_port, old->export_port);
+  }
+
+  if (cfg->line_freq != old->line_freq)
+    fprintf(stderr, "FLINE: %.6f -> %.6f MHz\n", old->line_freq * 1.0E-6,
+	    cfg->line_freq * 1.0E-6);
+  if (cfg->keep_cal_on != old->keep_cal_on)
+    fprintf(stderr, "VCALSTAYON: %d -> %d\n", old->keep_cal_on,
+	    cfg->keep_cal_on);
+  if ((cfg->cal_every != old->cal_every)
+      || (cfg->cal_max_sigma != old->cal_max_sigma))
+    fprintf(stderr, "CALEVERY/CALMAXSIGMA: %d/%.0f -> %d/%.0f\n",
+	    old->cal_every, old->cal_max_sigma, cfg->cal_every,
+	    cfg->cal_max_sigma);
+  if (cfg->cal_settle_ms != old->cal_settle_ms)
+    fprintf(stderr, "CALSETTLE: %d -> %d ms\n", old->cal_settle_ms,
+	    cfg->cal_settle_ms);
+  if (strcmp(cfg->data_dir, old->data_dir) != 0)
+    fprintf(stderr, "DATADIR: %s -> %s\n", old->data_dir, cfg->data_dir);
+  if (strcmp(cfg->station_name, old->station_name) != 0)
+    fprintf(stderr, "STATNAME: %s -> %s\n", old->station_name,
+	    cfg->station_name);
+  if (cfg->vsrt_num != old->vsrt_num)
+    fprintf(stderr, "VSRTNUM: %d -> %d\n", old->vsrt_num, cfg->vsrt_num);
+  if ((cfg->sk_mode != old->sk_mode) || (cfg->sk_sigma != old->sk_sigma))
+    fprintf(stderr, "SKMODE/SKSIGMA: %d/%.1f -> %d/%.1f\n", old->sk_mode,
+	    old->sk_sigma, cfg->sk_mode, cfg->sk_sigma);
+  if ((cfg->compress_after != old->compress_after)
+      || (cfg->retain_days != old->retain_days)
+      || (cfg->retain_mb != old->retain_mb))
+    fprintf(stderr, "COMPRESSAFTER/RETAINDAYS/RETAINMB: %d/%d/%d -> "
+	    "%d/%d/%d\n", old->compress_after, old->retain_days,
+	    old->retain_mb, cfg->compress_after, cfg->retain_days,
+	    cfg->retain_mb);
+  if ((cfg->ckpt_interval != old->ckpt_interval)
+      || (cfg->ckpt_max_age != old->ckpt_max_age))
+    fprintf(stderr, "CHECKPOINT/CHECKPOINTAGE: %d/%d -> %d/%d s\n",
+	    old->ckpt_interval, old->ckpt_max_age, cfg->ckpt_interval,
+	    cfg->ckpt_max_age);
+  if ((strcmp(cfg->export_host, old->export_host) != 0)
+      || (strcmp(cfg->export_port, old->export_port) != 0))
+    fprintf(stderr, "EXPORT: %s:%s -> %s:%s\n", old->export_host,
+	    old->export_port, cfg->export_host, cfg->export_port);
+  if ((cfg->export_batch != old->export_batch)
+      || (cfg->export_compress != old->export_compress)
+      || (cfg->export_spool_mb != old->export_spool_mb))
+    fprintf(stderr, "EXPORTBATCH/EXPORTCOMPRESS/EXPORTSPOOLMB: %d/%d/%d -> "
+	    "%d/%d/%d\n", old->export_batch, old->export_compress,
+	    old->export_spool_mb, cfg->export_batch, cfg->export_compress,
+	    cfg->export_spool_mb);
+  if (cfg->fold_out != old->fold_out)
+    fprintf(stderr, "FOLDOUT: %d -> %d\n", old->fold_out, cfg->fold_out);
+  if ((cfg->num_hires != old->num_hires)
+      || (memcmp(cfg->hires, old->hires, cfg->num_hires * sizeof(int)) != 0)
+      || (cfg->hires_bins != old->hires_bins)) {
+    fprintf(stderr, "HIRES:");
+    for (int k = 0; k < cfg->num_hires; k++)
+      fprintf(stderr, " %d", FFT_LEN * cfg->hires[k]);
+    fprintf(stderr, " points, %d bins\n", cfg->hires_bins);
+  }
+  if ((cfg->num_targets != old->num_targets)
+      || (memcmp(cfg->targets, old->targets,
+		 cfg->num_targets * sizeof(struct target)) != 0))
+    fprintf(stderr, "TARGET: %d -> %d extra targets\n", old->num_targets,
+	    cfg->num_targets);
+  if (cfg->fft_backend != old->fft_backend)
+    fprintf(stderr, "FFTBACKEND: %d -> %d\n", old->fft_backend,
+	    cfg->fft_backend);
+  if (cfg->spec_threads != old->spec_threads)
+    fprintf(stderr, "SPECTHREADS: %d -> %d\n", old->spec_threads,
+	    cfg->spec_threads);
+  if (memcmp(&cfg->shape, &old->shape, sizeof(cfg->shape)) != 0)
+    fprintf(stderr, "Cycle shape: %d x %d bytes, %d spectra, %d slots\n",
+	    cfg->shape.num_blocks, cfg->shape.read_size,
+	    cfg->shape.num_sig_spec, cfg->shape.in_queue_len);
+
+  /* Recorder threads only look the high-resolution plans up */
+
+  fft_plan_hires(cfg->hires, cfg->num_hires);
+
+  publish(cfg);
+
+  fprintf(stderr, "Configuration generation %u published\n", cfg->generation);
+
   return 0;
 }
+
+const struct ozone_config *config_get(void)
+{
+  return __atomic_load_n(&current_config, __ATOMIC_ACQUIRE);
+}
+
+/* Publish a copy of the current snapshot with a new cycle shape.
+ * Used by the auto-tuner. Must be called from the main thread.
+ */
+
+void config_set_shape(const struct cycle_shape *shape)
+{
+  struct ozone_config *cfg;
+
+  cfg = malloc(sizeof(struct ozone_config));
+  if (cfg == NULL) {
+    fprintf(stderr, "Cannot allocate configuration\n");
+    return;
+  }
+
+  memcpy(cfg, current_config, sizeof(struct ozone_config));
+  cfg->shape = *shape;
+  cfg->retired = NULL;
+
+  publish(cfg);
+}
+
+/* Free retired snapshots older than the oldest generation that any
+ * reader may still be using. Must be called from the main thread.
+ */
+
+void config_reclaim(unsigned int oldest_in_use)
+{
+  struct ozone_config **pp = &retired_configs;
+
+  while (*pp != NULL) {
+    struct ozone_config *cfg = *pp;
+    if (cfg->generation < oldest_in_use) {
+      *pp = cfg->retired;
+      free(cfg);
+    } else
+      pp = &cfg->retired;
+  }
+}
@@ -1,3 +1,4 @@
+
 #ifndef _CONFIG_H
 #define _CONFIG_H
 
@@ -6,15 +7,113 @@
 
 #define MAX_STATION_NAME 16
 
-extern char dongle_sns[MAX_NUM_CHANNELS][MAX_SN_LEN];
-extern int num_channels;
-extern int vsrt_num;
-extern char data_dir[_POSIX_PATH_MAX];
-extern char station_name[MAX_STATION_NAME];
-extern int watchdog_timeout;
-extern int keep_cal_on;
-extern double line_freq;
+/* Collector that records are streamed to (EXPORT host:port) */
+
+#define EXPORT_HOST_LEN 128
+#define EXPORT_PORT_LEN 16
+
+/* Shape of the observing cycle: each dwell on a sideband captures
+ * num_blocks reads of read_size bytes, giving one spectrum; there are
+ * num_sig_spec spectra per sideband per cycle and up to in_queue_len
+ * reads are in flight to the computational thread.
+ */
+
+struct cycle_shape {
+  int read_size;
+  int num_blocks;
+  int num_sig_spec;
+  int in_queue_len;
+};
+
+/* Spectral kurtosis RFI detection (SKMODE) */
+
+#define SK_OFF 0
+#define SK_FLAG 1 /* count flagged bins and blocks in the record */
+#define SK_EXCISE 2 /* ... and leave them out of the integration */
+
+/* Higher-resolution spectra around the line (HIRES, HIRESBINS) */
+
+#define MAX_HIRES 2
+#define MAX_HIRES_BINS 1024 /* per sideband */
+
+/* Threads computing each channel's spectra (SPECTHREADS) */
+
+#define MAX_SPEC_THREADS 16
+
+/* Extra targets observed each cycle besides the line (TARGET) */
+
+#define MAX_TARGETS 4
+#define MAX_TARGET_NAME 8
+
+#define ROLE_UPPER 0 /* tuned above the target, as the line's upper dwells */
+#define ROLE_LOWER 1 /* tuned below it */
+#define ROLE_SWITCHED 2 /* both in turn, like the line */
+#define ROLE_CENTRE 3 /* tuned to the target itself */
+
+struct target {
+  char name[MAX_TARGET_NAME];
+  double freq; /* Hz */
+  int role;
+  int dwell_reads; /* reads per dwell */
+  int reads; /* per cycle, in each sideband observed */
+};
+
+/* A configuration snapshot. Once published a snapshot is never
+ * modified; reloading the configuration publishes a new one.
+ * Readers call config_get() once per cycle and keep using the
+ * snapshot they got until the next cycle boundary.
+ */
+
+struct ozone_config {
+  unsigned int generation;
+  char (*dongle_sns)[MAX_SN_LEN]; /* fixed at startup, shared by snapshots */
+  int num_channels;
+  int vsrt_num;
+  char data_dir[_POSIX_PATH_MAX];
+  char station_name[MAX_STATION_NAME];
+  int watchdog_timeout;
+  int dongle_timeout;
+  int keep_cal_on;
+  int cal_every; /* cycles between cals, if the frequency error tracks */
+  double cal_max_sigma; /* Hz: calibrate sooner beyond this uncertainty */
+  int cal_backend; /* CAL_SYSFS, CAL_GPIOCHIP, CAL_MOCK (see calcontrol.h) */
+  int cal_gpio; /* sysfs GPIO number */
+  char cal_chip[_POSIX_PATH_MAX]; /* GPIO character device */
+  int cal_line; /* line offset on cal_chip */
+  int cal_settle_ms; /* from switching the cal on to capturing it */
+  double line_freq;
+  struct cycle_shape shape;
+  int autotune; /* choose the cycle shape from measured overheads */
+  int max_buf_mb; /* auto-tune limit on signal buffer memory per channel */
+  int max_cycle_time; /* auto-tune limit on cycle length (seconds) */
+  int sk_mode;
+  double sk_sigma; /* SK flagging threshold in standard deviations */
+  int fft_backend; /* FFT_FFTW, FFT_BUILTIN (see fftbackend.h) */
+  int spec_threads; /* split each read's frames between this many */
+  int fold_out; /* add the folded difference spectrum to each record */
+  int hires[MAX_HIRES]; /* factors over FFT_LEN */
+  int num_hires;
+  int hires_bins; /* bins around the line recorded per sideband */
+  struct target targets[MAX_TARGETS];
+  int num_targets;
+  int compress_after; /* gzip day files this many days old (0 = never) */
+  int retain_days; /* delete day files older than this (0 = keep) */
+  int retain_mb; /* delete oldest day files above this total (0 = keep) */
+  int archive_kbps; /* I/O rate limit for compression */
+  int ckpt_interval; /* seconds between checkpoints (0 = none) */
+  int ckpt_max_age; /* seconds: older checkpoints are not resumed */
+  char export_host[EXPORT_HOST_LEN]; /* empty: no streaming */
+  char export_port[EXPORT_PORT_LEN];
+  int export_batch; /* seconds between batches */
+  int export_compress; /* deflate batches */
+  int export_spool_mb; /* limit on records spooled for the collector */
+  struct ozone_config *retired; /* list of snapshots awaiting reclaim */
+};
 
 int read_config(char *conf_file);
+int reload_config(void);
+const struct ozone_config *config_get(void);
+void config_reclaim(unsigned int oldest_in_use);
+void config_set_shape(const struct cycle_shape *shape);
 
 #endif /* _CONFIG_H */
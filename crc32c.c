@@ -0,0 +1,117 @@
+/*
+ * CRC-32C (Castagnoli)
+ *
+ * Uses the CRC32C instructions when the compiler targets them (SSE4.2
+ * on x86, the CRC extension on ARMv8), and slicing-by-8 tables
+ * otherwise, e.g. on ARMv7.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+
+#if defined(__SSE4_2__)
+#define CRC_BYTE(c, b) _mm_crc32_u8(c, b)
+#define CRC_WORD(c, w) _mm_crc32_u32(c, w)
+#define IMPL "sse4.2"
+#else
+#define CRC_BYTE(c, b) __crc32cb(c, b)
+#define CRC_WORD(c, w) __crc32cw(c, w)
+#define IMPL "armv8"
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  uint32_t w;
+
+  crc = ~crc;
+
+  while (len >= 4) {
+    memcpy(&w, p, 4);
+    crc = CRC_WORD(crc, w);
+    p += 4;
+    len -= 4;
+  }
+
+  while (len > 0) {
+    crc = CRC_BYTE(crc, *p++);
+    len--;
+  }
+
+  return ~crc;
+}
+
+#else
+
+#define IMPL "slicing-by-8"
+#define POLY 0x82f63b78 /* reversed Castagnoli polynomial */
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void make_table(void)
+{
+  int n, k;
+
+  for (n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+    table[0][n] = c;
+  }
+
+  for (n = 0; n < 256; n++)
+    for (k = 1; k < 8; k++)
+      table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+
+  pthread_once(&table_once, make_table);
+
+  crc = ~crc;
+
+  /* Little-endian: the first four bytes are folded into crc */
+
+  while (len >= 8) {
+    uint32_t lo, hi;
+
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+      ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+      ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff]
+      ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+
+  while (len > 0) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+
+  return ~crc;
+}
+
+#endif
+
+/* Which implementation was built */
+
+const char *crc32c_impl(void)
+{
+  return IMPL;
+}
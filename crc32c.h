@@ -0,0 +1,17 @@
+/*
+ * CRC-32C (Castagnoli)
+ */
+
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Update crc (0 to start) with len bytes of buf */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+const char *crc32c_impl(void);
+
+#endif /* _CRC32C_H */
@@ -0,0 +1,167 @@
+/*
+ * Cycle barrier
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "cyclebarrier.h"
+
+/* Complete the current phase and release the waiting members.
+ * Must be called with the mutex held.
+ */
+
+static void complete_phase(struct cycle_barrier *b)
+{
+  b->num_waiting = 0;
+  b->phase = (b->phase + 1) % NUM_CYCLE_PHASES;
+  b->generation++;
+  pthread_cond_broadcast(&b->cond);
+}
+
+int cycle_barrier_init(struct cycle_barrier *b, int num_members)
+{
+  int r;
+
+  r = pthread_mutex_init(&b->mutex, NULL);
+  if (r != 0)
+    return r;
+
+  /* timed waits are measured on the monotonic clock */
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  r = pthread_cond_init(&b->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (r != 0)
+    return r;
+
+  b->num_members = num_members;
+  b->num_waiting = 0;
+  b->phase = PHASE_CAL_ON;
+  b->generation = 0;
+
+  return 0;
+}
+
+/* Arrive at a phase without waiting for it to complete.
+ * Returns the generation to pass to cycle_barrier_await().
+ * member may be NULL for a permanent member (the main thread).
+ */
+
+uint64_t cycle_barrier_arrive(struct cycle_barrier *b, int phase, int *member)
+{
+  uint64_t gen;
+
+  pthread_mutex_lock(&b->mutex);
+
+  gen = b->generation;
+
+  if ((member != NULL) && !*member) {
+    /* not taking part in this cycle; don't wait for anything */
+    pthread_mutex_unlock(&b->mutex);
+    return gen - 1;
+  }
+
+  if (phase != b->phase)
+    fprintf(stderr, "  cycle_barrier: WARNING: arrived at phase %d, "
+	    "expected %d\n", phase, b->phase);
+
+  b->num_waiting++;
+  if (b->num_waiting >= b->num_members)
+    complete_phase(b);
+
+  pthread_mutex_unlock(&b->mutex);
+
+  return gen;
+}
+
+/* Wait for the phase entered as generation gen to complete.
+ * If timeout (seconds) is non-zero, returns ETIMEDOUT if the phase is
+ * still incomplete after that time; the caller remains counted as
+ * arrived and should simply call this function again.
+ */
+
+int cycle_barrier_await(struct cycle_barrier *b, uint64_t gen, int timeout)
+{
+  struct timespec ts;
+  int r = 0;
+
+  if (timeout > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout;
+  }
+
+  pthread_mutex_lock(&b->mutex);
+
+  while ((b->generation == gen) && (r == 0)) {
+    if (timeout > 0)
+      r = pthread_cond_timedwait(&b->cond, &b->mutex, &ts);
+    else
+      r = pthread_cond_wait(&b->cond, &b->mutex);
+  }
+
+  if (b->generation != gen)
+    r = 0;
+
+  pthread_mutex_unlock(&b->mutex);
+
+  return r;
+}
+
+int cycle_barrier_wait(struct cycle_barrier *b, int phase, int *member)
+{
+  return cycle_barrier_await(b, cycle_barrier_arrive(b, phase, member), 0);
+}
+
+/* Remove a member. Safe to call more than once and from a thread other
+ * than the member itself (the supervisor does this for a stuck channel).
+ */
+
+void cycle_barrier_leave(struct cycle_barrier *b, int *member)
+{
+  pthread_mutex_lock(&b->mutex);
+
+  if (*member) {
+    *member = 0;
+    b->num_members--;
+
+    /* the remaining members may all be waiting for the leaver */
+    if ((b->num_waiting > 0) && (b->num_waiting >= b->num_members))
+      complete_phase(b);
+  }
+
+  pthread_mutex_unlock(&b->mutex);
+}
+
+/* Rejoin, blocking until the barrier is at the start of a cycle so
+ * that the new member's next wait is for PHASE_CAL_ON.
+ */
+
+void cycle_barrier_join(struct cycle_barrier *b, int *member)
+{
+  pthread_mutex_lock(&b->mutex);
+
+  if (!*member) {
+    while (b->phase != PHASE_CAL_ON)
+      pthread_cond_wait(&b->cond, &b->mutex);
+
+    *member = 1;
+    b->num_members++;
+  }
+
+  pthread_mutex_unlock(&b->mutex);
+}
+
+int cycle_barrier_members(struct cycle_barrier *b)
+{
+  int n;
+
+  pthread_mutex_lock(&b->mutex);
+  n = b->num_members;
+  pthread_mutex_unlock(&b->mutex);
+
+  return n;
+}
@@ -0,0 +1,43 @@
+/*
+ * Cycle barrier
+ *
+ * A reusable barrier for the threads taking part in the observing
+ * cycle. Unlike a pthread barrier the number of members can change:
+ * a channel whose dongle has failed can be removed (by itself or by
+ * the supervisor) and rejoin later at the start of a cycle.
+ */
+
+#ifndef _CYCLEBARRIER_H
+#define _CYCLEBARRIER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* Phases of the observing cycle, in order */
+
+enum cycle_phase {
+  PHASE_CAL_ON = 0,
+  PHASE_CAL_REC_DONE,
+  PHASE_CAL_OFF,
+  PHASE_SIG_REC_DONE,
+  NUM_CYCLE_PHASES
+};
+
+struct cycle_barrier {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int num_members; /* threads currently taking part */
+  int num_waiting; /* members that have reached the current phase */
+  int phase; /* phase the barrier is collecting */
+  uint64_t generation; /* incremented every time a phase completes */
+};
+
+int cycle_barrier_init(struct cycle_barrier *b, int num_members);
+uint64_t cycle_barrier_arrive(struct cycle_barrier *b, int phase, int *member);
+int cycle_barrier_await(struct cycle_barrier *b, uint64_t gen, int timeout);
+int cycle_barrier_wait(struct cycle_barrier *b, int phase, int *member);
+void cycle_barrier_leave(struct cycle_barrier *b, int *member);
+void cycle_barrier_join(struct cycle_barrier *b, int *member);
+int cycle_barrier_members(struct cycle_barrier *b);
+
+#endif /* _CYCLEBARRIER_H */
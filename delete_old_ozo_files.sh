@@ -1,6 +1,6 @@
 #!/bin/sh
 #
-# Clean up .ozo files older than some age
+# Clean up .ozo files, and their .ozq summaries, older than some age
 
 if [ -z $OZONE_DATA_DIR ]
 then
@@ -15,7 +15,7 @@ FIND=/usr/bin/find
 XARGS=/usr/bin/xargs
 RM=/bin/rm
 
-$FIND $OZONE_DATA_DIR \! -newermt $FILE_AGE -name "*.ozo" -print0 | $XARGS -0 -I{} $RM -v {}
+$FIND $OZONE_DATA_DIR \! -newermt $FILE_AGE \( -name "*.ozo" -o -name "*.ozo.gz" -o -name "*.ozq" \) -print0 | $XARGS -0 -I{} $RM -v {}
 
 
 
@@ -0,0 +1,649 @@
+/*
+ * Streaming of records to a collector
+ *
+ * The recorder threads hand each record to export_record(), which
+ * gives it a sequence number and appends it to the current spool
+ * segment (a file of records as in a day file, named by the sequence
+ * number of its first record in hex, .ozs), so the spool holds what
+ * the day files do even if the process is killed. A new segment is
+ * started once the current one reaches SEGMENT_BYTES. The worker
+ * thread wakes every EXPORTBATCH seconds and sends what the collector
+ * has not yet acknowledged, a segment at a time; it holds the lock
+ * only to look at and trim the list of segments, never while talking
+ * to the collector.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "export.h"
+#include "ozofile.h"
+#include "crc32c.h"
+#include "ozorecord.h"
+#include "timeutil.h"
+
+#define SEGMENT_BYTES (1 << 20)
+#define SEGMENT_NAME_LEN 21 /* /%016llx.ozs */
+#define EXPORT_TIMEOUT 30 /* seconds, for connecting, sending, acks */
+
+struct segment {
+  uint64_t first_seq;
+  uint32_t count;
+  off_t size;
+};
+
+/* Settings copied from the caller's configuration snapshot, as for
+   the archive worker */
+
+struct export_settings {
+  char host[EXPORT_HOST_LEN];
+  char port[EXPORT_PORT_LEN];
+  int batch;
+  int deflate;
+  int spool_mb;
+  int vsrt_num;
+  char station_name[MAX_STATION_NAME];
+};
+
+static pthread_mutex_t export_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+static struct export_settings settings;
+static int kicked = 0;
+static int started = 0;
+static long dropped = 0; /* records that could not be spooled */
+
+/* The spool, under export_mutex */
+
+static char spool_dir[_POSIX_PATH_MAX];
+static struct segment *segs = NULL;
+static int num_segs = 0;
+static FILE *spool_fp = NULL; /* the last segment, open for appending */
+static uint64_t next_seq = 1; /* to be given to the next record */
+
+/* Worker state */
+
+static uint64_t acked = 0; /* the collector wants this one next */
+static int sock = -1;
+static char connected_to[EXPORT_HOST_LEN + EXPORT_PORT_LEN];
+
+static void copy_settings(const struct ozone_config *cfg)
+{
+  strcpy(settings.host, cfg->export_host);
+  strcpy(settings.port, cfg->export_port);
+  settings.batch = cfg->export_batch;
+  settings.deflate = cfg->export_compress;
+  settings.spool_mb = cfg->export_spool_mb;
+  settings.vsrt_num = cfg->vsrt_num;
+  memcpy(settings.station_name, cfg->station_name, MAX_STATION_NAME);
+}
+
+/* A segment's file name. export_start() makes sure that it fits;
+   returns 0 if it does. */
+
+static int segment_path(uint64_t first_seq, char *path, size_t size)
+{
+  return snprintf(path, size, "%s/%016llx.ozs", spool_dir,
+		  (unsigned long long)first_seq) >= (int)size;
+}
+
+/* Read a whole segment. Returns NULL on error. */
+
+static uint8_t *read_segment(const struct segment *s, size_t *len)
+{
+  char path[_POSIX_PATH_MAX];
+  uint8_t *d;
+  FILE *fp;
+
+  if (segment_path(s->first_seq, path, sizeof(path)) != 0)
+    return NULL;
+  fp = fopen(path, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  d = malloc(s->size > 0 ? s->size : 1);
+  *len = d != NULL ? fread(d, 1, s->size, fp) : 0;
+  fclose(fp);
+
+  return d;
+}
+
+static int by_seq(const void *a, const void *b)
+{
+  const struct segment *x = a, *y = b;
+
+  return (x->first_seq > y->first_seq) - (x->first_seq < y->first_seq);
+}
+
+/* Find the segments left by the last run, counting their records. A
+   segment is cut short at its first bad record, which can only be the
+   last one written before a crash. */
+
+static void scan_spool(void)
+{
+  char path[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+
+  if ((mkdir(spool_dir, 0755) != 0) && (errno != EEXIST)) {
+    fprintf(stderr, "export: cannot create %s\n", spool_dir);
+    return;
+  }
+
+  dir = opendir(spool_dir);
+  if (dir == NULL)
+    return;
+
+  while ((de = readdir(dir)) != NULL) {
+    unsigned long long seq;
+    struct segment *p;
+    int n;
+
+    if ((sscanf(de->d_name, "%16llx.ozs%n", &seq, &n) != 1)
+	|| (de->d_name[n] != '\0'))
+      continue;
+    if ((segment_path(seq, path, sizeof(path)) != 0)
+	|| (stat(path, &st) != 0))
+      continue;
+
+    p = realloc(segs, (num_segs + 1) * sizeof(*segs));
+    if (p == NULL)
+      break;
+    segs = p;
+    segs[num_segs].first_seq = seq;
+    segs[num_segs].count = 0;
+    segs[num_segs].size = st.st_size;
+    num_segs++;
+  }
+  closedir(dir);
+
+  qsort(segs, num_segs, sizeof(*segs), by_seq);
+
+  for (int k = 0; k < num_segs; k++) {
+    struct segment *s = &segs[k];
+    size_t len, off = 0;
+    uint32_t rec_len;
+    uint8_t *d;
+
+    d = read_segment(s, &len);
+    if (d == NULL)
+      continue;
+    while ((rec_len = ozo_record_len(&d[off], len - off)) > 0) {
+      off += rec_len;
+      s->count++;
+    }
+    free(d);
+
+    if ((off_t)off != s->size) {
+      fprintf(stderr, "export: %016llx.ozs cut to %u good records\n",
+	      (unsigned long long)s->first_seq, s->count);
+      if ((segment_path(s->first_seq, path, sizeof(path)) == 0)
+	  && (truncate(path, off) == 0))
+	s->size = off;
+    }
+  }
+
+  if (num_segs > 0)
+    next_seq = segs[num_segs - 1].first_seq + segs[num_segs - 1].count;
+
+  fprintf(stderr, "export: %d spool segments, next record %llu\n", num_segs,
+	  (unsigned long long)next_seq);
+}
+
+static void remove_segment(int k)
+{
+  char path[_POSIX_PATH_MAX];
+
+  if (segment_path(segs[k].first_seq, path, sizeof(path)) == 0)
+    unlink(path);
+  memmove(&segs[k], &segs[k + 1], (num_segs - k - 1) * sizeof(*segs));
+  num_segs--;
+}
+
+/* Give a record its sequence number and append it to the spool.
+   Returns 0 if it was spooled. */
+
+static int spool_record(const void *rec, size_t len)
+{
+  char path[_POSIX_PATH_MAX];
+  struct segment *s = num_segs > 0 ? &segs[num_segs - 1] : NULL;
+
+  /* Continue the last segment while it is short and in sequence */
+
+  if ((s == NULL) || (s->size >= SEGMENT_BYTES)
+      || (s->first_seq + s->count != next_seq)) {
+    struct segment *p = realloc(segs, (num_segs + 1) * sizeof(*segs));
+
+    if (p == NULL)
+      return 1;
+    segs = p;
+    s = &segs[num_segs++];
+    s->first_seq = next_seq;
+    s->count = 0;
+    s->size = 0;
+
+    if (spool_fp != NULL)
+      fclose(spool_fp);
+    spool_fp = NULL;
+  }
+
+  if (spool_fp == NULL) {
+    if (segment_path(s->first_seq, path, sizeof(path)) == 0)
+      spool_fp = fopen(path, "ab");
+    if (spool_fp == NULL) {
+      fprintf(stderr, "export: cannot write %s\n", path);
+      return 1;
+    }
+  }
+
+  /* The worker reads up to s->size, so the record must be in the file
+     first; a short write is cut off by scan_spool() on the next start */
+
+  if ((fwrite(rec, len, 1, spool_fp) != 1) || (fflush(spool_fp) != 0)) {
+    fclose(spool_fp);
+    spool_fp = NULL;
+    return 1;
+  }
+  s->count++;
+  s->size += len;
+  next_seq++;
+
+  return 0;
+}
+
+/* Keep the spool within spool_mb, dropping the oldest segments (but
+   never the one being written), and remove those acknowledged. Called
+   with export_mutex held. */
+
+static void trim_spool(int spool_mb)
+{
+  off_t total = 0;
+
+  while ((num_segs > 1)
+	 && (acked >= segs[0].first_seq + segs[0].count))
+    remove_segment(0);
+
+  for (int k = 0; k < num_segs; k++)
+    total += segs[k].size;
+
+  while ((num_segs > 1) && (total > (off_t)spool_mb * 1024 * 1024)) {
+    fprintf(stderr, "export: spool full, dropping records %llu to %llu\n",
+	    (unsigned long long)segs[0].first_seq,
+	    (unsigned long long)(segs[0].first_seq + segs[0].count - 1));
+    total -= segs[0].size;
+    remove_segment(0);
+  }
+}
+
+/* Number the spool afresh from first. Called, with export_mutex held,
+ * when the collector wants a record beyond any numbered here: its
+ * records up to there came before this spool (lost with the card,
+ * say), so none of the spooled ones can have reached it, and under
+ * their old numbers it would skip them as already received. Renaming
+ * from the last segment back never meets a name still in use, and
+ * keeps the segments in order throughout. A segment that cannot be
+ * renamed is dropped, as under its old number it would be taken as
+ * acknowledged; the collector sees the gap.
+ */
+
+static void renumber_spool(uint64_t first)
+{
+  char from[_POSIX_PATH_MAX], to[_POSIX_PATH_MAX];
+  uint64_t shift;
+
+  if (num_segs == 0) {
+    next_seq = first;
+    return;
+  }
+
+  shift = first - segs[0].first_seq;
+
+  if (spool_fp != NULL)
+    fclose(spool_fp);
+  spool_fp = NULL;
+
+  for (int k = num_segs - 1; k >= 0; k--) {
+    uint64_t seq = segs[k].first_seq + shift;
+
+    if ((segment_path(segs[k].first_seq, from, sizeof(from)) != 0)
+	|| (segment_path(seq, to, sizeof(to)) != 0)
+	|| (rename(from, to) != 0)) {
+      fprintf(stderr, "export: cannot rename %s, dropping records %llu to "
+	      "%llu\n", from, (unsigned long long)seq,
+	      (unsigned long long)(seq + segs[k].count - 1));
+      remove_segment(k);
+      continue;
+    }
+    segs[k].first_seq = seq;
+  }
+
+  fprintf(stderr, "export: spool renumbered from %llu\n",
+	  (unsigned long long)first);
+
+  next_seq += shift;
+}
+
+static void disconnect(void)
+{
+  if (sock >= 0)
+    close(sock);
+  sock = -1;
+}
+
+static int send_all(const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+
+  while (len > 0) {
+    ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR))
+	continue;
+      return 1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int recv_ack(void)
+{
+  struct export_ack ack;
+  uint8_t *p = (uint8_t *)&ack;
+  size_t len = sizeof(ack);
+
+  while (len > 0) {
+    ssize_t n = recv(sock, p, len, 0);
+
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR))
+	continue;
+      return 1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  if (ack.magic != EXPORT_ACK_MAGIC)
+    return 1;
+
+  acked = ack.next_seq;
+  return 0;
+}
+
+/* Connect and say hello. Returns 0 once the collector has said which
+   record it wants next. */
+
+static int connect_collector(const struct export_settings *s)
+{
+  struct addrinfo hints, *res, *ai;
+  struct timeval tv = { EXPORT_TIMEOUT, 0 };
+  struct export_hello hello;
+  int r;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  r = getaddrinfo(s->host, s->port, &hints, &res);
+  if (r != 0) {
+    fprintf(stderr, "export: %s: %s\n", s->host, gai_strerror(r));
+    return 1;
+  }
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock < 0)
+      continue;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    disconnect();
+  }
+  freeaddrinfo(res);
+
+  if (sock < 0)
+    return 1;
+
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = EXPORT_HELLO_MAGIC;
+  hello.version = EXPORT_VERSION;
+  hello.fft_len = FFT_LEN;
+  hello.vsrt_num = s->vsrt_num;
+  memcpy(hello.station_name, s->station_name, sizeof(hello.station_name));
+  pthread_mutex_lock(&export_mutex);
+  hello.next_seq = next_seq;
+  pthread_mutex_unlock(&export_mutex);
+
+  if ((send_all(&hello, sizeof(hello)) != 0) || (recv_ack() != 0)) {
+    disconnect();
+    return 1;
+  }
+
+  /* A collector ahead of the numbering at the hello sets it, for the
+     records spooled since too */
+
+  pthread_mutex_lock(&export_mutex);
+  if (acked > hello.next_seq) {
+    fprintf(stderr, "export: collector wants %llu, numbering from there\n",
+	    (unsigned long long)acked);
+    renumber_spool(acked);
+  }
+  pthread_mutex_unlock(&export_mutex);
+
+  snprintf(connected_to, sizeof(connected_to), "%s:%s", s->host, s->port);
+  fprintf(stderr, "export: connected to %s, sending from %llu\n",
+	  connected_to, (unsigned long long)acked);
+
+  return 0;
+}
+
+/* Send the unacknowledged records of one segment, as far as they go
+   or EXPORT_MAX_BATCH allows. Returns 0 if the collector acknowledged
+   them. */
+
+static int send_segment(const struct export_settings *s,
+			const struct segment *seg)
+{
+  struct export_batch b;
+  uint64_t seq = seg->first_seq;
+  size_t len, off = 0, start;
+  uint8_t *d, *z = NULL;
+  const uint8_t *payload;
+  uint32_t rec_len;
+  int r;
+
+  d = read_segment(seg, &len);
+  if (d == NULL)
+    return 1;
+
+  /* Skip what the collector has; batches stay within EXPORT_MAX_BATCH */
+
+  while ((seq < acked)
+	 && ((rec_len = ozo_record_len(&d[off], len - off)) > 0)) {
+    off += rec_len;
+    seq++;
+  }
+  start = off;
+
+  memset(&b, 0, sizeof(b));
+  b.magic = EXPORT_BATCH_MAGIC;
+  b.first_seq = seq;
+  while ((seq < seg->first_seq + seg->count)
+	 && ((rec_len = ozo_record_len(&d[off], len - off)) > 0)
+	 && ((off - start + rec_len <= EXPORT_MAX_BATCH) || (b.count == 0))) {
+    off += rec_len;
+    seq++;
+    b.count++;
+  }
+  b.raw_len = off - start;
+
+  if (b.count == 0) {
+    free(d);
+    return 1;
+  }
+
+  payload = &d[start];
+  b.len = b.raw_len;
+  if (s->deflate) {
+    uLongf zlen = compressBound(b.raw_len);
+
+    z = malloc(zlen);
+    if ((z != NULL) && (compress2(z, &zlen, payload, b.raw_len, 6) == Z_OK)) {
+      payload = z;
+      b.len = zlen;
+      b.flags |= EXPORT_DEFLATE;
+    }
+  }
+  b.crc = crc32c(0, payload, b.len);
+
+  r = (send_all(&b, sizeof(b)) != 0) || (send_all(payload, b.len) != 0)
+    || (recv_ack() != 0) || (acked < seq);
+
+  free(z);
+  free(d);
+
+  return r;
+}
+
+static void *export_thread(void *arg)
+{
+  struct export_settings s;
+  struct timespec deadline;
+  struct segment seg;
+  char target[sizeof(connected_to)];
+
+  pthread_mutex_lock(&export_mutex);
+
+  for (;;) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += settings.batch;
+    while (!kicked)
+      if (pthread_cond_timedwait(&export_cond, &export_mutex,
+				 &deadline) == ETIMEDOUT)
+	break;
+
+    s = settings;
+    kicked = 0;
+    if (dropped > 0)
+      fprintf(stderr, "export: %ld records could not be spooled\n", dropped);
+    dropped = 0;
+    pthread_mutex_unlock(&export_mutex);
+
+    /* Reconnect if the collector has changed */
+
+    snprintf(target, sizeof(target), "%s:%s", s.host, s.port);
+    if ((sock >= 0) && (strcmp(target, connected_to) != 0))
+      disconnect();
+
+    if ((sock < 0) && (connect_collector(&s) != 0))
+      fprintf(stderr, "export: cannot reach %s\n", target);
+
+    /* Send until the collector has everything spooled so far. Segments
+       only go from the front, and only here. */
+
+    for (int k = 0; sock >= 0; ) {
+      int have;
+
+      pthread_mutex_lock(&export_mutex);
+      have = k < num_segs;
+      if (have)
+	seg = segs[k];
+      pthread_mutex_unlock(&export_mutex);
+      if (!have)
+	break;
+
+      if (acked >= seg.first_seq + seg.count)
+	k++;
+      else if (send_segment(&s, &seg) != 0) {
+	fprintf(stderr, "export: sending to %s failed\n", target);
+	disconnect();
+      }
+    }
+
+    pthread_mutex_lock(&export_mutex);
+    trim_spool(s.spool_mb);
+  }
+
+  return NULL;
+}
+
+/* Pick up the spool in DATADIR/spool and start the worker if EXPORT
+   is set. Called before the recorder threads start. */
+
+int export_start(const struct ozone_config *cfg)
+{
+  pthread_t thread;
+  int r;
+
+  if (cfg->export_host[0] == '\0')
+    return 0;
+
+  /* Room for the segment names, so that none is ever cut short */
+
+  if (snprintf(spool_dir, sizeof(spool_dir), "%s/%s", cfg->data_dir,
+	       EXPORT_SPOOL_DIR) + SEGMENT_NAME_LEN >= (int)sizeof(spool_dir)) {
+    fprintf(stderr, "export: DATADIR too long for the spool, not exporting\n");
+    return 1;
+  }
+
+  copy_settings(cfg);
+  scan_spool();
+
+  r = pthread_create(&thread, NULL, export_thread, NULL);
+  if (r != 0) {
+    fprintf(stderr, "pthread_create(export_thread): %s\n", strerror(r));
+    return 1;
+  }
+
+  pthread_detach(thread);
+  started = 1;
+
+  fprintf(stderr, "Exporting records to %s:%s every %d s\n", cfg->export_host,
+	  cfg->export_port, cfg->export_batch);
+
+  return 0;
+}
+
+/* Take up new settings, and send what is spooled now */
+
+void export_kick(const struct ozone_config *cfg)
+{
+  if (!started)
+    return;
+
+  pthread_mutex_lock(&export_mutex);
+  copy_settings(cfg);
+  kicked = 1;
+  pthread_cond_signal(&export_cond);
+  pthread_mutex_unlock(&export_mutex);
+}
+
+/* Spool a record just written to the day file. Called by the recorder
+   threads; never waits for the collector. */
+
+void export_record(const void *rec, size_t len)
+{
+  if (!started)
+    return;
+
+  pthread_mutex_lock(&export_mutex);
+  if (spool_record(rec, len) != 0)
+    dropped++;
+  pthread_mutex_unlock(&export_mutex);
+}
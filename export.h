@@ -0,0 +1,68 @@
+/*
+ * Streaming of records to a collector
+ *
+ * With EXPORT host:port set, every record written to the day file is
+ * also given a sequence number and appended to a spool in DATADIR/spool,
+ * and a worker thread sends the spool to the collector over TCP in
+ * batches, every EXPORTBATCH seconds, deflated if EXPORTCOMPRESS is set.
+ * The collector acknowledges each batch with the next sequence number
+ * it wants; spooled records below it are deleted. While the collector
+ * cannot be reached the spool grows, up to EXPORTSPOOLMB, beyond which
+ * the oldest records are dropped (they are still in the day files).
+ *
+ * Protocol, in the byte order of the station as in .ozo files: the
+ * station sends a struct export_hello, the collector answers with a
+ * struct export_ack giving the next sequence number it wants, then the
+ * station sends batches (struct export_batch and its payload, the
+ * records as in a day file) each answered with a struct export_ack. A
+ * batch may start beyond the number wanted if records were dropped, or
+ * below it after a lost acknowledgement; the collector skips records
+ * it already has. ozocollect is a reference collector.
+ */
+
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+#include "config.h"
+
+#define EXPORT_HELLO_MAGIC 0x4c485a4f /* "OZHL" */
+#define EXPORT_BATCH_MAGIC 0x42455a4f /* "OZEB" */
+#define EXPORT_ACK_MAGIC 0x4b415a4f /* "OZAK" */
+#define EXPORT_VERSION 1
+#define EXPORT_SPOOL_DIR "spool" /* in DATADIR */
+#define EXPORT_DEFLATE 1 /* batch flag: payload is zlib-compressed */
+#define EXPORT_MAX_BATCH (4 << 20) /* bytes of records per batch */
+
+struct export_hello {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fft_len;
+  int32_t vsrt_num;
+  char station_name[16];
+  uint64_t next_seq; /* the station's next unassigned sequence number */
+};
+
+struct export_ack {
+  uint32_t magic;
+  uint32_t pad;
+  uint64_t next_seq; /* the next record the collector wants */
+};
+
+struct export_batch {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t first_seq; /* of the first record in the payload */
+  uint32_t count; /* records */
+  uint32_t raw_len; /* bytes of records */
+  uint32_t len; /* bytes of payload that follow */
+  uint32_t crc; /* CRC-32C of the payload */
+};
+
+int export_start(const struct ozone_config *cfg);
+void export_kick(const struct ozone_config *cfg);
+void export_record(const void *rec, size_t len);
+
+#endif /* _EXPORT_H */
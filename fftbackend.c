@@ -0,0 +1,323 @@
+/*
+ * FFT backends
+ *
+ * FFTW is the default. The built-in backend is a 768-point FFT
+ * specialised for FFT_LEN = 3 x 256: one radix-3 pass with twiddles,
+ * then three 256-point radix-4 FFTs whose last stage writes straight to
+ * the output in natural order. Its tables are generated at build time
+ * by gentwiddle. Every backend is checked against FFTW at startup and
+ * is not used if it fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fftbackend.h"
+#include "common.h"
+#include "timeutil.h"
+#include "fft768_tables.h"
+
+#define WISDOM_FILE "ozonespec.wisdom"
+#define N2 (FFT_LEN / 3)
+#define CHECK_FRAMES 16 /* random frames for the accuracy check */
+#define CHECK_TOL 1.0E-5 /* max error relative to RMS of the output */
+#define BENCH_FRAMES 2000
+
+static void fftw_execute_backend(const struct fft_backend *fft,
+				 fft_complex *in, fft_complex *out)
+{
+  fftwf_execute_dft(fft->fplan, in, out);
+}
+
+/* Radix-4 stages of a 256-point FFT on digit-reversed data in work,
+   the last writing element k to out[stride * k] */
+
+static void fft256(fft_complex *work, fft_complex *out, int stride)
+{
+  int m, j, q;
+
+  for (m = 1; m < N2; m *= 4) {
+    int last = (4 * m == N2), step = N2 / (4 * m);
+
+    for (j = 0; j < N2; j += 4 * m) {
+      for (q = 0; q < m; q++) {
+	const float *w1 = tw256[q * step];
+	const float *w2 = tw256[2 * q * step];
+	const float *w3 = tw256[3 * q * step];
+	float *x0 = work[j + q], *x1 = work[j + q + m];
+	float *x2 = work[j + q + 2 * m], *x3 = work[j + q + 3 * m];
+	float a1r, a1i, a2r, a2i, a3r, a3i;
+	float t0r, t0i, t1r, t1i, t2r, t2i, t3r, t3i;
+
+	a1r = x1[0] * w1[0] - x1[1] * w1[1];
+	a1i = x1[0] * w1[1] + x1[1] * w1[0];
+	a2r = x2[0] * w2[0] - x2[1] * w2[1];
+	a2i = x2[0] * w2[1] + x2[1] * w2[0];
+	a3r = x3[0] * w3[0] - x3[1] * w3[1];
+	a3i = x3[0] * w3[1] + x3[1] * w3[0];
+
+	t0r = x0[0] + a2r; t0i = x0[1] + a2i;
+	t1r = x0[0] - a2r; t1i = x0[1] - a2i;
+	t2r = a1r + a3r; t2i = a1i + a3i;
+	t3r = a1r - a3r; t3i = a1i - a3i;
+
+	if (last) {
+	  x0 = out[stride * q];
+	  x1 = out[stride * (q + m)];
+	  x2 = out[stride * (q + 2 * m)];
+	  x3 = out[stride * (q + 3 * m)];
+	}
+
+	/* X1 = t1 - i t3, X3 = t1 + i t3 */
+
+	x0[0] = t0r + t2r; x0[1] = t0i + t2i;
+	x2[0] = t0r - t2r; x2[1] = t0i - t2i;
+	x1[0] = t1r + t3i; x1[1] = t1i - t3r;
+	x3[0] = t1r - t3i; x3[1] = t1i + t3r;
+      }
+    }
+  }
+}
+
+static void builtin_execute(const struct fft_backend *fft,
+			    fft_complex *in, fft_complex *out)
+{
+  fft_complex work[FFT_LEN];
+  const float h = 0.866025403784438647f; /* sqrt(3) / 2 */
+  int n, k;
+
+  (void)fft;
+
+  /* Radix-3 butterflies across the three 256-point subsequences,
+     then twiddles; results go to digit-reversed positions */
+
+  for (n = 0; n < N2; n++) {
+    float ar = in[n][0], ai = in[n][1];
+    float sr = in[n + N2][0] + in[n + 2 * N2][0];
+    float si = in[n + N2][1] + in[n + 2 * N2][1];
+    float dr = in[n + N2][0] - in[n + 2 * N2][0];
+    float di = in[n + N2][1] - in[n + 2 * N2][1];
+    float cr = ar - 0.5f * sr, ci = ai - 0.5f * si;
+    float y1r = cr + h * di, y1i = ci - h * dr;
+    float y2r = cr - h * di, y2i = ci + h * dr;
+    int r = rev256[n];
+
+    work[r][0] = ar + sr;
+    work[r][1] = ai + si;
+    work[N2 + r][0] = y1r * tw768[0][n][0] - y1i * tw768[0][n][1];
+    work[N2 + r][1] = y1r * tw768[0][n][1] + y1i * tw768[0][n][0];
+    work[2 * N2 + r][0] = y2r * tw768[1][n][0] - y2i * tw768[1][n][1];
+    work[2 * N2 + r][1] = y2r * tw768[1][n][1] + y2i * tw768[1][n][0];
+  }
+
+  /* X[k1 + 3 k2] is bin k2 of the FFT of subsequence k1 */
+
+  for (k = 0; k < 3; k++)
+    fft256(&work[k * N2], &out[k], 3);
+}
+
+static struct fft_backend backends[NUM_FFT_BACKENDS] = {
+  { "fftw", fftw_execute_backend, NULL, 0, FFT_LEN },
+  { "builtin", builtin_execute, NULL, 0, FFT_LEN },
+};
+
+/* High-resolution plans, indexed by log2 of the factor. Only the main
+   thread plans (the FFTW planner is not thread-safe); a plan is marked
+   ready once complete, for the recorder threads to pick up. */
+
+static struct fft_backend hires[5];
+static int hires_ready[5];
+static int hires_failed[5];
+
+/* Compare a backend with FFTW on random frames and time it.
+   Returns 0 if it is accurate enough. */
+
+static int check_backend(struct fft_backend *fft, fft_complex *in,
+			 fft_complex *out, fft_complex *ref)
+{
+  double max_err = 0, sum_sq = 0, rms, t;
+  struct timespec t0;
+  int n, k;
+
+  srand(1);
+
+  for (n = 0; n < CHECK_FRAMES; n++) {
+    for (k = 0; k < FFT_LEN; k++) {
+      in[k][0] = (float)rand() / RAND_MAX * 2 - 1;
+      in[k][1] = (float)rand() / RAND_MAX * 2 - 1;
+    }
+
+    fftwf_execute_dft(backends[FFT_FFTW].fplan, in, ref);
+    fft_execute(fft, in, out);
+
+    for (k = 0; k < FFT_LEN; k++) {
+      double er = out[k][0] - ref[k][0], ei = out[k][1] - ref[k][1];
+      double e = sqrt(er * er + ei * ei);
+      if (e > max_err)
+	max_err = e;
+      sum_sq += ref[k][0] * ref[k][0] + ref[k][1] * ref[k][1];
+    }
+  }
+
+  rms = sqrt(sum_sq / (CHECK_FRAMES * FFT_LEN));
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (n = 0; n < BENCH_FRAMES; n++)
+    fft_execute(fft, in, out);
+  t = time_since(&t0);
+
+  fprintf(stderr, "FFT backend %s: error %.1e, %.2f us per FFT\n",
+	  fft->name, max_err / rms, t / BENCH_FRAMES * 1.0E6);
+
+  return (max_err / rms > CHECK_TOL) ? 1 : 0;
+}
+
+/* Plan the FFTW backend and check the others against it. The plan is
+ * shared by all threads, each executing it on its own buffers with
+ * fftwf_execute_dft(), which is thread-safe. Buffers must come from
+ * fftwf_malloc() so that their alignment matches. Wisdom is kept in a
+ * file so that restarts do not have to measure again.
+ * Returns 0 on success.
+ */
+
+int init_fft(void)
+{
+  fftwf_complex *inbuf, *outbuf, *refbuf;
+
+  inbuf = fftwf_alloc_complex(FFT_LEN);
+  outbuf = fftwf_alloc_complex(FFT_LEN);
+  refbuf = fftwf_alloc_complex(FFT_LEN);
+  if ((inbuf == NULL) || (outbuf == NULL) || (refbuf == NULL)) {
+    fprintf(stderr, "Failed to allocate FFT buffers for planning\n");
+    return 1;
+  }
+
+  if (fftwf_import_wisdom_from_filename(WISDOM_FILE))
+    fprintf(stderr, "Loaded FFTW wisdom from %s\n", WISDOM_FILE);
+
+  backends[FFT_FFTW].fplan = fftwf_plan_dft_1d(FFT_LEN, inbuf, outbuf,
+					       FFTW_FORWARD, FFTW_MEASURE);
+  if (backends[FFT_FFTW].fplan == NULL) {
+    fprintf(stderr, "Failed to plan FFT\n");
+    return 1;
+  }
+  backends[FFT_FFTW].usable = 1;
+
+  if (!fftwf_export_wisdom_to_filename(WISDOM_FILE))
+    fprintf(stderr, "Could not save FFTW wisdom to %s\n", WISDOM_FILE);
+
+  for (int n = 0; n < NUM_FFT_BACKENDS; n++) {
+    if (n == FFT_FFTW)
+      continue;
+    backends[n].usable = check_backend(&backends[n], inbuf, outbuf,
+				       refbuf) == 0;
+    if (!backends[n].usable)
+      fprintf(stderr, "FFT backend %s failed accuracy check, "
+	      "FFTW will be used instead\n", backends[n].name);
+  }
+
+  fftwf_free(inbuf);
+  fftwf_free(outbuf);
+  fftwf_free(refbuf);
+
+  return 0;
+}
+
+/* The backend to use for a configured id, falling back to FFTW */
+
+const struct fft_backend *fft_get(int id)
+{
+  if ((id < 0) || (id >= NUM_FFT_BACKENDS) || !backends[id].usable)
+    return &backends[FFT_FFTW];
+
+  return &backends[id];
+}
+
+/* log2 of a high-resolution factor, or -1 unless it is a power of two
+   from 2 to MAX_HIRES_FACTOR */
+
+static int hires_index(int factor)
+{
+  int n;
+
+  for (n = 1; (1 << n) < factor; n++)
+    ;
+  if ((factor < 2) || (factor > MAX_HIRES_FACTOR) || ((1 << n) != factor))
+    return -1;
+
+  return n;
+}
+
+/* Plan the FFTs of FFT_LEN times each factor not planned yet. Called
+ * by the main thread at startup and on a reload before the factors are
+ * published, so that the seconds FFTW_MEASURE can take are never spent
+ * in a recorder thread while the other channels wait for it.
+ */
+
+void fft_plan_hires(const int *factors, int num)
+{
+  fftwf_complex *inbuf, *outbuf;
+  struct timespec t0;
+  int k, n, len;
+
+  for (k = 0; k < num; k++) {
+    n = hires_index(factors[k]);
+    if ((n < 0) || hires_ready[n] || hires_failed[n])
+      continue;
+
+    len = FFT_LEN * factors[k];
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    inbuf = fftwf_alloc_complex(len);
+    outbuf = fftwf_alloc_complex(len);
+    if ((inbuf != NULL) && (outbuf != NULL))
+      hires[n].fplan = fftwf_plan_dft_1d(len, inbuf, outbuf, FFTW_FORWARD,
+					 FFTW_MEASURE);
+    fftwf_free(inbuf);
+    fftwf_free(outbuf);
+
+    if (hires[n].fplan == NULL) {
+      fprintf(stderr, "Failed to plan %d-point FFT\n", len);
+      hires_failed[n] = 1;
+      continue;
+    }
+
+    hires[n].name = "fftw";
+    hires[n].execute = fftw_execute_backend;
+    hires[n].usable = 1;
+    hires[n].len = len;
+    __atomic_store_n(&hires_ready[n], 1, __ATOMIC_RELEASE);
+
+    fftwf_export_wisdom_to_filename(WISDOM_FILE);
+    fprintf(stderr, "Planned %d-point FFT in %.2f s\n", len,
+	    time_since(&t0));
+  }
+}
+
+/* The FFTW plan for FFT_LEN * factor points, planned beforehand by
+ * fft_plan_hires(). Never plans, so recorder threads can call it at
+ * the start of a cycle. Returns NULL if factor is not a power of two
+ * from 2 to MAX_HIRES_FACTOR or there is no plan for it.
+ */
+
+const struct fft_backend *fft_get_hires(int factor)
+{
+  int n = hires_index(factor);
+
+  if ((n < 0) || !__atomic_load_n(&hires_ready[n], __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return &hires[n];
+}
+
+/* Look up a backend by name. Returns -1 if there is no such backend. */
+
+int fft_backend_id(const char *name)
+{
+  for (int n = 0; n < NUM_FFT_BACKENDS; n++)
+    if (strcmp(name, backends[n].name) == 0)
+      return n;
+
+  return -1;
+}
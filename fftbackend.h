@@ -0,0 +1,51 @@
+/*
+ * FFT backends
+ */
+
+#ifndef _FFTBACKEND_H
+#define _FFTBACKEND_H
+
+#include <fftw3.h>
+
+/* Same layout as fftwf_complex, so buffers from fftwf_malloc() can be
+   used with every backend */
+
+typedef float fft_complex[2];
+
+/* Backends, selected with FFTBACKEND */
+
+#define FFT_FFTW 0 /* FFTW plan (default) */
+#define FFT_BUILTIN 1 /* built-in 768-point mixed-radix kernel */
+#define NUM_FFT_BACKENDS 2
+
+/* Higher resolutions are FFT_LEN times a power of two up to this */
+
+#define MAX_HIRES_FACTOR 16
+#define MAX_HIRES_LEN (FFT_LEN * MAX_HIRES_FACTOR)
+
+/* A forward FFT of len points, FFT_LEN except for the high-resolution
+   FFTW plans. execute() is thread-safe as long as each thread uses its
+   own buffers, and leaves the input unchanged. */
+
+struct fft_backend {
+  const char *name;
+  void (*execute)(const struct fft_backend *fft, fft_complex *in,
+		  fft_complex *out);
+  fftwf_plan fplan; /* FFTW only */
+  int usable; /* passed the startup accuracy check */
+  int len;
+};
+
+int init_fft(void);
+const struct fft_backend *fft_get(int id);
+void fft_plan_hires(const int *factors, int num);
+const struct fft_backend *fft_get_hires(int factor);
+int fft_backend_id(const char *name);
+
+static inline void fft_execute(const struct fft_backend *fft,
+			       fft_complex *in, fft_complex *out)
+{
+  fft->execute(fft, in, out);
+}
+
+#endif /* _FFTBACKEND_H */
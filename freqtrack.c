@@ -0,0 +1,119 @@
+/*
+ * Frequency error tracking
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "freqtrack.h"
+
+#define MEAS_SIGMA 30.0 /* of find_freq_error(), Hz */
+#define RATE_SIGMA 2.0 /* of the drift rate before it is measured, Hz/s */
+#define DRIFT_Q 1.0E-4 /* random walk of the rate, Hz^2/s^3 */
+#define GATE 5.0 /* standard deviations before a measurement is a jump */
+
+void freq_track_reset(struct freq_track *ft)
+{
+  memset(ft, 0, sizeof(*ft));
+}
+
+/* The state and covariance carried forward to time t */
+
+static void predict(const struct freq_track *ft, double t, double x[2],
+		    double p[2][2])
+{
+  double dt = t - ft->t;
+
+  if (dt < 0)
+    dt = 0;
+
+  x[0] = ft->err + ft->rate * dt;
+  x[1] = ft->rate;
+
+  p[0][0] = ft->p[0][0] + 2 * dt * ft->p[0][1] + dt * dt * ft->p[1][1]
+    + DRIFT_Q * dt * dt * dt / 3;
+  p[0][1] = ft->p[0][1] + dt * ft->p[1][1] + DRIFT_Q * dt * dt / 2;
+  p[1][0] = p[0][1];
+  p[1][1] = ft->p[1][1] + DRIFT_Q * dt;
+}
+
+/* The predicted error at time t, and its standard deviation in sigma
+   if that is not NULL. 0 if nothing has been measured yet. */
+
+double freq_track_predict(const struct freq_track *ft, double t,
+			  double *sigma)
+{
+  double x[2], p[2][2];
+
+  if (ft->num_meas == 0) {
+    if (sigma != NULL)
+      *sigma = INFINITY;
+    return 0;
+  }
+
+  predict(ft, t, x, p);
+  if (sigma != NULL)
+    *sigma = sqrt(p[0][0]);
+
+  return x[0];
+}
+
+/* Add a cal measurement made at time t. A measurement too far from the
+   prediction (a jump, such as after the dongle was reset) restarts the
+   track from it. Returns 1 if it did, 0 otherwise. */
+
+int freq_track_update(struct freq_track *ft, double t, double meas)
+{
+  double x[2], p[2][2], s, k0, k1, y;
+  int restart = ft->num_meas > 0;
+
+  if (ft->num_meas > 0) {
+    predict(ft, t, x, p);
+
+    y = meas - x[0];
+    s = p[0][0] + MEAS_SIGMA * MEAS_SIGMA;
+
+    if (fabs(y) <= GATE * sqrt(s)) {
+      k0 = p[0][0] / s;
+      k1 = p[1][0] / s;
+
+      ft->err = x[0] + k0 * y;
+      ft->rate = x[1] + k1 * y;
+      ft->p[0][0] = (1 - k0) * p[0][0];
+      ft->p[0][1] = (1 - k0) * p[0][1];
+      ft->p[1][0] = ft->p[0][1];
+      ft->p[1][1] = p[1][1] - k1 * p[0][1];
+      ft->t = t;
+      ft->num_meas++;
+      return 0;
+    }
+
+    fprintf(stderr, "  Frequency error jumped by %.0f Hz, restarting "
+	    "track\n", y);
+  }
+
+  ft->num_meas = 1;
+  ft->t = t;
+  ft->err = meas;
+  ft->rate = 0;
+  ft->p[0][0] = MEAS_SIGMA * MEAS_SIGMA;
+  ft->p[0][1] = ft->p[1][0] = 0;
+  ft->p[1][1] = RATE_SIGMA * RATE_SIGMA;
+
+  return restart;
+}
+
+/* Whether the prediction at time t is good to max_sigma (Hz). The
+   drift rate is only known after two measurements. */
+
+int freq_track_ok(const struct freq_track *ft, double t, double max_sigma)
+{
+  double sigma;
+
+  if (ft->num_meas < 2)
+    return 0;
+
+  freq_track_predict(ft, t, &sigma);
+
+  return sigma <= max_sigma;
+}
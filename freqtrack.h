@@ -0,0 +1,30 @@
+/*
+ * Frequency error tracking
+ *
+ * A dongle's frequency error drifts slowly and smoothly, mostly with
+ * temperature. Each channel tracks it with a two-state Kalman filter
+ * (the error and its drift rate, the rate doing a random walk) fed
+ * with the cal measurements, so that the calibrator need only be
+ * switched on every few cycles (CALEVERY). In between, the predicted
+ * error is used; once its standard deviation exceeds CALMAXSIGMA the
+ * channel asks for a cal sooner.
+ */
+
+#ifndef _FREQTRACK_H
+#define _FREQTRACK_H
+
+struct freq_track {
+  int num_meas; /* measurements since the track (re)started */
+  double t; /* time of the estimate, CLOCK_MONOTONIC seconds */
+  double err; /* Hz */
+  double rate; /* Hz per second */
+  double p[2][2]; /* covariance of (err, rate) */
+};
+
+void freq_track_reset(struct freq_track *ft);
+double freq_track_predict(const struct freq_track *ft, double t,
+			  double *sigma);
+int freq_track_update(struct freq_track *ft, double t, double meas);
+int freq_track_ok(const struct freq_track *ft, double t, double max_sigma);
+
+#endif /* _FREQTRACK_H */
@@ -0,0 +1,61 @@
+/*
+ * Generate the tables for the built-in FFT (fft768_tables.h)
+ *
+ * Run at build time, so the twiddle factors are compile-time constants
+ * computed in double precision.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include "common.h"
+
+#define N1 3
+#define N2 (FFT_LEN / N1)
+
+static void print_twiddle(double angle)
+{
+  printf("  { %.9ef, %.9ef },\n", cos(angle), -sin(angle));
+}
+
+int main(void)
+{
+  int n, k, r, d;
+
+  if ((N2 != 256) || (N1 * N2 != FFT_LEN)) {
+    fprintf(stderr, "gentwiddle: FFT_LEN must be 3 x 256\n");
+    return 1;
+  }
+
+  printf("/* Generated by gentwiddle, do not edit */\n\n");
+
+  /* W_768^(n * k1) for the radix-3 step, k1 = 1, 2 */
+
+  printf("static const float tw768[%d][%d][2] = {\n", N1 - 1, N2);
+  for (k = 1; k < N1; k++) {
+    printf(" {\n");
+    for (n = 0; n < N2; n++)
+      print_twiddle(2 * M_PI * n * k / FFT_LEN);
+    printf(" },\n");
+  }
+  printf("};\n\n");
+
+  /* W_256^n for the radix-4 stages (index < 3/4 * 256) */
+
+  printf("static const float tw256[%d][2] = {\n", 3 * N2 / 4);
+  for (n = 0; n < 3 * N2 / 4; n++)
+    print_twiddle(2 * M_PI * n / N2);
+  printf("};\n\n");
+
+  /* Base-4 digit reversal of 0..255 */
+
+  printf("static const unsigned char rev256[%d] = {\n", N2);
+  for (n = 0; n < N2; n++) {
+    for (r = 0, d = n, k = 0; k < 4; k++, d >>= 2)
+      r = (r << 2) | (d & 3);
+    printf("%s%3d,%s", (n % 16) == 0 ? "  " : " ", r,
+	   (n % 16) == 15 ? "\n" : "");
+  }
+  printf("};\n");
+
+  return 0;
+}
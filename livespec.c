@@ -0,0 +1,157 @@
+/*
+ * Live spectra in shared memory
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "livespec.h"
+
+#define READ_TRIES 1000
+
+static struct live_segment *segment = NULL;
+
+/* Create (or take over) the segment. Publishing is skipped if this
+   fails, which is not fatal to recording. */
+
+int live_init(int num_channels, const char sns[][MAX_SN_LEN])
+{
+  size_t size = LIVE_SEGMENT_SIZE(num_channels);
+  struct live_segment *seg;
+  int fd;
+
+  fd = shm_open(LIVE_SHM_NAME, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    perror("live_init: shm_open");
+    return 1;
+  }
+
+  if (ftruncate(fd, size) != 0) {
+    perror("live_init: ftruncate");
+    close(fd);
+    return 1;
+  }
+
+  seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED) {
+    perror("live_init: mmap");
+    return 1;
+  }
+
+  /* Readers check the magic value last */
+
+  __atomic_store_n(&seg->magic, 0, __ATOMIC_RELAXED);
+  memset(&seg->version, 0, size - sizeof(seg->magic));
+  seg->version = LIVE_VERSION;
+  seg->fft_len = FFT_LEN;
+  seg->num_channels = num_channels;
+  seg->pid = getpid();
+  for (int n = 0; n < num_channels; n++)
+    strncpy(seg->ch[n].dongle_sn, sns[n], MAX_SN_LEN - 1);
+  __atomic_store_n(&seg->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+
+  segment = seg;
+
+  fprintf(stderr, "Live spectra published in /dev/shm%s\n", LIVE_SHM_NAME);
+
+  return 0;
+}
+
+/* Called by a channel's recorder thread, the slot's only writer */
+
+void live_publish(int channel, uint64_t time_stamp, double freq_err,
+		  const uint32_t tuned_freq[2], const int spec_int[2],
+		  const struct ozo_sig_stats *level, const float *cal_spec,
+		  const float *spec)
+{
+  struct live_channel *c;
+  uint32_t seq;
+
+  if (segment == NULL)
+    return;
+
+  c = &segment->ch[channel];
+
+  seq = c->seq;
+  __atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  c->cycles++;
+  c->time_stamp = time_stamp;
+  c->freq_err = freq_err;
+  memcpy(c->tuned_freq, tuned_freq, sizeof(c->tuned_freq));
+  memcpy(c->spec_int, spec_int, sizeof(c->spec_int));
+  c->level = *level;
+  memcpy(c->cal_spec, cal_spec, sizeof(c->cal_spec));
+  memcpy(c->spec, spec, sizeof(c->spec));
+
+  __atomic_store_n(&c->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Map a published segment read-only. Returns NULL if there is none. */
+
+const struct live_segment *live_open(const char *name)
+{
+  struct live_segment *seg;
+  struct stat st;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(*seg))) {
+    close(fd);
+    return NULL;
+  }
+
+  /* The whole file, which the header says is for how many channels */
+
+  seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED)
+    return NULL;
+
+  if ((__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != LIVE_MAGIC)
+      || (seg->version != LIVE_VERSION) || (seg->fft_len != FFT_LEN)
+      || ((off_t)LIVE_SEGMENT_SIZE(seg->num_channels) > st.st_size)) {
+    munmap(seg, st.st_size);
+    return NULL;
+  }
+
+  return seg;
+}
+
+/* Take a consistent copy of a channel's slot. Returns 0 on success,
+   1 if the writer kept it busy for too long. */
+
+int live_read(const struct live_segment *seg, int channel,
+	      struct live_channel *out)
+{
+  const struct live_channel *c = &seg->ch[channel];
+  uint32_t s1, s2;
+
+  for (int n = 0; n < READ_TRIES; n++) {
+    s1 = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+    if (s1 & 1) {
+      sched_yield();
+      continue;
+    }
+
+    memcpy(out, c, sizeof(*out));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    if (s1 == s2) {
+      out->seq = s1;
+      return 0;
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,62 @@
+/*
+ * Live spectra in shared memory
+ *
+ * The recorder publishes each channel's latest cycle into a POSIX
+ * shared memory segment (/dev/shm/ozonespec). Every channel slot is
+ * guarded by a seqlock: the sequence number is odd while the slot is
+ * being written, so readers never take a lock and simply retry if it
+ * changed under them.
+ */
+
+#ifndef _LIVESPEC_H
+#define _LIVESPEC_H
+
+#include <stdint.h>
+#include "common.h"
+#include "ozofile.h"
+
+#define LIVE_SHM_NAME "/ozonespec"
+#define LIVE_MAGIC 0x4f5a4c56 /* "VLZO" */
+#define LIVE_VERSION 2
+
+struct live_channel {
+  uint32_t seq; /* odd while being written */
+  uint32_t cycles; /* published so far */
+  uint64_t time_stamp; /* of the cycle, as in the .ozo record */
+  char dongle_sn[MAX_SN_LEN];
+  double freq_err;
+  uint32_t tuned_freq[2];
+  int32_t spec_int[2];
+  struct ozo_sig_stats level;
+  float cal_spec[FFT_LEN];
+  float spec[2 * FFT_LEN]; /* upper then lower sideband, normalised */
+};
+
+struct live_segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fft_len;
+  uint32_t num_channels;
+  int32_t pid; /* of the publishing recorder */
+  uint32_t pad;
+  struct live_channel ch[]; /* num_channels of them */
+};
+
+#define LIVE_SEGMENT_SIZE(n) \
+  (sizeof(struct live_segment) + (size_t)(n) * sizeof(struct live_channel))
+
+/* Recorder side */
+
+int live_init(int num_channels, const char sns[][MAX_SN_LEN]);
+void live_publish(int channel, uint64_t time_stamp, double freq_err,
+		  const uint32_t tuned_freq[2], const int spec_int[2],
+		  const struct ozo_sig_stats *level, const float *cal_spec,
+		  const float *spec);
+
+/* Reader side */
+
+const struct live_segment *live_open(const char *name);
+int live_read(const struct live_segment *seg, int channel,
+	      struct live_channel *out);
+
+#endif /* _LIVESPEC_H */
@@ -0,0 +1,556 @@
+/*
+ * ozoagg: aggregate the records of many data files by time and channel
+ *
+ * Usage: ozoagg [-j threads] [-i interval] [-c channel]... [-f from]
+ *               [-t to] [-s] [-l] [-o output.oza] <file or directory>...
+ *
+ * The records of the given .ozo, .ozo.gz and .ozc files (directories
+ * are searched, not recursively) are grouped by channel and by time
+ * interval: "hour", "day" or a number of seconds (default hour),
+ * counted from 1970, so that hours and days start on the hour and at
+ * midnight UTC. For each group the number of records, the mean,
+ * standard deviation and range of the frequency error and a histogram
+ * of the max signal level (0 to 128) are kept, and with -s the mean of
+ * each bin of the cal and sideband spectra.
+ * Give either day files or their compactions, not both. -c, -f and -t
+ * select records as in ozoquery.
+ *
+ * Files are read in parallel, each into its own groups, which are then
+ * merged in file name order, so that the results do not depend on the
+ * number of threads.
+ *
+ * The groups are printed as CSV, in order of time then channel, with
+ * the histogram (-l) and mean spectra (-s) after the statistics. With
+ * -o they are written instead to a binary file: a struct oza_header,
+ * then num_groups struct oza_group, each followed by OZC_SPEC_BINS
+ * floats of mean spectra if the header has OZA_SPECTRA set. Values
+ * are in the byte order of the machine, as in .ozo files.
+ *
+ * The groups with spectra take 18 kB each while they are accumulated,
+ * so hourly spectra of a year of four channels need about 650 MB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ozoread.h"
+
+#define MAX_FILES 65536
+#define MAX_THREADS 64
+#define LEVEL_BINS 129 /* max_sig_level is 0 to 128 */
+
+#define OZA_MAGIC 0x47415a4f /* "OZAG" */
+#define OZA_VERSION 1
+#define OZA_SPECTRA 1 /* flag: mean spectra follow each group */
+
+struct oza_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fft_len;
+  uint32_t flags;
+  uint64_t interval; /* seconds */
+  uint64_t num_groups;
+};
+
+struct oza_group {
+  uint64_t start; /* of the interval, seconds since 1970 */
+  int32_t channel;
+  uint32_t records;
+  double freq_err_mean;
+  double freq_err_std;
+  double freq_err_min;
+  double freq_err_max;
+  uint32_t level_hist[LEVEL_BINS];
+  uint32_t pad;
+};
+
+/* A group while it is accumulated */
+
+struct group {
+  uint64_t start;
+  int32_t channel;
+  uint32_t records;
+  double freq_err_sum;
+  double freq_err_sq;
+  double freq_err_min;
+  double freq_err_max;
+  uint32_t level_hist[LEVEL_BINS];
+  double *spec; /* sums, or NULL without -s */
+};
+
+struct file_job {
+  char *path;
+  struct group *groups;
+  int num_groups;
+  long records;
+  long bad;
+  int error;
+  int done;
+};
+
+static struct file_job *files;
+static int num_files = 0;
+static int next_file = 0; /* taken with __atomic_fetch_add */
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct ozo_query query = { 0, UINT64_MAX, 0 };
+static uint64_t interval = 3600;
+static int spectra = 0;
+static int histogram = 0;
+
+static int by_path(const void *a, const void *b)
+{
+  return strcmp(((const struct file_job *)a)->path,
+		((const struct file_job *)b)->path);
+}
+
+static int by_key(uint64_t start, int32_t channel, const struct group *g)
+{
+  if (start != g->start)
+    return start < g->start ? -1 : 1;
+  if (channel != g->channel)
+    return channel < g->channel ? -1 : 1;
+  return 0;
+}
+
+/* The group for start and channel in a table sorted by key, inserting
+   an empty one if there is none. last is where the previous lookup
+   ended; records mostly come in order, so it is tried first. */
+
+static struct group *find_group(struct group **groups, int *num, int *last,
+				uint64_t start, int32_t channel)
+{
+  struct group *g = *groups, *p;
+  int lo = 0, hi = *num;
+
+  if ((*last < *num) && (by_key(start, channel, &g[*last]) == 0))
+    return &g[*last];
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (by_key(start, channel, &g[mid]) > 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if ((lo == *num) || (by_key(start, channel, &g[lo]) != 0)) {
+    p = realloc(g, (*num + 1) * sizeof(*g));
+    if (p == NULL)
+      return NULL;
+    g = *groups = p;
+    memmove(&g[lo + 1], &g[lo], (*num - lo) * sizeof(*g));
+    (*num)++;
+
+    memset(&g[lo], 0, sizeof(g[lo]));
+    g[lo].start = start;
+    g[lo].channel = channel;
+    if (spectra) {
+      g[lo].spec = calloc(OZC_SPEC_BINS, sizeof(double));
+      if (g[lo].spec == NULL)
+	return NULL;
+    }
+  }
+
+  *last = lo;
+  return &g[lo];
+}
+
+static void add_record(struct group *g, const struct ozo_source *src,
+		       const struct ozo_rec *rec)
+{
+  int level = rec->max_sig_level;
+
+  if ((g->records == 0) || (rec->freq_err < g->freq_err_min))
+    g->freq_err_min = rec->freq_err;
+  if ((g->records == 0) || (rec->freq_err > g->freq_err_max))
+    g->freq_err_max = rec->freq_err;
+  g->freq_err_sum += rec->freq_err;
+  g->freq_err_sq += rec->freq_err * rec->freq_err;
+  g->records++;
+
+  if (level < 0)
+    level = 0;
+  if (level >= LEVEL_BINS)
+    level = LEVEL_BINS - 1;
+  g->level_hist[level]++;
+
+  if (g->spec == NULL)
+    return;
+
+  if (rec->spec != NULL) {
+    double * restrict sum = g->spec;
+    const float * restrict s = rec->spec;
+
+    for (int b = 0; b < OZC_SPEC_BINS; b++)
+      sum[b] += s[b];
+  } else
+    for (int b = 0; b < OZC_SPEC_BINS; b++)
+      g->spec[b] += ozo_bin(src, rec, b);
+}
+
+/* Merge group s into d, which has the same key */
+
+static void merge_group(struct group *d, const struct group *s)
+{
+  if ((d->records == 0) || (s->freq_err_min < d->freq_err_min))
+    d->freq_err_min = s->freq_err_min;
+  if ((d->records == 0) || (s->freq_err_max > d->freq_err_max))
+    d->freq_err_max = s->freq_err_max;
+  d->freq_err_sum += s->freq_err_sum;
+  d->freq_err_sq += s->freq_err_sq;
+  d->records += s->records;
+
+  for (int k = 0; k < LEVEL_BINS; k++)
+    d->level_hist[k] += s->level_hist[k];
+
+  if (d->spec != NULL)
+    for (int b = 0; b < OZC_SPEC_BINS; b++)
+      d->spec[b] += s->spec[b];
+}
+
+static void free_groups(struct group *groups, int num)
+{
+  for (int k = 0; k < num; k++)
+    free(groups[k].spec);
+  free(groups);
+}
+
+static void aggregate_file(struct file_job *job)
+{
+  struct ozo_source src;
+  struct ozo_cursor *cur;
+  struct ozo_rec rec;
+  int last = 0;
+
+  cur = calloc(1, sizeof(*cur));
+  if ((cur == NULL) || (ozo_open(job->path, &src) != 0)) {
+    job->error = 1;
+    free(cur);
+    return;
+  }
+
+  while (ozo_next(&src, &query, cur, &rec)) {
+    struct group *g;
+
+    g = find_group(&job->groups, &job->num_groups, &last,
+		   rec.time_stamp - rec.time_stamp % interval, rec.channel);
+    if (g == NULL) {
+      job->error = 1;
+      break;
+    }
+    add_record(g, &src, &rec);
+    job->records++;
+  }
+  job->bad = cur->bad;
+
+  ozo_close(&src);
+  free(cur);
+}
+
+static void *worker(void *arg)
+{
+  int n;
+
+  while ((n = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED))
+	 < num_files) {
+    aggregate_file(&files[n]);
+
+    pthread_mutex_lock(&done_mutex);
+    files[n].done = 1;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&done_mutex);
+  }
+
+  return NULL;
+}
+
+static void add_file(const char *path)
+{
+  if (num_files >= MAX_FILES) {
+    fprintf(stderr, "Too many files, ignoring %s\n", path);
+    return;
+  }
+  files[num_files++].path = strdup(path);
+}
+
+static void add_path(const char *path)
+{
+  char file[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+
+  if ((stat(path, &st) != 0) || !S_ISDIR(st.st_mode)) {
+    add_file(path);
+    return;
+  }
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return;
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (!ozo_is_data_file(de->d_name))
+      continue;
+    if (snprintf(file, sizeof(file), "%s/%s", path, de->d_name)
+	>= (int)sizeof(file)) {
+      fprintf(stderr, "%s/%s: path too long\n", path, de->d_name);
+      continue;
+    }
+    add_file(file);
+  }
+  closedir(dir);
+}
+
+static void summarise(const struct group *g, struct oza_group *o)
+{
+  double mean = g->freq_err_sum / g->records;
+  double var = g->freq_err_sq / g->records - mean * mean;
+
+  memset(o, 0, sizeof(*o));
+  o->start = g->start;
+  o->channel = g->channel;
+  o->records = g->records;
+  o->freq_err_mean = mean;
+  o->freq_err_std = var > 0 ? sqrt(var) : 0;
+  o->freq_err_min = g->freq_err_min;
+  o->freq_err_max = g->freq_err_max;
+  memcpy(o->level_hist, g->level_hist, sizeof(o->level_hist));
+}
+
+static void mean_spectra(const struct group *g, float *mean)
+{
+  for (int b = 0; b < OZC_SPEC_BINS; b++)
+    mean[b] = g->spec[b] / g->records;
+}
+
+static void print_csv(const struct group *groups, int num)
+{
+  static float mean[OZC_SPEC_BINS];
+  struct oza_group o;
+
+  printf("start,channel,records,freq_err_mean,freq_err_std,freq_err_min,"
+	 "freq_err_max,level_max");
+  if (histogram)
+    for (int k = 0; k < LEVEL_BINS; k++)
+      printf(",level%d", k);
+  if (spectra)
+    for (int b = 0; b < OZC_SPEC_BINS; b++)
+      printf(",bin%d", b);
+  printf("\n");
+
+  for (int n = 0; n < num; n++) {
+    int level_max = LEVEL_BINS - 1;
+
+    summarise(&groups[n], &o);
+    while ((level_max > 0) && (o.level_hist[level_max] == 0))
+      level_max--;
+
+    printf("%llu,%d,%u,%.2f,%.2f,%.1f,%.1f,%d",
+	   (unsigned long long)o.start, o.channel, o.records, o.freq_err_mean,
+	   o.freq_err_std, o.freq_err_min, o.freq_err_max, level_max);
+    if (histogram)
+      for (int k = 0; k < LEVEL_BINS; k++)
+	printf(",%u", o.level_hist[k]);
+    if (spectra) {
+      mean_spectra(&groups[n], mean);
+      for (int b = 0; b < OZC_SPEC_BINS; b++)
+	printf(",%g", mean[b]);
+    }
+    printf("\n");
+  }
+}
+
+static int write_binary(const char *path, const struct group *groups,
+			int num)
+{
+  static float mean[OZC_SPEC_BINS];
+  struct oza_header h;
+  struct oza_group o;
+  FILE *fp;
+  int err = 0;
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot create %s\n", path);
+    return 1;
+  }
+
+  memset(&h, 0, sizeof(h));
+  h.magic = OZA_MAGIC;
+  h.version = OZA_VERSION;
+  h.fft_len = FFT_LEN;
+  h.flags = spectra ? OZA_SPECTRA : 0;
+  h.interval = interval;
+  h.num_groups = num;
+  err |= fwrite(&h, sizeof(h), 1, fp) != 1;
+
+  for (int n = 0; (n < num) && !err; n++) {
+    summarise(&groups[n], &o);
+    err |= fwrite(&o, sizeof(o), 1, fp) != 1;
+    if (spectra) {
+      mean_spectra(&groups[n], mean);
+      err |= fwrite(mean, sizeof(mean), 1, fp) != 1;
+    }
+  }
+
+  if ((fclose(fp) != 0) || err) {
+    fprintf(stderr, "Error writing %s\n", path);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: ozoagg [-j threads] [-i interval] [-c channel]... "
+	  "[-f from] [-t to] [-s] [-l] [-o output.oza] "
+	  "<file or directory>...\n");
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t threads[MAX_THREADS];
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct group *groups = NULL;
+  const char *output = NULL;
+  int num_groups = 0, last = 0;
+  long records = 0, bad = 0;
+  int opt, n, errors = 0;
+
+  while ((opt = getopt(argc, argv, "j:i:c:f:t:slo:")) != -1) {
+    switch (opt) {
+      case 'j':
+	num_threads = atoi(optarg);
+	break;
+      case 'i':
+	if (strcmp(optarg, "hour") == 0)
+	  interval = 3600;
+	else if (strcmp(optarg, "day") == 0)
+	  interval = 86400;
+	else
+	  interval = strtoull(optarg, NULL, 10);
+	if (interval == 0) {
+	  fprintf(stderr, "Bad interval %s\n", optarg);
+	  return 2;
+	}
+	break;
+      case 'c':
+	query.channels |= 1ull << (atoi(optarg) & 63);
+	break;
+      case 'f':
+	if (ozo_parse_time(optarg, 0, &query.from) != 0) {
+	  fprintf(stderr, "Bad time %s\n", optarg);
+	  return 2;
+	}
+	break;
+      case 't':
+	if (ozo_parse_time(optarg, 1, &query.to) != 0) {
+	  fprintf(stderr, "Bad time %s\n", optarg);
+	  return 2;
+	}
+	break;
+      case 's':
+	spectra = 1;
+	break;
+      case 'l':
+	histogram = 1;
+	break;
+      case 'o':
+	output = optarg;
+	break;
+      default:
+	usage();
+	return 2;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return 2;
+  }
+
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > MAX_THREADS)
+    num_threads = MAX_THREADS;
+
+  files = calloc(MAX_FILES, sizeof(struct file_job));
+  if (files == NULL) {
+    fprintf(stderr, "Cannot allocate file list\n");
+    return 2;
+  }
+
+  for (n = optind; n < argc; n++)
+    add_path(argv[n]);
+
+  qsort(files, num_files, sizeof(files[0]), by_path);
+
+  if (num_threads > num_files)
+    num_threads = num_files > 0 ? num_files : 1;
+
+  for (n = 0; n < num_threads; n++)
+    if (pthread_create(&threads[n], NULL, worker, NULL) != 0) {
+      fprintf(stderr, "Cannot start thread\n");
+      return 2;
+    }
+
+  /* Merge each file's groups as soon as it and those before it are
+     done, so that only the files in progress are held apart */
+
+  for (n = 0; n < num_files; n++) {
+    struct file_job *job = &files[n];
+
+    pthread_mutex_lock(&done_mutex);
+    while (!job->done)
+      pthread_cond_wait(&done_cond, &done_mutex);
+    pthread_mutex_unlock(&done_mutex);
+
+    if (job->error) {
+      fprintf(stderr, "%s: cannot read\n", job->path);
+      errors++;
+    } else if (job->bad > 0)
+      fprintf(stderr, "%s: %ld bad records left out\n", job->path, job->bad);
+
+    for (int k = 0; (k < job->num_groups) && !job->error; k++) {
+      const struct group *s = &job->groups[k];
+      struct group *d;
+
+      d = find_group(&groups, &num_groups, &last, s->start, s->channel);
+      if (d == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	return 2;
+      }
+      merge_group(d, s);
+    }
+    records += job->records;
+    bad += job->bad;
+
+    free_groups(job->groups, job->num_groups);
+    job->groups = NULL;
+  }
+
+  for (n = 0; n < num_threads; n++)
+    pthread_join(threads[n], NULL);
+
+  if (output != NULL)
+    errors += write_binary(output, groups, num_groups);
+  else
+    print_csv(groups, num_groups);
+
+  fprintf(stderr, "%d files, %ld records, %ld bad, %d groups\n", num_files,
+	  records, bad, num_groups);
+
+  return errors > 0 ? 1 : 0;
+}
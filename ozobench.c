@@ -0,0 +1,221 @@
+/*
+ * ozobench: how many channels the spectrum computation can sustain
+ *
+ * Usage: ozobench [-t max threads] [-s seconds] [-r hires factor]
+ *                 [-b fft backend] [-p spectrum threads]
+ *
+ * Runs the computational threads' work (spectra of each read, spectral
+ * kurtosis per block) on synthetic samples in 1, 2, 4, ... threads up
+ * to the number of cores, and reports the throughput against the rate
+ * one dongle delivers. A channel is on source for less than the whole
+ * cycle, so these are lower bounds. With -p each thread splits its
+ * reads between that many (as SPECTHREADS), which shows how fast one
+ * channel can go. Capture and file writing are not included; run
+ * ozonespec with SYNTH dongles for the whole pipeline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "common.h"
+#include "fftbackend.h"
+#include "signalproc.h"
+#include "timeutil.h"
+#include "specpool.h"
+
+#define READ_SIZE (16384 * 256) /* as the default cycle shape */
+#define NUM_BLOCKS 4
+#define SK_SIGMA 4.0
+#define MAX_THREADS 256
+
+struct bench {
+  pthread_t thread;
+  const struct fft_backend *fft;
+  const struct fft_backend *hires_fft;
+  int spec_threads;
+  double seconds;
+  double bytes; /* processed */
+};
+
+static void *bench_thread(void *arg)
+{
+  struct bench *b = arg;
+  int tile_len = b->hires_fft != NULL ? b->hires_fft->len : FFT_LEN;
+  float spec[FFT_LEN], sq[FFT_LEN], block[FFT_LEN], block_sq[FFT_LEN];
+  uint8_t flags[FFT_LEN];
+  struct spec_res res;
+  struct sig_stats stats;
+  fft_complex *tile, *out;
+  struct timespec t0;
+  uint32_t x = 2463534242u + (uint32_t)(size_t)b;
+  uint8_t *data;
+  float *hires;
+  int nspec, block_nspec;
+  struct spec_pool pool;
+
+  data = malloc(READ_SIZE);
+  hires = calloc(tile_len, sizeof(float));
+  tile = fftwf_alloc_complex(tile_len);
+  out = fftwf_alloc_complex(tile_len);
+  if ((data == NULL) || (hires == NULL) || (tile == NULL) || (out == NULL)) {
+    fprintf(stderr, "Cannot allocate benchmark buffers\n");
+    return NULL;
+  }
+
+  for (int k = 0; k < READ_SIZE; k++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    data[k] = 127 + (int)(x & 0x1f) - 16;
+  }
+
+  res.fft = b->hires_fft;
+  res.spec = hires;
+
+  spec_pool_init(&pool, b->spec_threads);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  while (time_since(&t0) < b->seconds) {
+    memset(block, 0, sizeof(block));
+    memset(block_sq, 0, sizeof(block_sq));
+    block_nspec = 0;
+
+    for (int n = 0; n < NUM_BLOCKS; n++) {
+      res.num_spec = 0;
+      spec_pool_spectra(&pool, data, READ_SIZE, spec, sq, &nspec, NULL,
+			b->fft, tile, out, &stats, &res,
+			b->hires_fft != NULL ? 1 : 0);
+      for (int k = 0; k < FFT_LEN; k++) {
+	block[k] += spec[k];
+	block_sq[k] += sq[k];
+      }
+      block_nspec += nspec;
+      b->bytes += READ_SIZE;
+    }
+
+    sk_flag(block, block_sq, block_nspec, SK_SIGMA, flags);
+  }
+
+  b->seconds = time_since(&t0);
+
+  spec_pool_free(&pool);
+  free(data);
+  free(hires);
+  fftwf_free(tile);
+  fftwf_free(out);
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench *b;
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cores, factor = 0, backend = FFT_FFTW, opt;
+  int spec_threads = 1;
+  int t = 1, best_t = 1;
+  double seconds = 5, best = 0, dongle_rate = 2.0 * SAMPLERATE;
+  const struct fft_backend *hires_fft = NULL;
+
+  while ((opt = getopt(argc, argv, "t:s:r:b:p:")) != -1) {
+    switch (opt) {
+      case 't':
+	max_threads = atoi(optarg);
+	break;
+      case 's':
+	seconds = atof(optarg);
+	break;
+      case 'r':
+	factor = atoi(optarg);
+	break;
+      case 'b':
+	backend = fft_backend_id(optarg);
+	if (backend < 0) {
+	  fprintf(stderr, "Unknown FFT backend %s\n", optarg);
+	  return 2;
+	}
+	break;
+      case 'p':
+	spec_threads = atoi(optarg);
+	break;
+      default:
+	fprintf(stderr, "Usage: ozobench [-t max threads] [-s seconds] "
+		"[-r hires factor] [-b fft backend] [-p spectrum threads]\n");
+	return 2;
+    }
+  }
+
+  if (max_threads < 1)
+    max_threads = 1;
+  if (max_threads > MAX_THREADS)
+    max_threads = MAX_THREADS;
+  if ((spec_threads < 1) || (spec_threads > MAX_SPEC_THREADS))
+    spec_threads = 1;
+
+  init_convtab();
+  if (init_fft() != 0)
+    return 1;
+
+  if (factor != 0) {
+    fft_plan_hires(&factor, 1);
+    hires_fft = fft_get_hires(factor);
+    if (hires_fft == NULL) {
+      fprintf(stderr, "Cannot use hires factor %d\n", factor);
+      return 2;
+    }
+  }
+
+  b = calloc(max_threads, sizeof(*b));
+  if (b == NULL)
+    return 1;
+
+  printf("%d cores, FFT %s%s, %d spectrum threads, %.1f s per step\n",
+	 cores, fft_get(backend)->name, hires_fft != NULL ? " + hires" : "",
+	 spec_threads, seconds);
+  printf("threads   MB/s  channels  per thread\n");
+
+  for (;;) {
+    double rate = 0, channels;
+
+    for (int n = 0; n < t; n++) {
+      b[n].fft = fft_get(backend);
+      b[n].hires_fft = hires_fft;
+      b[n].spec_threads = spec_threads;
+      b[n].seconds = seconds;
+      b[n].bytes = 0;
+      if (pthread_create(&b[n].thread, NULL, bench_thread, &b[n]) != 0) {
+	fprintf(stderr, "Cannot start thread\n");
+	return 1;
+      }
+    }
+
+    for (int n = 0; n < t; n++) {
+      pthread_join(b[n].thread, NULL);
+      rate += b[n].bytes / b[n].seconds;
+    }
+
+    channels = rate / dongle_rate;
+    if (channels > best) {
+      best = channels;
+      best_t = t;
+    }
+
+    printf("%7d %6.1f %9.1f %11.2f\n", t, rate / 1048576.0, channels,
+	   channels / t);
+
+    if (t == max_threads)
+      break;
+    t = 2 * t < max_threads ? 2 * t : max_threads;
+  }
+
+  best_t *= spec_threads;
+  printf("At most %d channels in real time, %.1f per core\n", (int)best,
+	 best / (best_t < cores ? best_t : cores));
+
+  free(b);
+
+  return 0;
+}
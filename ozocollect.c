@@ -0,0 +1,358 @@
+/*
+ * ozocollect: reference collector for exported records
+ *
+ * Usage: ozocollect [-p port] [-d dir]
+ *
+ * Accepts stations streaming their records (EXPORT in ozonespec.conf)
+ * on the given port (default 4455), one connection at a time, and
+ * appends the records to day files in dir (default the current
+ * directory) named as on the station, YYYYMMDD_sNNN.ozo. The next
+ * sequence number wanted from each station is kept in sNNN.seq and
+ * only moved on, and a batch acknowledged, once its records are on
+ * disk, so a batch is never lost and records sent again are skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "export.h"
+#include "ozofile.h"
+#include "crc32c.h"
+#include "ozorecord.h"
+
+#define COLLECT_TIMEOUT 300 /* seconds of silence before hanging up */
+
+static const char *dir = ".";
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+  uint8_t *p = buf;
+
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR))
+	continue;
+      return 1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int send_ack(int fd, uint64_t next_seq)
+{
+  struct export_ack ack = { EXPORT_ACK_MAGIC, 0, next_seq };
+
+  return send(fd, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack);
+}
+
+/* The next sequence number wanted from a station, 0 if it is new.
+   Returns 0 on success. */
+
+static int load_seq(int vsrt_num, uint64_t *next_seq)
+{
+  char path[_POSIX_PATH_MAX];
+  unsigned long long seq = 0;
+  FILE *fp;
+
+  if (snprintf(path, sizeof(path), "%s/s%03d.seq", dir, vsrt_num)
+      >= (int)sizeof(path))
+    return 1;
+  fp = fopen(path, "r");
+  if (fp != NULL) {
+    if (fscanf(fp, "%llu", &seq) != 1)
+      seq = 0;
+    fclose(fp);
+  }
+
+  *next_seq = seq;
+  return 0;
+}
+
+/* Replace sNNN.seq, so that it is always either the old number or the
+   new one */
+
+static int save_seq(int vsrt_num, uint64_t seq)
+{
+  char path[_POSIX_PATH_MAX], tmp[_POSIX_PATH_MAX];
+  FILE *fp;
+  int r;
+
+  if ((snprintf(path, sizeof(path), "%s/s%03d.seq", dir, vsrt_num)
+       >= (int)sizeof(path))
+      || (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)))
+    return 1;
+  fp = fopen(tmp, "w");
+  if (fp == NULL)
+    return 1;
+  r = fprintf(fp, "%llu\n", (unsigned long long)seq) < 0;
+  r |= fflush(fp) != 0;
+  r |= fdatasync(fileno(fp)) != 0;
+  r |= fclose(fp) != 0;
+
+  return r || (rename(tmp, path) != 0);
+}
+
+/* Append a record to the day file of its time stamp. *fp and name hold
+   the file last written. */
+
+static int append(const uint8_t *rec, uint32_t len, int vsrt_num, FILE **fp,
+		  char *name)
+{
+  char path[_POSIX_PATH_MAX];
+  uint64_t time_stamp;
+  struct tm tms;
+  time_t t;
+
+  memcpy(&time_stamp, &rec[OFF_TIME_STAMP], sizeof(time_stamp));
+  t = (time_t)(time_stamp - time_stamp % 86400);
+  gmtime_r(&t, &tms);
+  if (snprintf(path, sizeof(path), "%s/%04d%02d%02d_s%03d.ozo", dir,
+	       1900 + tms.tm_year, tms.tm_mon + 1, tms.tm_mday, vsrt_num)
+      >= (int)sizeof(path)) {
+    fprintf(stderr, "Day file path too long in %s\n", dir);
+    return 1;
+  }
+
+  if ((*fp != NULL) && (strcmp(path, name) != 0)) {
+    if ((fflush(*fp) != 0) || (fdatasync(fileno(*fp)) != 0)) {
+      fclose(*fp);
+      *fp = NULL;
+      return 1;
+    }
+    fclose(*fp);
+    *fp = NULL;
+  }
+
+  if (*fp == NULL) {
+    *fp = fopen(path, "ab");
+    if (*fp == NULL) {
+      fprintf(stderr, "Cannot open %s\n", path);
+      return 1;
+    }
+    strcpy(name, path);
+  }
+
+  return fwrite(rec, len, 1, *fp) != 1;
+}
+
+/* Take batches from a station until it hangs up or sends something
+   wrong */
+
+static void serve(int fd, const char *peer)
+{
+  struct export_hello hello;
+  struct export_batch b;
+  uint8_t *payload = NULL, *raw = NULL;
+  char name[_POSIX_PATH_MAX] = "";
+  uint64_t next_seq;
+  FILE *fp = NULL;
+
+  if ((recv_all(fd, &hello, sizeof(hello)) != 0)
+      || (hello.magic != EXPORT_HELLO_MAGIC)
+      || (hello.version != EXPORT_VERSION) || (hello.fft_len != FFT_LEN)
+      || (hello.vsrt_num < 0) || (hello.vsrt_num > 999)) {
+    fprintf(stderr, "%s: not a station\n", peer);
+    return;
+  }
+
+  if (load_seq(hello.vsrt_num, &next_seq) != 0) {
+    fprintf(stderr, "%s: path too long in %s\n", peer, dir);
+    return;
+  }
+  fprintf(stderr, "%s: station %03d %.16s, wanting %llu (it is at %llu)\n",
+	  peer, hello.vsrt_num, hello.station_name,
+	  (unsigned long long)next_seq, (unsigned long long)hello.next_seq);
+  if (send_ack(fd, next_seq) != 0)
+    return;
+
+  payload = malloc(compressBound(EXPORT_MAX_BATCH));
+  raw = malloc(EXPORT_MAX_BATCH);
+  if ((payload == NULL) || (raw == NULL)) {
+    fprintf(stderr, "Out of memory\n");
+    goto done;
+  }
+
+  while (recv_all(fd, &b, sizeof(b)) == 0) {
+    const uint8_t *d = payload;
+    uint64_t seq = b.first_seq;
+    size_t off = 0;
+    long added = 0;
+
+    if ((b.magic != EXPORT_BATCH_MAGIC) || (b.raw_len > EXPORT_MAX_BATCH)
+	|| (b.len > compressBound(EXPORT_MAX_BATCH))) {
+      fprintf(stderr, "%s: bad batch\n", peer);
+      break;
+    }
+    if (recv_all(fd, payload, b.len) != 0)
+      break;
+    if (crc32c(0, payload, b.len) != b.crc) {
+      fprintf(stderr, "%s: bad CRC on batch from %llu\n", peer,
+	      (unsigned long long)b.first_seq);
+      break;
+    }
+
+    if (b.flags & EXPORT_DEFLATE) {
+      uLongf raw_len = b.raw_len;
+
+      if ((uncompress(raw, &raw_len, payload, b.len) != Z_OK)
+	  || (raw_len != b.raw_len)) {
+	fprintf(stderr, "%s: cannot inflate batch from %llu\n", peer,
+		(unsigned long long)b.first_seq);
+	break;
+      }
+      d = raw;
+    } else if (b.len != b.raw_len)
+      break;
+
+    if ((next_seq > 0) && (b.first_seq > next_seq))
+      fprintf(stderr, "%s: records %llu to %llu lost by the station\n", peer,
+	      (unsigned long long)next_seq,
+	      (unsigned long long)(b.first_seq - 1));
+
+    for (uint32_t k = 0; k < b.count; k++, seq++) {
+      uint32_t rec_len = ozo_record_len(&d[off], b.raw_len - off);
+
+      if (rec_len == 0) {
+	fprintf(stderr, "%s: bad record %llu\n", peer,
+		(unsigned long long)seq);
+	goto done;
+      }
+      if (seq >= next_seq) {
+	if (append(&d[off], rec_len, hello.vsrt_num, &fp, name) != 0) {
+	  fprintf(stderr, "Cannot write %s\n", name);
+	  goto done;
+	}
+	added++;
+      }
+      off += rec_len;
+    }
+
+    /* Only what is on disk is acknowledged */
+
+    if ((fp != NULL)
+	&& ((fflush(fp) != 0) || (fdatasync(fileno(fp)) != 0))) {
+      fprintf(stderr, "Cannot write %s\n", name);
+      break;
+    }
+    if (seq > next_seq) {
+      next_seq = seq;
+      if (save_seq(hello.vsrt_num, next_seq) != 0) {
+	fprintf(stderr, "Cannot save the sequence number of station %03d\n",
+		hello.vsrt_num);
+	break;
+      }
+    }
+    fprintf(stderr, "%s: %ld records to %llu%s\n", peer, added,
+	    (unsigned long long)(seq - 1),
+	    (b.flags & EXPORT_DEFLATE) ? " (deflated)" : "");
+
+    if (send_ack(fd, next_seq) != 0)
+      break;
+  }
+
+ done:
+  if (fp != NULL)
+    fclose(fp);
+  free(payload);
+  free(raw);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: ozocollect [-p port] [-d dir]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct addrinfo hints, *res;
+  struct timeval tv = { COLLECT_TIMEOUT, 0 };
+  const char *port = "4455";
+  int opt, lfd, r, one = 1;
+
+  while ((opt = getopt(argc, argv, "p:d:")) != -1) {
+    switch (opt) {
+      case 'p':
+	port = optarg;
+	break;
+      case 'd':
+	dir = optarg;
+	break;
+      default:
+	usage();
+	return 2;
+    }
+  }
+
+  if (optind != argc) {
+    usage();
+    return 2;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET6;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  r = getaddrinfo(NULL, port, &hints, &res);
+  if (r != 0) {
+    hints.ai_family = AF_INET;
+    r = getaddrinfo(NULL, port, &hints, &res);
+  }
+  if (r != 0) {
+    fprintf(stderr, "Port %s: %s\n", port, gai_strerror(r));
+    return 1;
+  }
+
+  lfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (lfd >= 0)
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if ((lfd < 0) || (bind(lfd, res->ai_addr, res->ai_addrlen) != 0)
+      || (listen(lfd, 4) != 0)) {
+    perror("ozocollect");
+    return 1;
+  }
+  freeaddrinfo(res);
+
+  fprintf(stderr, "Collecting on port %s into %s\n", port, dir);
+
+  for (;;) {
+    struct sockaddr_storage sa;
+    socklen_t sa_len = sizeof(sa);
+    char host[NI_MAXHOST], serv[NI_MAXSERV], peer[NI_MAXHOST + NI_MAXSERV];
+    int fd;
+
+    fd = accept(lfd, (struct sockaddr *)&sa, &sa_len);
+    if (fd < 0) {
+      if (errno != EINTR)
+	perror("accept");
+      continue;
+    }
+
+    if (getnameinfo((struct sockaddr *)&sa, sa_len, host, sizeof(host), serv,
+		    sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+      snprintf(peer, sizeof(peer), "%s:%s", host, serv);
+    else
+      strcpy(peer, "?");
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    serve(fd, peer);
+    close(fd);
+    fprintf(stderr, "%s: disconnected\n", peer);
+  }
+
+  return 0;
+}
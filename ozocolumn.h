@@ -0,0 +1,87 @@
+/*
+ * Columnar compaction (.ozc) file format
+ *
+ * ozocompact rewrites closed day files into a single .ozc file in which
+ * each header field is a separate array over all the records, so that a
+ * scan of, say, freq_err over a year reads only that. Records are in
+ * order of time stamp, then channel. The spectra (cal, upper and lower
+ * sideband: 3 * FFT_LEN bins per record) are stored record-major, as
+ * in the day files, or bin-major, where each bin is an array over the
+ * records. Every OZC_BLOCK_LEN records have a block entry with the
+ * range of their time stamps and other fields, so that a query can
+ * skip whole blocks. Extension blocks are not carried over; they stay
+ * in the day files.
+ *
+ * All sections start at a multiple of OZC_ALIGN bytes. Values are in
+ * the byte order of the machine that wrote the file, as in .ozo files.
+ */
+
+#ifndef _OZOCOLUMN_H
+#define _OZOCOLUMN_H
+
+#include <stdint.h>
+#include "common.h"
+
+#define OZC_MAGIC 0x4c435a4f /* "OZCL" */
+#define OZC_VERSION 1
+#define OZC_ALIGN 64
+#define OZC_BLOCK_LEN 1024 /* records per block entry */
+#define OZC_SPEC_BINS (3 * FFT_LEN) /* cal, upper, lower */
+
+#define OZC_RECORD_MAJOR 0 /* spec[record][bin] */
+#define OZC_BIN_MAJOR 1 /* spec[bin][record] */
+
+/* Sections, in file order */
+
+#define OZC_TIME_STAMP 0 /* uint64_t[num_records] */
+#define OZC_CHANNEL 1 /* int32_t[num_records] */
+#define OZC_META 2 /* uint32_t[num_records]: index into OZC_META_TABLE */
+#define OZC_FREQ_ERR 3 /* double[num_records] */
+#define OZC_SPEC_INT 4 /* int32_t[num_records][2] */
+#define OZC_MAX_SIG_LEVEL 5 /* int32_t[num_records] */
+#define OZC_SPEC 6 /* float, OZC_SPEC_BINS per record, as layout */
+#define OZC_BLOCKS 7 /* struct ozc_block[num_blocks] */
+#define OZC_META_TABLE 8 /* struct ozc_meta[num_meta] */
+#define OZC_NUM_SECTIONS 9
+
+struct ozc_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fft_len;
+  uint32_t layout; /* OZC_RECORD_MAJOR or OZC_BIN_MAJOR */
+  uint64_t num_records;
+  uint32_t num_blocks;
+  uint32_t num_meta;
+  uint64_t offset[OZC_NUM_SECTIONS]; /* of each section, bytes */
+  uint64_t file_len;
+  uint32_t bad_records; /* left out of the compaction */
+  uint32_t crc; /* CRC-32C of the header up to here */
+};
+
+/* Per-channel settings, as in the record headers. Each distinct
+   combination in the day files gets an entry. */
+
+struct ozc_meta {
+  int32_t channel;
+  int32_t vsrt_num;
+  double line_freq;
+  char dongle_sn[MAX_SN_LEN];
+  char station_name[16];
+};
+
+/* The range of each field over records first to first + count - 1 */
+
+struct ozc_block {
+  uint64_t first;
+  uint32_t count;
+  uint32_t pad;
+  uint64_t time_min;
+  uint64_t time_max;
+  uint64_t channels; /* bit (channel % 64) set for each channel present */
+  double freq_err_min;
+  double freq_err_max;
+  int32_t level_min; /* of max_sig_level */
+  int32_t level_max;
+};
+
+#endif /* _OZOCOLUMN_H */
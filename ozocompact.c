@@ -0,0 +1,487 @@
+/*
+ * ozocompact: rewrite closed day files as a columnar compaction
+ *
+ * Usage: ozocompact [-b] [-f] [-o output.ozc] <file or directory>...
+ *
+ * The good records of the given .ozo and .ozo.gz day files (directories
+ * are searched, not recursively) are written to one .ozc file, sorted
+ * by time stamp and channel; see ozocolumn.h. With -b the spectra are
+ * stored bin-major, which suits scans of a few bins over many records,
+ * otherwise record-major. Today's and later day files may still be
+ * written to and are refused unless -f is given. With a single input
+ * the output defaults to its name with .ozc for .ozo or .ozo.gz;
+ * typical use is a month of day files into 202401_s000.ozc. The day
+ * files are left as they are.
+ *
+ * All the inputs are held in memory (day files are mapped, compressed
+ * ones read in) while the output is written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "ozofile.h"
+#include "ozocolumn.h"
+#include "ozoread.h"
+
+#define MAX_FILES 4096
+#define MAX_META 1024
+#define TRANSPOSE_BYTES (64 << 20) /* buffer for bin-major spectra */
+
+struct entry {
+  uint64_t time_stamp;
+  int32_t channel;
+  uint32_t meta;
+  double freq_err;
+  int32_t spec_int[2];
+  int32_t max_sig_level;
+  uint64_t seq; /* read order, to keep the sort stable */
+  const uint8_t *raw;
+};
+
+static char *files[MAX_FILES];
+static int num_files = 0;
+static struct ozc_meta meta[MAX_META];
+static int num_meta = 0;
+
+static int by_name(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int by_time(const void *a, const void *b)
+{
+  const struct entry *x = a, *y = b;
+
+  if (x->time_stamp != y->time_stamp)
+    return x->time_stamp < y->time_stamp ? -1 : 1;
+  if (x->channel != y->channel)
+    return x->channel < y->channel ? -1 : 1;
+  return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static void add_file(const char *path)
+{
+  size_t n = strlen(path);
+
+  if ((n > 4) && (strcmp(&path[n - 4], ".ozc") == 0))
+    return;
+  if (num_files >= MAX_FILES) {
+    fprintf(stderr, "Too many files, ignoring %s\n", path);
+    return;
+  }
+  files[num_files++] = strdup(path);
+}
+
+static void add_path(const char *path)
+{
+  char file[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+
+  if ((stat(path, &st) != 0) || !S_ISDIR(st.st_mode)) {
+    add_file(path);
+    return;
+  }
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return;
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (!ozo_is_data_file(de->d_name))
+      continue;
+    if (snprintf(file, sizeof(file), "%s/%s", path, de->d_name)
+	>= (int)sizeof(file)) {
+      fprintf(stderr, "%s/%s: path too long\n", path, de->d_name);
+      continue;
+    }
+    add_file(file);
+  }
+  closedir(dir);
+}
+
+/* A day file is closed once its day (from the name, YYYYMMDD_...) is
+   over */
+
+static int is_closed(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  char today[16];
+  time_t t = time(NULL);
+
+  name = name == NULL ? path : name + 1;
+  strftime(today, sizeof(today), "%Y%m%d", gmtime(&t));
+
+  return (strlen(name) >= 8) && (strncmp(name, today, 8) < 0);
+}
+
+/* The metadata table entry for a record, adding one if it is new */
+
+static int meta_index(const uint8_t *raw, int32_t channel, uint32_t *index)
+{
+  struct ozc_meta m;
+
+  memset(&m, 0, sizeof(m));
+  m.channel = channel;
+  memcpy(&m.vsrt_num, &raw[OFF_VSRT_NUM], 4);
+  memcpy(&m.line_freq, &raw[OFF_LINE_FREQ], 8);
+  memcpy(m.dongle_sn, &raw[OFF_DONGLE_SN], MAX_SN_LEN);
+  memcpy(m.station_name, &raw[OFF_STATION_NAME], sizeof(m.station_name));
+  m.dongle_sn[MAX_SN_LEN - 1] = '\0';
+  m.station_name[sizeof(m.station_name) - 1] = '\0';
+
+  for (int k = 0; k < num_meta; k++)
+    if (memcmp(&meta[k], &m, sizeof(m)) == 0) {
+      *index = k;
+      return 0;
+    }
+
+  if (num_meta == MAX_META)
+    return 1;
+  meta[num_meta] = m;
+  *index = num_meta++;
+  return 0;
+}
+
+/* Write len bytes, then pad to the next section boundary. Returns 0
+   on success. */
+
+static int put_section(FILE *fp, const void *data, size_t len,
+		       uint64_t *offset)
+{
+  static const uint8_t zeros[OZC_ALIGN];
+  off_t pos = ftello(fp);
+
+  if (pos < 0)
+    return 1;
+  if (pos % OZC_ALIGN != 0)
+    if (fwrite(zeros, OZC_ALIGN - pos % OZC_ALIGN, 1, fp) != 1)
+      return 1;
+
+  *offset = ftello(fp);
+
+  return (len > 0) && (fwrite(data, len, 1, fp) != 1);
+}
+
+static void *column(const struct entry *e, uint64_t n, size_t size,
+		    size_t field)
+{
+  uint8_t *c = malloc(n * size + 1);
+
+  if (c != NULL)
+    for (uint64_t i = 0; i < n; i++)
+      memcpy(&c[i * size], (const uint8_t *)&e[i] + field, size);
+
+  return c;
+}
+
+/* The spectra section, after the metadata columns */
+
+static int put_spectra(FILE *fp, const struct entry *e, uint64_t n,
+		       int layout, uint64_t *offset)
+{
+  float spec[OZC_SPEC_BINS];
+  float *buf;
+  uint64_t rows;
+
+  if (put_section(fp, NULL, 0, offset) != 0)
+    return 1;
+
+  if (layout == OZC_RECORD_MAJOR) {
+    for (uint64_t i = 0; i < n; i++) {
+      memcpy(spec, &e[i].raw[OFF_CAL_SPEC], sizeof(spec));
+      if (fwrite(spec, sizeof(spec), 1, fp) != 1)
+	return 1;
+    }
+    return 0;
+  }
+
+  /* Bin-major: transpose as many bins at a time as fit the buffer */
+
+  if (n == 0)
+    return 0;
+  rows = TRANSPOSE_BYTES / (n * sizeof(float));
+  if (rows < 1)
+    rows = 1;
+  if (rows > OZC_SPEC_BINS)
+    rows = OZC_SPEC_BINS;
+
+  buf = malloc(rows * n * sizeof(float));
+  if (buf == NULL)
+    return 1;
+
+  for (uint64_t b0 = 0; b0 < OZC_SPEC_BINS; b0 += rows) {
+    uint64_t nb = OZC_SPEC_BINS - b0 < rows ? OZC_SPEC_BINS - b0 : rows;
+
+    for (uint64_t i = 0; i < n; i++) {
+      memcpy(spec, &e[i].raw[OFF_CAL_SPEC + b0 * sizeof(float)],
+	     nb * sizeof(float));
+      for (uint64_t b = 0; b < nb; b++)
+	buf[b * n + i] = spec[b];
+    }
+    if (fwrite(buf, nb * n * sizeof(float), 1, fp) != 1) {
+      free(buf);
+      return 1;
+    }
+  }
+
+  free(buf);
+  return 0;
+}
+
+static struct ozc_block *make_blocks(const struct entry *e, uint64_t n,
+				     uint32_t *num_blocks)
+{
+  struct ozc_block *blocks;
+
+  *num_blocks = (n + OZC_BLOCK_LEN - 1) / OZC_BLOCK_LEN;
+  blocks = calloc(*num_blocks + 1, sizeof(*blocks));
+  if (blocks == NULL)
+    return NULL;
+
+  for (uint32_t k = 0; k < *num_blocks; k++) {
+    struct ozc_block *b = &blocks[k];
+
+    b->first = (uint64_t)k * OZC_BLOCK_LEN;
+    b->count = n - b->first < OZC_BLOCK_LEN ? n - b->first : OZC_BLOCK_LEN;
+    b->time_min = e[b->first].time_stamp;
+    b->time_max = e[b->first + b->count - 1].time_stamp;
+    b->freq_err_min = b->freq_err_max = e[b->first].freq_err;
+    b->level_min = b->level_max = e[b->first].max_sig_level;
+
+    for (uint64_t i = b->first; i < b->first + b->count; i++) {
+      b->channels |= 1ull << (e[i].channel & 63);
+      if (e[i].freq_err < b->freq_err_min)
+	b->freq_err_min = e[i].freq_err;
+      if (e[i].freq_err > b->freq_err_max)
+	b->freq_err_max = e[i].freq_err;
+      if (e[i].max_sig_level < b->level_min)
+	b->level_min = e[i].max_sig_level;
+      if (e[i].max_sig_level > b->level_max)
+	b->level_max = e[i].max_sig_level;
+    }
+  }
+
+  return blocks;
+}
+
+static int write_compaction(const char *path, const struct entry *e,
+			    uint64_t n, int layout, long bad)
+{
+  char tmp[_POSIX_PATH_MAX + 8];
+  struct ozc_header h;
+  struct ozc_block *blocks;
+  void *col[OZC_SPEC];
+  FILE *fp;
+  int err = 0;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = OZC_MAGIC;
+  h.version = OZC_VERSION;
+  h.fft_len = FFT_LEN;
+  h.layout = layout;
+  h.num_records = n;
+  h.num_meta = num_meta;
+  h.bad_records = bad;
+
+  col[OZC_TIME_STAMP] = column(e, n, 8, offsetof(struct entry, time_stamp));
+  col[OZC_CHANNEL] = column(e, n, 4, offsetof(struct entry, channel));
+  col[OZC_META] = column(e, n, 4, offsetof(struct entry, meta));
+  col[OZC_FREQ_ERR] = column(e, n, 8, offsetof(struct entry, freq_err));
+  col[OZC_SPEC_INT] = column(e, n, 8, offsetof(struct entry, spec_int));
+  col[OZC_MAX_SIG_LEVEL] = column(e, n, 4,
+				  offsetof(struct entry, max_sig_level));
+  blocks = make_blocks(e, n, &h.num_blocks);
+
+  for (int s = 0; s < OZC_SPEC; s++)
+    if (col[s] == NULL)
+      err = 1;
+  if (blocks == NULL)
+    err = 1;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = err ? NULL : fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot write %s\n", tmp);
+    err = 1;
+  } else {
+    size_t sizes[OZC_SPEC] = { 8, 4, 4, 8, 8, 4 };
+
+    /* The header is written again once the offsets are known */
+
+    err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    for (int s = 0; (s < OZC_SPEC) && !err; s++)
+      err = put_section(fp, col[s], n * sizes[s], &h.offset[s]);
+    if (!err)
+      err = put_spectra(fp, e, n, layout, &h.offset[OZC_SPEC]);
+    if (!err)
+      err = put_section(fp, blocks, h.num_blocks * sizeof(*blocks),
+			&h.offset[OZC_BLOCKS]);
+    if (!err)
+      err = put_section(fp, meta, num_meta * sizeof(meta[0]),
+			&h.offset[OZC_META_TABLE]);
+
+    h.file_len = ftello(fp);
+    h.crc = crc32c(0, &h, offsetof(struct ozc_header, crc));
+    if (!err)
+      err = (fseeko(fp, 0, SEEK_SET) != 0) || (fwrite(&h, sizeof(h), 1, fp) != 1);
+    if (fclose(fp) != 0)
+      err = 1;
+    if (!err && (rename(tmp, path) != 0))
+      err = 1;
+    if (err) {
+      fprintf(stderr, "Cannot write %s\n", path);
+      unlink(tmp);
+    }
+  }
+
+  for (int s = 0; s < OZC_SPEC; s++)
+    free(col[s]);
+  free(blocks);
+
+  if (!err)
+    printf("%s: %llu records in %u blocks, %d channel settings, %s, "
+	   "%.1f MB\n", path, (unsigned long long)n, h.num_blocks, num_meta,
+	   layout == OZC_BIN_MAJOR ? "bin-major" : "record-major",
+	   h.file_len / 1048576.0);
+
+  return err;
+}
+
+int main(int argc, char *argv[])
+{
+  const struct ozo_query all = { 0, UINT64_MAX, 0 };
+  char out[_POSIX_PATH_MAX] = "";
+  struct ozo_source *src;
+  struct entry *e = NULL;
+  uint64_t n = 0, size = 0;
+  int layout = OZC_RECORD_MAJOR, force = 0, opt, err;
+  long bad = 0;
+
+  while ((opt = getopt(argc, argv, "bfo:")) != -1) {
+    switch (opt) {
+      case 'b':
+	layout = OZC_BIN_MAJOR;
+	break;
+      case 'f':
+	force = 1;
+	break;
+      case 'o':
+	if (snprintf(out, sizeof(out), "%s", optarg) >= (int)sizeof(out)) {
+	  fprintf(stderr, "%s: path too long\n", optarg);
+	  return 2;
+	}
+	break;
+      default:
+	fprintf(stderr, "Usage: ozocompact [-b] [-f] [-o output.ozc] "
+		"<file or directory>...\n");
+	return 2;
+    }
+  }
+
+  for (int k = optind; k < argc; k++)
+    add_path(argv[k]);
+  qsort(files, num_files, sizeof(files[0]), by_name);
+
+  if (num_files == 0) {
+    fprintf(stderr, "Usage: ozocompact [-b] [-f] [-o output.ozc] "
+	    "<file or directory>...\n");
+    return 2;
+  }
+
+  for (int k = 0; k < num_files; k++)
+    if (!force && !is_closed(files[k])) {
+      fprintf(stderr, "%s may still be written to (use -f to compact "
+	      "it anyway)\n", files[k]);
+      return 2;
+    }
+
+  if (out[0] == '\0') {
+    size_t n = strlen(files[0]);
+
+    if (num_files > 1) {
+      fprintf(stderr, "Give the output file (-o) for several inputs\n");
+      return 2;
+    }
+    if (!ozo_is_day_file(files[0])) {
+      fprintf(stderr, "%s: not a day file\n", files[0]);
+      return 2;
+    }
+    n -= strcmp(&files[0][n - 3], ".gz") == 0 ? 7 : 4; /* .ozo[.gz] */
+    if (snprintf(out, sizeof(out), "%.*s.ozc", (int)n, files[0])
+	>= (int)sizeof(out)) {
+      fprintf(stderr, "%s: path too long\n", files[0]);
+      return 2;
+    }
+  }
+
+  src = calloc(num_files, sizeof(*src));
+  if (src == NULL) {
+    fprintf(stderr, "Cannot allocate file list\n");
+    return 2;
+  }
+
+  /* Collect every good record */
+
+  for (int k = 0; k < num_files; k++) {
+    struct ozo_cursor *cur = calloc(1, sizeof(*cur));
+    struct ozo_rec rec;
+
+    if ((cur == NULL) || (ozo_open(files[k], &src[k]) != 0)) {
+      fprintf(stderr, "%s: cannot read\n", files[k]);
+      return 2;
+    }
+
+    while (ozo_next(&src[k], &all, cur, &rec)) {
+      if (n == size) {
+	struct entry *p;
+
+	size = size ? 2 * size : 65536;
+	p = realloc(e, size * sizeof(*e));
+	if (p == NULL) {
+	  fprintf(stderr, "Cannot allocate record list\n");
+	  return 2;
+	}
+	e = p;
+      }
+
+      e[n].time_stamp = rec.time_stamp;
+      e[n].channel = rec.channel;
+      e[n].freq_err = rec.freq_err;
+      memcpy(e[n].spec_int, rec.spec_int, sizeof(rec.spec_int));
+      e[n].max_sig_level = rec.max_sig_level;
+      e[n].seq = n;
+      e[n].raw = rec.raw;
+      if (meta_index(rec.raw, rec.channel, &e[n].meta) != 0) {
+	fprintf(stderr, "Too many distinct channel settings\n");
+	return 2;
+      }
+      n++;
+    }
+
+    bad += cur->bad;
+    free(cur);
+  }
+
+  qsort(e, n, sizeof(*e), by_time);
+
+  err = write_compaction(out, e, n, layout, bad);
+  if (bad > 0)
+    printf("%ld bad records left out\n", bad);
+
+  for (int k = 0; k < num_files; k++)
+    ozo_close(&src[k]);
+  free(src);
+  free(e);
+
+  return err ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * .ozo data file format
+ *
+ * A file holds a sequence of records, each starting with a fixed
+ * header (magic, version, record length, ...) followed by the cal and
+ * signal spectra. Since version 5 the spectra may be followed by
+ * extension blocks, each a 32-bit tag, a 32-bit payload length in
+ * bytes and the payload. Readers should skip blocks with unknown tags;
+ * the record length covers everything. Since version 6 the last four
+ * bytes of a record are the CRC-32C of the rest of it.
+ */
+
+#ifndef _OZOFILE_H
+#define _OZOFILE_H
+
+#include <stdint.h>
+#include "common.h"
+
+#define HEADER_MAGIC 0xa9e4b8b4
+#define HEADER_VERSION 6
+#define HEADER_LEN 96 /* magic up to and including max_sig_level */
+#define CRC_VERSION 6 /* first version with a CRC */
+
+/* Byte offsets in a record, for readers */
+
+#define OFF_VERSION 4
+#define OFF_REC_LEN 8
+#define OFF_TIME_STAMP 12 /* uint64 */
+#define OFF_FREQ_ERR 20 /* double */
+#define OFF_SPEC_INT 28 /* int32[2] */
+#define OFF_FFT_LEN 40
+#define OFF_CHANNEL 44 /* int32 */
+#define OFF_DONGLE_SN 48 /* char[MAX_SN_LEN] */
+#define OFF_LINE_FREQ 64 /* double */
+#define OFF_VSRT_NUM 72 /* int32 */
+#define OFF_STATION_NAME 76 /* char[16] */
+#define OFF_MAX_SIG_LEVEL 92 /* int32 */
+#define OFF_CAL_SPEC HEADER_LEN /* float[FFT_LEN] */
+#define OFF_SIG_SPEC (HEADER_LEN + FFT_LEN * 4) /* float[2][FFT_LEN] */
+
+/* Extension block tags */
+
+#define OZO_BLOCK_SIG_STATS 1
+#define OZO_BLOCK_SK 2
+#define OZO_BLOCK_FOLD 3
+#define OZO_BLOCK_TIMING 4
+#define OZO_BLOCK_HIRES 5
+#define OZO_BLOCK_TARGET 6
+#define OZO_BLOCK_FREQ_TRACK 7
+#define OZO_BLOCK_CAL 8
+
+/* Signal level statistics over every sample of the cycle's signal
+   blocks (both sidebands) */
+
+struct ozo_sig_stats {
+  uint32_t num_samples; /* complex samples */
+  uint32_t clip_low; /* I or Q values at 0 */
+  uint32_t clip_high; /* I or Q values at 255 */
+  int32_t peak; /* largest |x - 127| */
+  float dc_i; /* mean of I, full scale = 1 */
+  float dc_q; /* mean of Q, full scale = 1 */
+  float power; /* mean of I^2 + Q^2, full scale = 1 */
+  uint32_t hist[256]; /* histogram of raw I and Q values */
+};
+
+/* Spectral kurtosis RFI flags. Index 0 is the upper sideband (the
+   first signal spectrum), index 1 the lower. A signal block (one
+   spectrum from the computational thread) is flagged as a whole if
+   too many of its bins are. With mode 2 (excise) flagged bins and
+   blocks are left out of the integration, so each bin of the spectra
+   is normalised by its own number of frames: the header integration
+   count less frames_flagged for that bin. */
+
+struct ozo_sk {
+  uint32_t mode; /* 1 = flag only, 2 = excise */
+  float sigma; /* threshold in standard deviations of SK */
+  uint32_t blocks[2]; /* signal blocks */
+  uint32_t blocks_flagged[2];
+  uint32_t frames_flagged[2][FFT_LEN]; /* per bin, in integrated blocks */
+};
+
+/* Frequency-switched difference, folded about the line (FOLDOUT).
+   Bin j is (j - FFT_LEN / 4) * SAMPLERATE / FFT_LEN Hz from the line,
+   corrected for the measured frequency error; (fold / ref) is the
+   usual (sig - ref) / ref. */
+
+struct ozo_fold {
+  float line_pos[2]; /* line position in each sideband spectrum, bins */
+  float fold[FFT_LEN / 2]; /* normalised power, line minus reference */
+  float ref[FFT_LEN / 2]; /* reference power */
+};
+
+/* Capture timing. Absolute times are CLOCK_REALTIME, durations are
+   measured on CLOCK_MONOTONIC; all in nanoseconds. Index 0 is the
+   upper sideband. The effective integration time of a sideband is
+   samples / SAMPLERATE; on_source minus that is time lost in starting
+   and stopping reads. */
+
+struct ozo_timing {
+  int64_t cal_start; /* start of the cal capture */
+  int64_t sig_start; /* start of the first signal capture */
+  int64_t sig_end; /* end of the last signal capture */
+  uint64_t on_source[2]; /* time spent in signal captures */
+  uint64_t retune; /* time spent retuning and resetting buffers */
+  uint64_t samples[2]; /* complex samples captured */
+  uint32_t reads[2]; /* signal reads made */
+  uint32_t short_reads[2]; /* reads returning less than asked for */
+  uint64_t short_bytes[2]; /* bytes missing from short reads */
+};
+
+/* A higher-resolution spectrum around the line (HIRES), one block per
+   resolution. The header is followed by float spec[2][num_bins], upper
+   sideband first, normalised like the main spectra. Bin j of sideband
+   k is (first_bin[k] + j) * SAMPLERATE / fft_len Hz from the tuned
+   frequency. With SK excision, flagged blocks are left out but single
+   flagged bins are not. */
+
+struct ozo_hires {
+  uint32_t fft_len;
+  uint32_t num_bins; /* per sideband */
+  int32_t first_bin[2];
+  int32_t spec_int[2]; /* frames integrated */
+};
+
+/* An extra target's spectra (TARGET), one block per target. The header
+   is followed by float spec[2][FFT_LEN], upper sideband first,
+   normalised like the main spectra; a sideband not observed has
+   spec_int 0 and zero power. As in the main spectra, bin j of
+   sideband k is j * SAMPLERATE / FFT_LEN Hz from tuned_freq[k], less
+   SAMPLERATE for j >= FFT_LEN / 2. */
+
+struct ozo_target {
+  char name[8];
+  double freq; /* of the target, Hz */
+  uint32_t role; /* 0 upper, 1 lower, 2 switched, 3 centre */
+  uint32_t tuned_freq[2]; /* of the sideband's last dwell, Hz */
+  int32_t spec_int[2]; /* frames integrated */
+};
+
+/* How the header's freq_err was arrived at (CALEVERY). Without a cal
+   in the cycle it is the tracking filter's prediction for the middle
+   of the signal capture, and the cal spectrum is that of the last cal
+   made. */
+
+struct ozo_freq_track {
+  uint32_t calibrated; /* 1 if measured this cycle, 0 if predicted */
+  uint32_t num_meas; /* cal measurements in the track */
+  float sigma; /* standard deviation of freq_err, Hz */
+  float rate; /* drift, Hz per second */
+};
+
+/* Calibrator switching (CAL), in cycles with a cal. Times are
+   CLOCK_REALTIME ns taken as the switch completed; off is 0 if the
+   calibrator stayed on (VCALSTAYON). settle is from the switch on to
+   the start of the cal capture. */
+
+struct ozo_cal {
+  int64_t on;
+  int64_t off;
+  int64_t settle; /* ns */
+  uint32_t on_latency; /* ns taken by the switch */
+  uint32_t off_latency;
+};
+
+#endif /* _OZOFILE_H */
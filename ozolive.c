@@ -0,0 +1,113 @@
+/*
+ * ozolive: show the live spectra published by a running ozonespec
+ *
+ * Usage: ozolive [-c channel] [-s] [-w seconds] [-n shm name]
+ *
+ * Without -s, one summary line is printed per channel. With -s, the
+ * cal and sideband spectra of the channel given by -c (default 0) are
+ * printed as columns: bin, cal, upper, lower. With -w the output is
+ * repeated at that interval. Exit status is 1 if no recorder is
+ * publishing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "livespec.h"
+
+static void print_summary(const struct live_segment *seg)
+{
+  struct live_channel c;
+
+  for (uint32_t n = 0; n < seg->num_channels; n++) {
+    if (live_read(seg, n, &c) != 0) {
+      printf("%u: busy\n", n);
+      continue;
+    }
+    if (c.cycles == 0) {
+      printf("%u %-8s no data yet\n", n, c.dongle_sn);
+      continue;
+    }
+    printf("%u %-8s cycle %u, age %lld s, freq err %.0f Hz, "
+	   "peak %d, clipped %u/%u, DC %.4f/%.4f, power %.4f\n", n,
+	   c.dongle_sn, c.cycles, (long long)time(NULL) - (long long)c.time_stamp,
+	   c.freq_err, c.level.peak, c.level.clip_low, c.level.clip_high,
+	   c.level.dc_i, c.level.dc_q, c.level.power);
+  }
+}
+
+static int print_spectra(const struct live_segment *seg, int channel)
+{
+  struct live_channel c;
+
+  if (live_read(seg, channel, &c) != 0) {
+    fprintf(stderr, "Channel %d busy\n", channel);
+    return 1;
+  }
+
+  printf("# %s cycle %u, time %llu, freq err %.0f Hz, tuned %u/%u Hz, "
+	 "spectra %d/%d\n", c.dongle_sn, c.cycles,
+	 (unsigned long long)c.time_stamp, c.freq_err, c.tuned_freq[0],
+	 c.tuned_freq[1], c.spec_int[0], c.spec_int[1]);
+  for (int k = 0; k < FFT_LEN; k++)
+    printf("%d %g %g %g\n", k, c.cal_spec[k], c.spec[k],
+	   c.spec[FFT_LEN + k]);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const struct live_segment *seg;
+  const char *name = LIVE_SHM_NAME;
+  int opt, channel = 0, spectra = 0, interval = 0;
+
+  while ((opt = getopt(argc, argv, "c:sw:n:")) != -1) {
+    switch (opt) {
+      case 'c':
+	channel = atoi(optarg);
+	break;
+      case 's':
+	spectra = 1;
+	break;
+      case 'w':
+	interval = atoi(optarg);
+	break;
+      case 'n':
+	name = optarg;
+	break;
+      default:
+	fprintf(stderr, "Usage: ozolive [-c channel] [-s] [-w seconds] "
+		"[-n shm name]\n");
+	return 2;
+    }
+  }
+
+  seg = live_open(name);
+  if (seg == NULL) {
+    fprintf(stderr, "No live spectra in /dev/shm%s\n", name);
+    return 1;
+  }
+
+  if ((channel < 0) || (channel >= (int)seg->num_channels)) {
+    fprintf(stderr, "Channel must be 0 to %u\n", seg->num_channels - 1);
+    return 2;
+  }
+
+  for (;;) {
+    if (spectra) {
+      if (print_spectra(seg, channel) != 0)
+	return 1;
+    } else
+      print_summary(seg);
+
+    if (interval <= 0)
+      break;
+    printf("\n");
+    fflush(stdout);
+    sleep(interval);
+  }
+
+  return 0;
+}
@@ -12,15 +12,27 @@
 #include <errno.h>
 
 #include "rtl-sdr.h"
-#include <fftw3.h>
+#include "fftbackend.h"
 #include "calcontrol.h"
 #include "common.h"
 #include "recthread.h"
 #include "signalproc.h"
 #include "rtldongle.h"
 #include "config.h"
+#include "cyclebarrier.h"
+#include "timeutil.h"
+#include "autotune.h"
+#include "archive.h"
+#include "livespec.h"
+#include "checkpoint.h"
+#include "export.h"
+
+#define SUPERVISE_INTERVAL 1 /* seconds between checks on the channels */
 
 timer_t watchdog;
+volatile sig_atomic_t reload_pending = 0;
+struct cycle_barrier cycle_barrier;
+struct rec_thread_context **rec_ctx; /* one per channel, from the heap */
 
 void watchdog_handler(int sig)
 {
@@ -32,7 +44,7 @@ void watchdog_reset(void)
 {
   struct itimerspec its;
  
-  its.it_value.tv_sec = watchdog_timeout;
+  its.it_value.tv_sec = config_get()->watchdog_timeout;
   its.it_value.tv_nsec = 0;
   its.it_interval.tv_sec = 0;
   its.it_interval.tv_nsec = 0;
@@ -58,20 +70,180 @@ int watchdog_init(void)
   return timer_create(CLOCK_REALTIME, NULL, &watchdog);
 }
 
+void hangup_handler(int sig)
+{
+  reload_pending = 1;
+}
+
+/* SIGHUP requests a configuration reload, which the main thread
+ * carries out at the next cycle boundary.
+ */
+
+int reload_init(void)
+{
+  struct sigaction sa;
+  sigset_t ss;
+
+  sigemptyset(&ss);
+  sa.sa_handler = hangup_handler;
+  sa.sa_mask = ss;
+  sa.sa_flags = SA_RESTART;
+  return sigaction(SIGHUP, &sa, NULL);
+}
+
+/* Free configuration snapshots that no thread is using any more */
+
+void reclaim_config(void)
+{
+  unsigned int oldest = config_get()->generation;
+
+  for (int n = 0; n < config_get()->num_channels; n++) {
+    unsigned int gen = __atomic_load_n(&rec_ctx[n]->cfg_generation,
+				       __ATOMIC_ACQUIRE);
+    if (gen < oldest)
+      oldest = gen;
+  }
+
+  config_reclaim(oldest);
+}
+
+/* Look for channels stuck in a dongle read. Such a channel is removed
+ * from the cycle so that the others can carry on, and the read is
+ * aborted so that its thread can reopen the dongle.
+ */
+
+void check_channels(void)
+{
+  const struct ozone_config *cfg = config_get();
+  struct timespec ts;
+  time_t hb;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  for (int n = 0; n < cfg->num_channels; n++) {
+    struct rec_thread_context *ctx = rec_ctx[n];
+
+    int stuck;
+
+    if (!__atomic_load_n(&ctx->in_read, __ATOMIC_ACQUIRE) ||
+	__atomic_load_n(&ctx->stalled, __ATOMIC_ACQUIRE))
+      continue;
+
+    /* Decide and mark under dev_mutex: capture() clears in_read and
+       looks at stalled under it too, so either the read is failed or
+       it finished first and the channel is left alone */
+
+    pthread_mutex_lock(&ctx->dev_mutex);
+    hb = __atomic_load_n(&ctx->heartbeat, __ATOMIC_ACQUIRE);
+    stuck = __atomic_load_n(&ctx->in_read, __ATOMIC_ACQUIRE)
+      && (ts.tv_sec - hb > cfg->dongle_timeout);
+    if (stuck) {
+      __atomic_store_n(&ctx->stalled, 1, __ATOMIC_RELEASE);
+      if (ctx->dev != NULL)
+	abort_read(ctx->dev);
+    }
+    pthread_mutex_unlock(&ctx->dev_mutex);
+
+    if (!stuck)
+      continue;
+
+    fprintf(stderr, "  main_thread: channel %d (%s) stuck in read for %ld s, "
+	    "removing from cycle\n", n, ctx->dongle_sn, (long)(ts.tv_sec - hb));
+
+    cycle_barrier_leave(&cycle_barrier, &ctx->barrier_member);
+  }
+}
+
+/* Open a channel's dongle and set up its buffers. One of these runs
+ * for each channel in parallel at startup. Failures are reported
+ * through ctx->dev and ctx->bufs.arena being NULL.
+ */
+
+void *init_channel(void *ptarg)
+{
+  struct rec_thread_context *ctx = (struct rec_thread_context *)ptarg;
+  struct timespec t0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  ctx->dev = init_dongle(ctx->dongle_sn);
+  if (ctx->dev == NULL)
+    return NULL;
+  fprintf(stderr, "Startup: channel %d dongle %s opened in %.2f s\n",
+	  ctx->channel, ctx->dongle_sn, time_since(&t0));
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (rec_thread_alloc(ctx) != 0) {
+    ctx->bufs.arena = NULL;
+    return NULL;
+  }
+  fprintf(stderr, "Startup: channel %d buffers (%zu MB) set up in %.2f s\n",
+	  ctx->channel, ctx->bufs.arena_size >> 20, time_since(&t0));
+
+  return NULL;
+}
+
+/* Log the peak resident set size, and its share per channel, when it
+ * has grown since last time. The buffers are locked in memory, so
+ * this is what the recorder really needs.
+ */
+
+void report_peak_rss(int num_channels)
+{
+  static long last_kb = 0;
+  char line[128];
+  long kb = 0;
+  FILE *fp;
+
+  fp = fopen("/proc/self/status", "r");
+  if (fp == NULL)
+    return;
+  while (fgets(line, sizeof(line), fp) != NULL)
+    if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+      break;
+  fclose(fp);
+
+  if (kb <= last_kb)
+    return;
+  last_kb = kb;
+
+  fprintf(stderr, "  main_thread: peak RSS %.1f MB, %.1f MB per channel\n",
+	  kb / 1024.0, kb / 1024.0 / num_channels);
+}
+
+/* Wait at a phase of the cycle, supervising the channels meanwhile */
+
+void supervised_wait(int phase)
+{
+  uint64_t gen;
+
+  gen = cycle_barrier_arrive(&cycle_barrier, phase, NULL);
+  while (cycle_barrier_await(&cycle_barrier, gen, SUPERVISE_INTERVAL)
+	 == ETIMEDOUT)
+    check_channels();
+}
+
 int main(int argc, char *argv[])
 {
-  FILE *calfp;
   pthread_t rthread;
+  pthread_t *init_threads;
+  struct timespec t0;
   float *fft_win;
   int r, n, opt;
   int conf_read = 0;
-  pthread_barrier_t cal_on_barrier;
-  pthread_barrier_t cal_rec_done_barrier;
-  pthread_barrier_t cal_off_barrier;
-  pthread_barrier_t sig_rec_done_barrier;
   pthread_mutex_t outfile_mutex = PTHREAD_MUTEX_INITIALIZER;
   uint64_t time_stamp;
-
+  int cal_cycle = 1, cycles_since_cal = 0;
+  int resuming;
+  struct ckpt_state **resume;
+  struct cal_event cal_on, cal_off;
+  const struct ozone_config *cfg;
+  sigset_t hup_set;
+  struct autotune at;
+  int tuned = 0;
+  struct timespec cycle_start;
+  struct cycle_timing worst;
+
+  clock_gettime(CLOCK_MONOTONIC, &startup_time);
 
   while ((opt = getopt(argc, argv, "f:")) != -1) {
     switch (opt) {
@@ -88,7 +260,9 @@ int main(int argc, char *argv[])
   if (!conf_read)
     read_config(NULL);
 
-  if (num_channels < 1) {
+  cfg = config_get();
+
+  if (cfg->num_channels < 1) {
     fprintf(stderr, "No channels defined!\n");
     return 1;
   }
@@ -98,6 +272,18 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (reload_init() != 0) {
+    perror("Could not install SIGHUP handler");
+    return 1;
+  }
+
+  /* Only the main thread handles SIGHUP: block it in the threads
+     created below, which inherit this mask */
+
+  sigemptyset(&hup_set);
+  sigaddset(&hup_set, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &hup_set, NULL);
+
   init_convtab();
 
   fft_win = malloc(FFT_LEN * sizeof(float));
@@ -108,62 +294,124 @@ int main(int argc, char *argv[])
 
   init_window(fft_win, FFT_LEN);
 
-  if ((calfp = init_cal_control()) == NULL)
+  if (init_cal_control(cfg) != 0)
     return 1;
+  memset(&cal_on, 0, sizeof(cal_on));
+  memset(&cal_off, 0, sizeof(cal_off));
 
-  /* Initialise barriers for calibration synchronisation */
-  r = pthread_barrier_init(&cal_on_barrier, NULL, num_channels + 1);
+  /* Initialise barrier for calibration synchronisation */
+  r = cycle_barrier_init(&cycle_barrier, cfg->num_channels + 1);
   if (r != 0) {
-    fprintf(stderr, "pthread_barrier_init(cal_on_barrier): %s\n", strerror(r));
+    fprintf(stderr, "cycle_barrier_init(): %s\n", strerror(r));
     return 1;
   }
 
-  r = pthread_barrier_init(&cal_rec_done_barrier, NULL, num_channels + 1);
-  if (r != 0) {
-    fprintf(stderr, "pthread_barrier_init(cal_rec_done_barrier): %s\n",
-	    strerror(r));
-    return 1;
-  }
-
-  r = pthread_barrier_init(&cal_off_barrier, NULL, num_channels + 1);
-  if (r != 0) {
-    fprintf(stderr, "pthread_barrier_init(cal_off_barrier): %s\n", strerror(r));
-    return 1;
-  }
+  /* The channel registry. Channels are fixed for the life of the
+     process; each has its own context. */
 
-  r = pthread_barrier_init(&sig_rec_done_barrier, NULL, num_channels + 1);
-  if (r != 0) {
-    fprintf(stderr, "pthread_barrier_init(sig_rec_done_barrier): %s\n",
-	    strerror(r));
+  rec_ctx = calloc(cfg->num_channels, sizeof(*rec_ctx));
+  init_threads = calloc(cfg->num_channels, sizeof(*init_threads));
+  if ((rec_ctx == NULL) || (init_threads == NULL)) {
+    fprintf(stderr, "Failed to allocate channel registry\n");
     return 1;
   }
 
-  for (n = 0; n < num_channels; n++) {
+  for (n = 0; n < cfg->num_channels; n++) {
 
-    /* Start a recorder thread */
     struct rec_thread_context *ctx = malloc(sizeof(struct rec_thread_context));
     if (ctx == NULL) {
       fprintf(stderr, "Failed to allocate rec thread context\n");
       return 1;
     }
 
-    strcpy(ctx->dongle_sn, &dongle_sns[n][0]);
+    strcpy(ctx->dongle_sn, &cfg->dongle_sns[n][0]);
 
     ctx->fft_win = fft_win;
-    ctx->dev = init_dongle(ctx->dongle_sn);
-    if (ctx->dev == NULL) {
-      fprintf(stderr, "Failed to init dongle %s\n", ctx->dongle_sn);
-      return 1;
-    }
+    ctx->dev = NULL;
     ctx->channel = n;
     ctx->time_stamp = &time_stamp;
-    ctx->cal_on_barrier = &cal_on_barrier;
-    ctx->cal_rec_done_barrier = &cal_rec_done_barrier;
-    ctx->cal_off_barrier = &cal_off_barrier;
-    ctx->sig_rec_done_barrier = &sig_rec_done_barrier;
+    ctx->cal_cycle = &cal_cycle;
+    ctx->cal_on = &cal_on;
+    ctx->cal_off = &cal_off;
+    freq_track_reset(&ctx->ftrack);
+    ctx->cal_wanted = 1;
+    ctx->cycle_barrier = &cycle_barrier;
+    ctx->barrier_member = 1;
     ctx->outfile_mutex = &outfile_mutex;
+    ctx->cfg_generation = cfg->generation;
+    ctx->shape = cfg->shape;
+    ctx->timing.valid = 0;
+    pthread_mutex_init(&ctx->dev_mutex, NULL);
+    ctx->heartbeat = 0;
+    ctx->in_read = 0;
+    ctx->stalled = 0;
+    ctx->resume = NULL;
+    rec_ctx[n] = ctx;
+
+  }
+
+  /* Open the dongles and set up the channels' buffers in parallel,
+     planning the FFT meanwhile */
+
+  for (n = 0; n < cfg->num_channels; n++) {
+    r = pthread_create(&init_threads[n], NULL, init_channel, (void *)rec_ctx[n]);
+    if (r != 0) {
+      fprintf(stderr, "pthread_create(init_channel): %s", strerror(r));
+      return 1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (init_fft() != 0)
+    return 1;
+  fft_plan_hires(cfg->hires, cfg->num_hires);
+  fprintf(stderr, "Startup: FFT planned in %.2f s\n", time_since(&t0));
+
+  for (n = 0; n < cfg->num_channels; n++) {
+    pthread_join(init_threads[n], NULL);
+    if (rec_ctx[n]->dev == NULL) {
+      fprintf(stderr, "Failed to init dongle %s\n", rec_ctx[n]->dongle_sn);
+      return 1;
+    }
+    if (rec_ctx[n]->bufs.arena == NULL) {
+      fprintf(stderr, "Failed to set up buffers for channel %d\n", n);
+      return 1;
+    }
+  }
+
+  free(init_threads);
 
-    r = pthread_create(&rthread, NULL, rec_thread, (void *)ctx);
+  /* Carry on with the cycle in progress before a restart, if it was
+     checkpointed. The channels pick up their frequency tracks now. */
+
+  resume = calloc(cfg->num_channels, sizeof(*resume));
+  if (resume == NULL) {
+    fprintf(stderr, "Failed to allocate checkpoint list\n");
+    return 1;
+  }
+  ckpt_init(cfg);
+  resuming = ckpt_resume(cfg, resume, &time_stamp);
+  for (n = 0; n < cfg->num_channels; n++) {
+    rec_ctx[n]->resume = resume[n];
+    if (resume[n] != NULL) {
+      rec_ctx[n]->ftrack = resume[n]->ftrack;
+      rec_ctx[n]->cal_wanted = 0;
+    }
+  }
+  free(resume);
+
+  fprintf(stderr, "Startup: %d channels initialised after %.2f s\n",
+	  cfg->num_channels, time_since(&startup_time));
+
+  archive_start(cfg);
+  export_start(cfg);
+  live_init(cfg->num_channels, cfg->dongle_sns);
+
+  for (n = 0; n < cfg->num_channels; n++) {
+
+    /* Start a recorder thread */
+
+    r = pthread_create(&rthread, NULL, rec_thread, (void *)rec_ctx[n]);
     if (r != 0) {
       fprintf(stderr, "pthread_create(rec_thread): %s", strerror(r));
       return 1;
@@ -171,6 +419,8 @@ int main(int argc, char *argv[])
 
   }
 
+  pthread_sigmask(SIG_UNBLOCK, &hup_set, NULL);
+
   /* Set realtime scheduling */
 
   struct sched_param spar;
@@ -179,36 +429,110 @@ int main(int argc, char *argv[])
   if (r != 0)
     perror("  main_thread: Failed to set RT scheduling");
 
+  autotune_reset(&at, &cfg->shape);
+
   /* Calibrator control loop */
 
   for (;;) {
 
-    fprintf(stderr, "  main_thread: calibrator on\n");
-    set_cal_state(calfp, 1);
+    /* Configuration changes take effect at the cycle boundary */
+
+    if (reload_pending) {
+      reload_pending = 0;
+      if (reload_config() == 0) {
+	tuned = 0; /* tune again from the newly read shape */
+	archive_kick(config_get());
+	export_kick(config_get());
+      }
+    }
+    reclaim_config();
+    cfg = config_get();
+
+    if (cfg->autotune && !tuned && (at.cycles >= AUTOTUNE_CYCLES)) {
+      struct cycle_shape shape;
+
+      if (autotune_choose(&at, cfg, &shape) == 0) {
+	tuned = 1;
+	if (memcmp(&shape, &cfg->shape, sizeof(shape)) != 0) {
+	  config_set_shape(&shape);
+	  cfg = config_get();
+	}
+      }
+    }
+
+    if (memcmp(&at.shape, &cfg->shape, sizeof(at.shape)) != 0)
+      autotune_reset(&at, &cfg->shape);
+
+    /* If every channel has dropped out, wait for one to come back.
+       The watchdog is not reset meanwhile, so if none does the
+       process exits and is restarted. */
+
+    if (cycle_barrier_members(&cycle_barrier) < 2) {
+      fprintf(stderr, "  main_thread: no channels active, waiting\n");
+      while (cycle_barrier_members(&cycle_barrier) < 2)
+	sleep(SUPERVISE_INTERVAL);
+    }
+
+    /* Calibrate every CALEVERY cycles, or sooner if any channel can
+       no longer predict its frequency error well enough. The recorder
+       threads read the decision after cal on. */
+
+    cal_cycle = ++cycles_since_cal >= cfg->cal_every;
+    for (n = 0; n < cfg->num_channels; n++)
+      if (__atomic_load_n(&rec_ctx[n]->cal_wanted, __ATOMIC_ACQUIRE))
+	cal_cycle = 1;
+    if (resuming)
+      cal_cycle = 0; /* a resumed cycle had its cal, if any, already */
+    if (cal_cycle)
+      cycles_since_cal = 0;
+
+    if (cal_cycle || cfg->keep_cal_on) {
+      fprintf(stderr, "  main_thread: calibrator on\n");
+      set_cal_state(1, &cal_on);
+    } else
+      fprintf(stderr, "  main_thread: no cal this cycle\n");
 
-    time_stamp = (uint64_t)time(NULL);
+    if (!resuming)
+      time_stamp = (uint64_t)time(NULL);
 
     watchdog_reset();
 
-    r = pthread_barrier_wait(&cal_on_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &cycle_start);
+
+    supervised_wait(PHASE_CAL_ON);
 
     fprintf(stderr, "  main_thread: waiting for rec threads\n");
-    r = pthread_barrier_wait(&cal_rec_done_barrier);
+    supervised_wait(PHASE_CAL_REC_DONE);
 
-    if (!keep_cal_on) {
+    if (cal_cycle && !cfg->keep_cal_on) {
       fprintf(stderr, "  main_thread: calibrator off\n");
-      set_cal_state(calfp, 0);
-    } else
+      set_cal_state(0, &cal_off);
+    } else if (cfg->keep_cal_on)
       fprintf(stderr, "  main_thread: calibrator remains on\n");
 
-    r = pthread_barrier_wait(&cal_off_barrier);
+    supervised_wait(PHASE_CAL_OFF);
 
     fprintf(stderr, "  main_thread: waiting for sig rec to finish\n");
-    r = pthread_barrier_wait(&sig_rec_done_barrier);
+    supervised_wait(PHASE_SIG_REC_DONE);
+
+    /* Collect the channels' timing for the cycle just completed */
+
+    memset(&worst, 0, sizeof(worst));
+    for (n = 0; n < cfg->num_channels; n++) {
+      cycle_timing_worst(&worst, &rec_ctx[n]->timing);
+      rec_ctx[n]->timing.valid = 0;
+    }
+
+    log_duty_cycle(&worst, time_since(&cycle_start));
+    if (!resuming)
+      autotune_add(&at, &worst, time_since(&cycle_start));
+    resuming = 0;
+    report_peak_rss(cfg->num_channels);
 
   }
 
-  fclose(calfp);
+  ckpt_close();
+  close_cal_control();
 
   return 0;
 }
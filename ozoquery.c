@@ -0,0 +1,185 @@
+/*
+ * ozoquery: select records from day files and compactions
+ *
+ * Usage: ozoquery [-c channel]... [-f from] [-t to] [-b bin]... [-s]
+ *                 <file or directory>...
+ *
+ * Prints the records of the given .ozo, .ozo.gz and .ozc files
+ * (directories are searched, not recursively, in name order) with
+ * time stamps from..to and on the channels given (all if none), as
+ * CSV: time stamp, channel, frequency error, max signal level, the two
+ * integration counts, then the value of each bin asked for. Bins are
+ * numbered through the cal spectrum (0 to 767) and the upper (768 to
+ * 1535) and lower (1536 to 2303) sideband spectra. Times are seconds
+ * since 1970 or YYYYMMDD (UTC; the whole day for -t). With -s the
+ * number of records read and, for compactions, blocks skipped are
+ * reported on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ozoread.h"
+
+#define MAX_BINS 64
+
+static int bins[MAX_BINS];
+static int num_bins = 0;
+static int stats = 0;
+
+static int by_name(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int query(const char *path, const struct ozo_query *q)
+{
+  struct ozo_source src;
+  struct ozo_cursor *cur;
+  struct ozo_rec rec;
+  long n = 0;
+
+  cur = calloc(1, sizeof(*cur));
+  if ((cur == NULL) || (ozo_open(path, &src) != 0)) {
+    fprintf(stderr, "%s: cannot read\n", path);
+    free(cur);
+    return 1;
+  }
+
+  while (ozo_next(&src, q, cur, &rec)) {
+    printf("%llu,%d,%.1f,%d,%d,%d", (unsigned long long)rec.time_stamp,
+	   rec.channel, rec.freq_err, rec.max_sig_level, rec.spec_int[0],
+	   rec.spec_int[1]);
+    for (int k = 0; k < num_bins; k++)
+      printf(",%g", ozo_bin(&src, &rec, bins[k]));
+    printf("\n");
+    n++;
+  }
+
+  if (stats) {
+    if (src.ozc != NULL)
+      fprintf(stderr, "%s: %ld records, %ld blocks read, %ld skipped\n",
+	      path, n, cur->blocks_read, cur->blocks_skipped);
+    else
+      fprintf(stderr, "%s: %ld records, %ld bad\n", path, n, cur->bad);
+  }
+
+  ozo_close(&src);
+  free(cur);
+
+  return 0;
+}
+
+/* Query a file, or the data files in a directory in order */
+
+static int each_file(const char *path, const struct ozo_query *q)
+{
+  char file[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  char **list = NULL;
+  int n = 0, errors = 0;
+  DIR *dir;
+
+  if ((stat(path, &st) != 0) || !S_ISDIR(st.st_mode))
+    return query(path, q);
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return 1;
+  }
+
+  while ((de = readdir(dir)) != NULL) {
+    char **l;
+
+    if (!ozo_is_data_file(de->d_name))
+      continue;
+    l = realloc(list, (n + 1) * sizeof(*list));
+    if (l == NULL)
+      break;
+    list = l;
+    list[n++] = strdup(de->d_name);
+  }
+  closedir(dir);
+
+  qsort(list, n, sizeof(*list), by_name);
+
+  for (int k = 0; k < n; k++) {
+    snprintf(file, sizeof(file), "%s/%s", path, list[k]);
+    errors += query(file, q);
+    free(list[k]);
+  }
+  free(list);
+
+  return errors;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: ozoquery [-c channel]... [-f from] [-t to] "
+	  "[-b bin]... [-s] <file or directory>...\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct ozo_query q = { 0, UINT64_MAX, 0 };
+  int opt, errors = 0;
+
+  while ((opt = getopt(argc, argv, "c:f:t:b:s")) != -1) {
+    switch (opt) {
+      case 'c':
+	q.channels |= 1ull << (atoi(optarg) & 63);
+	break;
+      case 'f':
+	if (ozo_parse_time(optarg, 0, &q.from) != 0) {
+	  fprintf(stderr, "Bad time %s\n", optarg);
+	  return 2;
+	}
+	break;
+      case 't':
+	if (ozo_parse_time(optarg, 1, &q.to) != 0) {
+	  fprintf(stderr, "Bad time %s\n", optarg);
+	  return 2;
+	}
+	break;
+      case 'b':
+	if (num_bins == MAX_BINS) {
+	  fprintf(stderr, "At most %d bins\n", MAX_BINS);
+	  return 2;
+	}
+	bins[num_bins] = atoi(optarg);
+	if ((bins[num_bins] < 0) || (bins[num_bins] >= OZC_SPEC_BINS)) {
+	  fprintf(stderr, "Bins are 0 to %d\n", OZC_SPEC_BINS - 1);
+	  return 2;
+	}
+	num_bins++;
+	break;
+      case 's':
+	stats = 1;
+	break;
+      default:
+	usage();
+	return 2;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return 2;
+  }
+
+  printf("time_stamp,channel,freq_err,max_sig_level,spec_int_u,spec_int_l");
+  for (int k = 0; k < num_bins; k++)
+    printf(",bin%d", bins[k]);
+  printf("\n");
+
+  for (int n = optind; n < argc; n++)
+    errors += each_file(argv[n], &q);
+
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,383 @@
+/*
+ * Reading records from day files and their compactions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "ozoread.h"
+#include "crc32c.h"
+#include "ozorecord.h"
+
+#define GZ_CHUNK (1 << 20)
+
+static int has_suffix(const char *name, const char *suffix)
+{
+  size_t n = strlen(name), m = strlen(suffix);
+
+  return (n > m) && (strcmp(&name[n - m], suffix) == 0);
+}
+
+/* Day files, .ozo or .ozo.gz */
+
+int ozo_is_day_file(const char *name)
+{
+  return has_suffix(name, ".ozo") || has_suffix(name, ".ozo.gz");
+}
+
+/* Day files and compactions */
+
+int ozo_is_data_file(const char *name)
+{
+  return ozo_is_day_file(name) || has_suffix(name, ".ozc");
+}
+
+/* Read a whole file, gzip-compressed or not, into memory. A truncated
+   gzip file still gives the records before the damage, with a warning.
+   Returns NULL on error. */
+
+uint8_t *ozo_read_file(const char *path, size_t *len)
+{
+  gzFile gzf;
+  uint8_t *d = NULL;
+  size_t size = 0;
+  int n, err;
+
+  gzf = gzopen(path, "rb"); /* reads uncompressed files as they are */
+  if (gzf == NULL)
+    return NULL;
+
+  *len = 0;
+  do {
+    if (*len + GZ_CHUNK > size) {
+      uint8_t *p = realloc(d, size + 8 * GZ_CHUNK);
+      if (p == NULL) {
+	free(d);
+	gzclose(gzf);
+	return NULL;
+      }
+      d = p;
+      size += 8 * GZ_CHUNK;
+    }
+    n = gzread(gzf, &d[*len], GZ_CHUNK);
+    if (n > 0)
+      *len += n;
+  } while (n > 0);
+
+  /* A gzip stream cut short may only show in gzerror() */
+
+  gzerror(gzf, &err);
+  if ((n < 0) || ((err != Z_OK) && (err != Z_STREAM_END)))
+    fprintf(stderr, "%s: gzip error, using what could be read\n", path);
+
+  gzclose(gzf);
+  return d;
+}
+
+/* Check a compaction's header and that its sections lie in the file */
+
+static int check_ozc(const struct ozo_source *src)
+{
+  const struct ozc_header *h = (const struct ozc_header *)src->data;
+  uint64_t n, size[OZC_NUM_SECTIONS];
+
+  if ((src->len < sizeof(*h)) || (h->magic != OZC_MAGIC)
+      || (h->version != OZC_VERSION) || (h->fft_len != FFT_LEN)
+      || (h->layout > OZC_BIN_MAJOR) || (h->file_len != src->len)
+      || (crc32c(0, h, offsetof(struct ozc_header, crc)) != h->crc))
+    return 1;
+
+  n = h->num_records;
+  size[OZC_TIME_STAMP] = n * sizeof(uint64_t);
+  size[OZC_CHANNEL] = n * sizeof(int32_t);
+  size[OZC_META] = n * sizeof(uint32_t);
+  size[OZC_FREQ_ERR] = n * sizeof(double);
+  size[OZC_SPEC_INT] = n * 2 * sizeof(int32_t);
+  size[OZC_MAX_SIG_LEVEL] = n * sizeof(int32_t);
+  size[OZC_SPEC] = n * OZC_SPEC_BINS * sizeof(float);
+  size[OZC_BLOCKS] = (uint64_t)h->num_blocks * sizeof(struct ozc_block);
+  size[OZC_META_TABLE] = (uint64_t)h->num_meta * sizeof(struct ozc_meta);
+
+  if (h->num_blocks != (n + OZC_BLOCK_LEN - 1) / OZC_BLOCK_LEN)
+    return 1;
+
+  for (int s = 0; s < OZC_NUM_SECTIONS; s++)
+    if ((h->offset[s] % OZC_ALIGN != 0) || (h->offset[s] > src->len)
+	|| (size[s] > src->len - h->offset[s]))
+      return 1;
+
+  return 0;
+}
+
+/* Open a day file or compaction. Returns 0 on success. */
+
+int ozo_open(const char *path, struct ozo_source *src)
+{
+  struct stat st;
+  int fd;
+
+  memset(src, 0, sizeof(*src));
+  src->path = path;
+
+  if (has_suffix(path, ".gz")) {
+    src->data = ozo_read_file(path, &src->len);
+    return src->data == NULL;
+  }
+
+  /* A file too big to map (on a 32-bit system) cannot be read */
+
+  fd = open(path, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) != 0)
+      || ((uint64_t)st.st_size > SIZE_MAX)) {
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+
+  if (st.st_size > 0) {
+    src->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src->data == MAP_FAILED) {
+      close(fd);
+      src->data = NULL;
+      return 1;
+    }
+    src->len = st.st_size;
+    src->mapped = 1;
+  }
+  close(fd);
+
+  if (has_suffix(path, ".ozc")) {
+    if (check_ozc(src) != 0) {
+      fprintf(stderr, "%s: not a valid compaction\n", path);
+      ozo_close(src);
+      return 1;
+    }
+    src->ozc = (const struct ozc_header *)src->data;
+  } else if (src->mapped)
+    madvise(src->data, src->len, MADV_SEQUENTIAL);
+
+  return 0;
+}
+
+void ozo_close(struct ozo_source *src)
+{
+  if (src->mapped)
+    munmap(src->data, src->len);
+  else
+    free(src->data);
+  src->data = NULL;
+  src->len = 0;
+  src->mapped = 0;
+  src->ozc = NULL;
+}
+
+static int selected(const struct ozo_query *q, uint64_t t, int32_t channel)
+{
+  return (t >= q->from) && (t <= q->to)
+    && ((q->channels == 0) || (q->channels & (1ull << (channel & 63))));
+}
+
+/* The next good record of a day file that the query selects */
+
+static int next_in_day_file(const struct ozo_source *src,
+			    const struct ozo_query *q, struct ozo_cursor *cur,
+			    struct ozo_rec *rec)
+{
+  const uint8_t *d = src->data;
+  size_t len = src->len;
+
+  while (cur->off + HEADER_LEN <= len) {
+    size_t off = cur->off;
+    uint32_t rec_len, fft_len;
+    const uint32_t hdr_magic = HEADER_MAGIC;
+    const uint8_t *p;
+    int status = ozo_check_record(&d[off], len - off, &rec_len);
+
+    if ((status == OZO_REC_BAD_MAGIC) || (status == OZO_REC_BAD_LENGTH)
+	|| (status == OZO_REC_TRUNCATED) || (rec_len < OFF_SIG_SPEC)) {
+      /* resynchronise on the next magic value */
+      cur->bad++;
+      p = memmem(&d[off + 1], len - off - 1, &hdr_magic, 4);
+      cur->off = p == NULL ? len : (size_t)(p - d);
+      continue;
+    }
+    cur->off += rec_len;
+
+    memcpy(&fft_len, &d[off + OFF_FFT_LEN], 4);
+    if ((status == OZO_REC_BAD_CRC) || (fft_len != FFT_LEN)
+	|| (rec_len < OFF_SIG_SPEC + 2 * FFT_LEN * sizeof(float))) {
+      cur->bad++;
+      continue;
+    }
+
+    memcpy(&rec->time_stamp, &d[off + OFF_TIME_STAMP], 8);
+    memcpy(&rec->channel, &d[off + OFF_CHANNEL], 4);
+    if (!selected(q, rec->time_stamp, rec->channel))
+      continue;
+
+    memcpy(&rec->freq_err, &d[off + OFF_FREQ_ERR], 8);
+    memcpy(rec->spec_int, &d[off + OFF_SPEC_INT], 8);
+    memcpy(&rec->max_sig_level, &d[off + OFF_MAX_SIG_LEVEL], 4);
+    rec->index = 0;
+    rec->meta = NULL;
+    rec->raw = &d[off];
+
+    p = &d[off + OFF_CAL_SPEC];
+    if ((uintptr_t)p % sizeof(float) == 0)
+      rec->spec = (const float *)p;
+    else {
+      memcpy(cur->spec_buf, p, sizeof(cur->spec_buf));
+      rec->spec = cur->spec_buf;
+    }
+
+    return 1;
+  }
+
+  cur->off = len;
+  return 0;
+}
+
+static int block_selected(const struct ozc_block *b, const struct ozo_query *q)
+{
+  return (b->time_max >= q->from) && (b->time_min <= q->to)
+    && ((q->channels == 0) || (b->channels & q->channels));
+}
+
+/* The next record of a compaction that the query selects. Records are
+   in time order, so the first block that can hold one is found by
+   bisection and the scan stops at the first block past the end. */
+
+static int next_in_compaction(const struct ozo_source *src,
+			      const struct ozo_query *q,
+			      struct ozo_cursor *cur, struct ozo_rec *rec)
+{
+  const struct ozc_header *h = src->ozc;
+  const uint8_t *d = src->data;
+  const struct ozc_block *blocks = (const void *)&d[h->offset[OZC_BLOCKS]];
+  const uint64_t *ts = (const void *)&d[h->offset[OZC_TIME_STAMP]];
+  const int32_t *ch = (const void *)&d[h->offset[OZC_CHANNEL]];
+
+  if ((cur->index == 0) && (h->num_blocks > 0)) {
+    uint32_t lo = 0, hi = h->num_blocks;
+
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (blocks[mid].time_max < q->from)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    cur->blocks_skipped += lo;
+    cur->index = lo < h->num_blocks ? blocks[lo].first : h->num_records;
+  }
+
+  while (cur->index < h->num_records) {
+    const struct ozc_block *b = &blocks[cur->index / OZC_BLOCK_LEN];
+    uint64_t i;
+
+    if (cur->index == b->first) {
+      if (b->time_min > q->to) {
+	cur->blocks_skipped += h->num_blocks - cur->index / OZC_BLOCK_LEN;
+	break;
+      }
+      if (!block_selected(b, q)) {
+	cur->blocks_skipped++;
+	cur->index += b->count;
+	continue;
+      }
+      cur->blocks_read++;
+    }
+
+    i = cur->index++;
+    if (!selected(q, ts[i], ch[i]))
+      continue;
+
+    rec->time_stamp = ts[i];
+    rec->channel = ch[i];
+    rec->freq_err = ((const double *)&d[h->offset[OZC_FREQ_ERR]])[i];
+    memcpy(rec->spec_int,
+	   &((const int32_t *)&d[h->offset[OZC_SPEC_INT]])[2 * i], 8);
+    rec->max_sig_level =
+      ((const int32_t *)&d[h->offset[OZC_MAX_SIG_LEVEL]])[i];
+    rec->index = i;
+    rec->raw = NULL;
+    rec->meta = &((const struct ozc_meta *)&d[h->offset[OZC_META_TABLE]])
+      [((const uint32_t *)&d[h->offset[OZC_META]])[i]];
+    rec->spec = h->layout == OZC_RECORD_MAJOR
+      ? &((const float *)&d[h->offset[OZC_SPEC]])[i * OZC_SPEC_BINS] : NULL;
+
+    return 1;
+  }
+
+  cur->index = h->num_records;
+  return 0;
+}
+
+/* Get the next record selected by q. Returns 1 if there is one, 0 at
+   the end of the source. */
+
+int ozo_next(const struct ozo_source *src, const struct ozo_query *q,
+	     struct ozo_cursor *cur, struct ozo_rec *rec)
+{
+  if (src->ozc != NULL)
+    return next_in_compaction(src, q, cur, rec);
+
+  return next_in_day_file(src, q, cur, rec);
+}
+
+/* Bin of a record's spectra: 0 to FFT_LEN - 1 the cal, then the upper
+   and lower sidebands */
+
+float ozo_bin(const struct ozo_source *src, const struct ozo_rec *rec,
+	      int bin)
+{
+  if (rec->spec != NULL)
+    return rec->spec[bin];
+
+  return ozc_bin_column(src, bin)[rec->index];
+}
+
+/* One bin over all the records of a bin-major compaction, or NULL */
+
+const float *ozc_bin_column(const struct ozo_source *src, int bin)
+{
+  const struct ozc_header *h = src->ozc;
+
+  if ((h == NULL) || (h->layout != OZC_BIN_MAJOR))
+    return NULL;
+
+  return &((const float *)&src->data[h->offset[OZC_SPEC]])
+    [(uint64_t)bin * h->num_records];
+}
+
+/* Seconds since 1970, or YYYYMMDD: the start of that day, or its end
+   if end is set. Returns 0 on success. */
+
+int ozo_parse_time(const char *s, int end, uint64_t *t)
+{
+  char *e;
+  unsigned long long v = strtoull(s, &e, 10);
+
+  if ((*e != '\0') || (e == s))
+    return 1;
+
+  if (strlen(s) == 8) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = v / 10000 - 1900;
+    tm.tm_mon = v / 100 % 100 - 1;
+    tm.tm_mday = v % 100;
+    v = timegm(&tm) + (end ? 86399 : 0);
+  }
+
+  *t = v;
+  return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Reading records from day files and their compactions
+ *
+ * A source is a day file (.ozo, mapped, or .ozo.gz, read into memory)
+ * or a columnar compaction (.ozc, mapped). Queries select records by
+ * time stamp and channel. In a day file every record is read and
+ * checked; in a compaction the block entries let whole blocks be
+ * skipped, and only the columns asked for are touched.
+ */
+
+#ifndef _OZOREAD_H
+#define _OZOREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "ozofile.h"
+#include "ozocolumn.h"
+
+struct ozo_source {
+  const char *path;
+  uint8_t *data;
+  size_t len;
+  int mapped; /* data is mmap()ed rather than malloc()ed */
+  const struct ozc_header *ozc; /* NULL for a day file */
+};
+
+/* Selection: time stamps from..to inclusive, and the channels whose
+   bits (channel % 64) are set in channels, or all if it is 0 */
+
+struct ozo_query {
+  uint64_t from;
+  uint64_t to;
+  uint64_t channels;
+};
+
+/* Position in a source. Start from zero. */
+
+struct ozo_cursor {
+  size_t off; /* day file: byte offset of the next record */
+  uint64_t index; /* compaction: next record */
+  long bad; /* day file records failing their checks */
+  long blocks_read; /* compaction blocks looked into */
+  long blocks_skipped; /* ... and passed over */
+  float spec_buf[OZC_SPEC_BINS]; /* unaligned spectra, copied */
+};
+
+/* A record. spec is the cal then the upper and lower sideband spectra,
+   or NULL in a bin-major compaction (use ozo_bin() there). */
+
+struct ozo_rec {
+  uint64_t time_stamp;
+  int32_t channel;
+  double freq_err;
+  int32_t spec_int[2];
+  int32_t max_sig_level;
+  const float *spec;
+  uint64_t index; /* in a compaction */
+  const struct ozc_meta *meta; /* in a compaction, else NULL */
+  const uint8_t *raw; /* the whole record in a day file, else NULL */
+};
+
+int ozo_open(const char *path, struct ozo_source *src);
+void ozo_close(struct ozo_source *src);
+int ozo_next(const struct ozo_source *src, const struct ozo_query *q,
+	     struct ozo_cursor *cur, struct ozo_rec *rec);
+float ozo_bin(const struct ozo_source *src, const struct ozo_rec *rec,
+	      int bin);
+const float *ozc_bin_column(const struct ozo_source *src, int bin);
+int ozo_is_day_file(const char *name);
+int ozo_is_data_file(const char *name);
+uint8_t *ozo_read_file(const char *path, size_t *len);
+int ozo_parse_time(const char *s, int end, uint64_t *t);
+
+#endif /* _OZOREAD_H */
@@ -0,0 +1,76 @@
+/*
+ * Checks of .ozo records
+ */
+
+#include <string.h>
+#include "ozorecord.h"
+#include "ozofile.h"
+#include "crc32c.h"
+
+#define MIN_REC_LEN 12 /* magic, version and length */
+
+/* Check the record at the start of d, len bytes being left in the
+ * data. Returns one of OZO_REC_*; *rec_len is set once the length has
+ * been read, so that a reader can step over a record with a bad CRC.
+ */
+
+int ozo_check_record(const uint8_t *d, size_t len, uint32_t *rec_len)
+{
+  uint32_t magic, version, crc;
+
+  if (len < MIN_REC_LEN)
+    return OZO_REC_SHORT;
+
+  memcpy(&magic, d, 4);
+  memcpy(&version, &d[OFF_VERSION], 4);
+  memcpy(rec_len, &d[OFF_REC_LEN], 4);
+
+  if (magic != HEADER_MAGIC)
+    return OZO_REC_BAD_MAGIC;
+  if (*rec_len < MIN_REC_LEN)
+    return OZO_REC_BAD_LENGTH;
+  if (*rec_len > len)
+    return OZO_REC_TRUNCATED;
+  if (version < CRC_VERSION)
+    return OZO_REC_NO_CRC;
+  if (*rec_len < HEADER_LEN + 4)
+    return OZO_REC_BAD_LENGTH;
+
+  memcpy(&crc, &d[*rec_len - 4], 4);
+  if (crc32c(0, d, *rec_len - 4) != crc)
+    return OZO_REC_BAD_CRC;
+
+  return OZO_REC_OK;
+}
+
+/* Length of the record at the start of d if it is good and has a CRC,
+   else 0 */
+
+uint32_t ozo_record_len(const uint8_t *d, size_t len)
+{
+  uint32_t rec_len;
+
+  return ozo_check_record(d, len, &rec_len) == OZO_REC_OK ? rec_len : 0;
+}
+
+const char *ozo_record_error(int status)
+{
+  switch (status) {
+    case OZO_REC_OK:
+      return "good";
+    case OZO_REC_NO_CRC:
+      return "no CRC";
+    case OZO_REC_SHORT:
+      return "truncated header";
+    case OZO_REC_BAD_MAGIC:
+      return "bad magic value";
+    case OZO_REC_BAD_LENGTH:
+      return "bad record length";
+    case OZO_REC_TRUNCATED:
+      return "truncated record";
+    case OZO_REC_BAD_CRC:
+      return "CRC mismatch";
+  }
+
+  return "unknown";
+}
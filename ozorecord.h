@@ -0,0 +1,27 @@
+/*
+ * Checks of .ozo records
+ *
+ * One place for what makes a record good: the magic value, a length
+ * that fits the data and, from version 6, the CRC-32C. Used by
+ * ozoverify, the readers of day files, the exporter and ozocollect.
+ */
+
+#ifndef _OZORECORD_H
+#define _OZORECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OZO_REC_OK 0
+#define OZO_REC_NO_CRC 1 /* good as far as can be told: before version 6 */
+#define OZO_REC_SHORT 2 /* less than a record's first 12 bytes left */
+#define OZO_REC_BAD_MAGIC 3
+#define OZO_REC_BAD_LENGTH 4
+#define OZO_REC_TRUNCATED 5 /* the length runs past the data */
+#define OZO_REC_BAD_CRC 6
+
+int ozo_check_record(const uint8_t *d, size_t len, uint32_t *rec_len);
+uint32_t ozo_record_len(const uint8_t *d, size_t len);
+const char *ozo_record_error(int status);
+
+#endif /* _OZORECORD_H */
@@ -0,0 +1,199 @@
+/*
+ * ozosummary: rebuild or print quick-look summary sidecars
+ *
+ * Usage: ozosummary [-p] <file or directory>...
+ *
+ * For each .ozo or .ozo.gz day file (directories are searched, not
+ * recursively) the .ozq sidecar is written afresh from the records,
+ * replacing any existing one. Records with a bad CRC are left out.
+ * With -p the sidecars of the given day files (or .ozq files) are
+ * printed instead, one line per record: time stamp, channel,
+ * frequency error, max signal level, then line power and baseline of
+ * each sideband.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ozofile.h"
+#include "ozoread.h"
+#include "summary.h"
+
+static int rebuild(const char *path)
+{
+  char qpath[_POSIX_PATH_MAX], tmp[_POSIX_PATH_MAX + 8];
+  const struct ozo_query all = { 0, UINT64_MAX, 0 };
+  struct ozo_source src;
+  struct ozo_cursor *cur;
+  struct ozo_summary s;
+  struct ozo_rec rec;
+  long good = 0;
+  FILE *fp;
+
+  if (summary_path(path, qpath, sizeof(qpath)) != 0) {
+    fprintf(stderr, "%s: not a day file\n", path);
+    return 1;
+  }
+
+  cur = calloc(1, sizeof(*cur));
+  if ((cur == NULL) || (ozo_open(path, &src) != 0)) {
+    fprintf(stderr, "%s: cannot read\n", path);
+    free(cur);
+    return 1;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", qpath);
+  fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot write %s\n", tmp);
+    ozo_close(&src);
+    free(cur);
+    return 1;
+  }
+
+  while (ozo_next(&src, &all, cur, &rec)) {
+    memset(&s, 0, sizeof(s));
+    s.magic = SUMMARY_MAGIC;
+    s.channel = rec.channel;
+    s.time_stamp = rec.time_stamp;
+    s.freq_err = rec.freq_err;
+    s.max_sig_level = rec.max_sig_level;
+    summarise_spectra(&rec.spec[FFT_LEN], &s); /* past the cal spectrum */
+
+    if (fwrite(&s, sizeof(s), 1, fp) != 1) {
+      fprintf(stderr, "Cannot write %s\n", tmp);
+      break;
+    }
+    good++;
+  }
+
+  ozo_close(&src);
+
+  if ((fclose(fp) != 0) || (rename(tmp, qpath) != 0)) {
+    fprintf(stderr, "Cannot write %s\n", qpath);
+    unlink(tmp);
+    free(cur);
+    return 1;
+  }
+
+  printf("%s: %ld records summarised, %ld bad\n", qpath, good, cur->bad);
+  free(cur);
+
+  return 0;
+}
+
+static int print(const char *path)
+{
+  char qpath[_POSIX_PATH_MAX];
+  struct ozo_summary s;
+  FILE *fp;
+  size_t n = strlen(path);
+
+  if ((n > 4) && (strcmp(&path[n - 4], ".ozq") == 0)) {
+    if (snprintf(qpath, sizeof(qpath), "%s", path) >= (int)sizeof(qpath)) {
+      fprintf(stderr, "%s: path too long\n", path);
+      return 1;
+    }
+  } else if (summary_path(path, qpath, sizeof(qpath)) != 0) {
+    fprintf(stderr, "%s: not a day file\n", path);
+    return 1;
+  }
+
+  fp = fopen(qpath, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot open %s\n", qpath);
+    return 1;
+  }
+
+  /* A torn last entry (the recorder does not sync the sidecar) is
+     simply not read */
+
+  while (fread(&s, sizeof(s), 1, fp) == 1) {
+    if (s.magic != SUMMARY_MAGIC) {
+      fprintf(stderr, "%s: bad entry, stopping\n", qpath);
+      break;
+    }
+    printf("%llu %d %.0f %d %g %g %g %g\n",
+	   (unsigned long long)s.time_stamp, s.channel, s.freq_err,
+	   s.max_sig_level, s.line_power[0], s.baseline[0], s.line_power[1],
+	   s.baseline[1]);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static int by_name(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Apply fn to a file, or to the day files in a directory in order */
+
+static int each_file(const char *path, int (*fn)(const char *))
+{
+  char file[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  char **list = NULL;
+  int n = 0, errors = 0;
+  DIR *dir;
+
+  if ((stat(path, &st) != 0) || !S_ISDIR(st.st_mode))
+    return fn(path);
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return 1;
+  }
+
+  while ((de = readdir(dir)) != NULL) {
+    char **l;
+
+    if (!ozo_is_day_file(de->d_name))
+      continue;
+    l = realloc(list, (n + 1) * sizeof(*list));
+    if (l == NULL)
+      break;
+    list = l;
+    list[n++] = strdup(de->d_name);
+  }
+  closedir(dir);
+
+  qsort(list, n, sizeof(*list), by_name);
+
+  for (int k = 0; k < n; k++) {
+    snprintf(file, sizeof(file), "%s/%s", path, list[k]);
+    errors += fn(file);
+    free(list[k]);
+  }
+  free(list);
+
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  int (*fn)(const char *) = rebuild;
+  int n = 1, errors = 0;
+
+  if ((argc > 1) && (strcmp(argv[1], "-p") == 0)) {
+    fn = print;
+    n++;
+  }
+
+  if (n >= argc) {
+    fprintf(stderr, "Usage: ozosummary [-p] <file or directory>...\n");
+    return 2;
+  }
+
+  for (; n < argc; n++)
+    errors += each_file(argv[n], fn);
+
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * ozoverify: check the records of .ozo data files
+ *
+ * Usage: ozoverify [-j threads] [-q] <file or directory>...
+ *
+ * Directories are searched (not recursively) for .ozo and .ozo.gz
+ * files. Files are checked in parallel. For each record the magic
+ * value, the length and, for version 6 and later, the CRC-32C are
+ * checked; bad records are reported by byte offset and the reader
+ * resynchronises on the next magic value. Exit status is 0 if every
+ * record is good, 1 if any is bad and 2 on errors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "ozofile.h"
+#include "ozoread.h"
+#include "ozorecord.h"
+
+#define MAX_FILES 65536
+#define MAX_THREADS 64
+
+struct file_result {
+  char path[_POSIX_PATH_MAX];
+  long records;
+  long bad;
+  long unchecked; /* records from before CRCs were added */
+  int error;
+  char *report; /* lines for the bad records */
+  size_t report_len;
+};
+
+static struct file_result *files;
+static int num_files = 0;
+static int next_file = 0; /* taken with __atomic_fetch_add */
+static int quiet = 0;
+
+static void report(struct file_result *r, const char *fmt, long offset,
+		   const char *what)
+{
+  char line[_POSIX_PATH_MAX + 128];
+  int n;
+
+  n = snprintf(line, sizeof(line), fmt, r->path, offset, what);
+  if (n < 0)
+    return;
+  if (n >= (int)sizeof(line))
+    n = sizeof(line) - 1;
+
+  r->report = realloc(r->report, r->report_len + n + 1);
+  if (r->report == NULL) {
+    r->report_len = 0;
+    return;
+  }
+  memcpy(&r->report[r->report_len], line, n + 1);
+  r->report_len += n;
+}
+
+/* Offset of the next magic value at or after off, or len if none */
+
+static size_t find_magic(const uint8_t *d, size_t len, size_t off)
+{
+  const uint32_t magic = HEADER_MAGIC;
+
+  for (; off + 4 <= len; off++)
+    if (memcmp(&d[off], &magic, 4) == 0)
+      return off;
+
+  return len;
+}
+
+static void check_records(struct file_result *r, const uint8_t *d,
+			  size_t len)
+{
+  size_t off = 0;
+
+  while (off < len) {
+    uint32_t rec_len;
+    int status = ozo_check_record(&d[off], len - off, &rec_len);
+
+    switch (status) {
+      case OZO_REC_SHORT:
+	r->bad++;
+	report(r, "%s: offset %ld: %s\n", off, ozo_record_error(status));
+	return;
+      case OZO_REC_BAD_MAGIC:
+      case OZO_REC_BAD_LENGTH:
+      case OZO_REC_TRUNCATED:
+	r->bad++;
+	report(r, "%s: offset %ld: %s\n", off, ozo_record_error(status));
+	off = find_magic(d, len, off + (status == OZO_REC_BAD_MAGIC ? 1 : 4));
+	continue;
+      case OZO_REC_NO_CRC:
+	r->unchecked++;
+	break;
+      case OZO_REC_BAD_CRC:
+	r->bad++;
+	report(r, "%s: offset %ld: %s\n", off, ozo_record_error(status));
+	break;
+    }
+
+    r->records++;
+    off += rec_len;
+  }
+}
+
+static void check_file(struct file_result *r)
+{
+  size_t plen = strlen(r->path);
+  struct stat st;
+  uint8_t *d;
+  size_t len;
+  int fd;
+
+  if ((plen > 3) && (strcmp(&r->path[plen - 3], ".gz") == 0)) {
+    d = ozo_read_file(r->path, &len);
+    if (d == NULL) {
+      r->error = 1;
+      return;
+    }
+    check_records(r, d, len);
+    free(d);
+    return;
+  }
+
+  fd = open(r->path, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) != 0)
+      || ((uint64_t)st.st_size > SIZE_MAX)) { /* too big to map */
+    r->error = 1;
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  if (st.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  d = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (d == MAP_FAILED) {
+    r->error = 1;
+    return;
+  }
+
+  madvise(d, st.st_size, MADV_SEQUENTIAL);
+  check_records(r, d, st.st_size);
+  munmap(d, st.st_size);
+}
+
+static void *worker(void *arg)
+{
+  int n;
+
+  while ((n = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED))
+	 < num_files)
+    check_file(&files[n]);
+
+  return NULL;
+}
+
+static void add_file(const char *path)
+{
+  if (num_files >= MAX_FILES) {
+    fprintf(stderr, "Too many files, ignoring %s\n", path);
+    return;
+  }
+  if (snprintf(files[num_files].path, sizeof(files[num_files].path), "%s",
+	       path) >= (int)sizeof(files[num_files].path)) {
+    fprintf(stderr, "Path too long, ignoring %s\n", path);
+    return;
+  }
+  num_files++;
+}
+
+static int by_path(const void *a, const void *b)
+{
+  return strcmp(((const struct file_result *)a)->path,
+		((const struct file_result *)b)->path);
+}
+
+static void add_path(const char *path)
+{
+  char file[_POSIX_PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+
+  if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+    dir = opendir(path);
+    if (dir == NULL) {
+      fprintf(stderr, "Cannot open %s\n", path);
+      return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+      if (!ozo_is_day_file(de->d_name))
+	continue;
+      if (snprintf(file, sizeof(file), "%s/%s", path, de->d_name)
+	  >= (int)sizeof(file)) {
+	fprintf(stderr, "%s/%s: path too long\n", path, de->d_name);
+	continue;
+      }
+      add_file(file);
+    }
+    closedir(dir);
+  } else
+    add_file(path);
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t threads[MAX_THREADS];
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long records = 0, bad = 0, unchecked = 0;
+  int opt, n, errors = 0;
+
+  while ((opt = getopt(argc, argv, "j:q")) != -1) {
+    switch (opt) {
+      case 'j':
+	num_threads = atoi(optarg);
+	break;
+      case 'q':
+	quiet = 1;
+	break;
+      default:
+	fprintf(stderr, "Usage: ozoverify [-j threads] [-q] "
+		"<file or directory>...\n");
+	return 2;
+    }
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: ozoverify [-j threads] [-q] "
+	    "<file or directory>...\n");
+    return 2;
+  }
+
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > MAX_THREADS)
+    num_threads = MAX_THREADS;
+
+  files = calloc(MAX_FILES, sizeof(struct file_result));
+  if (files == NULL) {
+    fprintf(stderr, "Cannot allocate file list\n");
+    return 2;
+  }
+
+  for (n = optind; n < argc; n++)
+    add_path(argv[n]);
+
+  qsort(files, num_files, sizeof(files[0]), by_path);
+
+  if (num_threads > num_files)
+    num_threads = num_files > 0 ? num_files : 1;
+
+  for (n = 0; n < num_threads; n++)
+    if (pthread_create(&threads[n], NULL, worker, NULL) != 0) {
+      fprintf(stderr, "Cannot start thread\n");
+      return 2;
+    }
+
+  for (n = 0; n < num_threads; n++)
+    pthread_join(threads[n], NULL);
+
+  for (n = 0; n < num_files; n++) {
+    struct file_result *r = &files[n];
+
+    if (r->error) {
+      fprintf(stderr, "%s: cannot read\n", r->path);
+      errors++;
+      continue;
+    }
+    if (r->report != NULL)
+      fputs(r->report, stdout);
+    if (!quiet || (r->bad > 0))
+      printf("%s: %ld records, %ld bad, %ld without CRC\n", r->path,
+	     r->records, r->bad, r->unchecked);
+
+    records += r->records;
+    bad += r->bad;
+    unchecked += r->unchecked;
+  }
+
+  printf("%d files, %ld records, %ld bad, %ld without CRC (%s)\n",
+	 num_files, records, bad, unchecked, crc32c_impl());
+
+  if (errors > 0)
+    return 2;
+
+  return bad > 0 ? 1 : 0;
+}
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <math.h>
+#include <errno.h>
 #include "rtl-sdr.h"
 #include "recthread.h"
 #include "common.h"
@@ -17,72 +19,140 @@
 #include "signalproc.h"
 #include "calcontrol.h"
 #include "config.h"
+#include "timeutil.h"
+#include "ozofile.h"
+#include "archive.h"
+#include "crc32c.h"
+#include "livespec.h"
+#include "export.h"
+#include "summary.h"
+#include "schedule.h"
+
+/* set once the first record has been written by any channel */
+static int first_record_done = 0;
+
+#define MAX_REOPEN_ATTEMPTS 10
+#define REOPEN_DELAY 5 /* seconds, multiplied by attempt number */
+#define ARENA_ALIGN 64
+
+/* An extension block to be written after the spectra */
+
+struct ozo_block {
+  uint32_t tag;
+  uint32_t len;
+  const void *data;
+};
+
+/* A record being written, and the copy of it kept for export */
+
+struct rec_out {
+  FILE *fp;
+  uint32_t crc;
+  uint8_t *copy;
+  size_t len;
+  size_t size;
+  int incomplete; /* the copy could not be made */
+};
+
+/* Write part of a record, adding it to the record's CRC and copy */
+
+static size_t put(const void *data, size_t len, struct rec_out *out)
+{
+  out->crc = crc32c(out->crc, data, len);
 
-#define HEADER_MAGIC 0xa9e4b8b4
-#define HEADER_VERSION 4
+  if (out->len + len > out->size) {
+    size_t size = 2 * (out->len + len);
+    uint8_t *p = realloc(out->copy, size);
 
-#define CALFREQ 1320000000 /* actual calibrator frequency */
-#define CALRXFREQ CALFREQ
+    if (p != NULL) {
+      out->copy = p;
+      out->size = size;
+    } else
+      out->incomplete = 1;
+  }
+  if (!out->incomplete)
+    memcpy(&out->copy[out->len], data, len);
+  out->len += len;
 
-#define READ_SIZE (16384 * 256)
-#define NUM_BLOCKS 4
-#define SIG_SIZE (NUM_BLOCKS * READ_SIZE)
-#define NUM_SIG_SPEC 8
-#define MAX_IN_QUEUE_LEN 3
-#define MAX_SIG_LEVEL_SAMPLES 10000
+  return len > 0 ? fwrite(data, len, 1, out->fp) : 1;
+}
 
 /* Write data to file
  * This function is NOT thread-safe and calls MUST be
  * protected by a mutex!
  */
 
-void write_file(struct rec_thread_context *ctx, uint64_t time_stamp,
+void write_file(struct rec_thread_context *ctx,
+		const struct ozone_config *cfg, uint64_t time_stamp,
 		double freq_err, int spec_out_int[2],
 		float *cal_spec_buf, float *spec_out_buf,
-		int32_t max_sig_level)
+		int32_t max_sig_level,
+		const struct ozo_block *blocks, int num_blocks)
 {
   static FILE *fp = NULL;
-  static uint64_t current_day = 0;
+  static FILE *qfp = NULL; /* the day file's summary sidecar */
+  static struct rec_out out = { NULL, 0, NULL, 0, 0, 0 };
+  static char current_file[_POSIX_PATH_MAX] = "";
   char filename[_POSIX_PATH_MAX];
+  char qfilename[_POSIX_PATH_MAX];
+  struct ozo_summary summary;
   const uint32_t hdr_magic = HEADER_MAGIC;
   const uint32_t samp_rate = SAMPLERATE;
   const uint32_t fft_len = FFT_LEN;
   const uint32_t hdr_version = HEADER_VERSION;
+  uint32_t crc;
   struct tm *tms;
   time_t t;
 
   uint64_t wanted_day = time_stamp - (time_stamp % 86400);
 
+  t = (time_t)wanted_day;
+  tms = gmtime(&t);
+  snprintf(filename, _POSIX_PATH_MAX, "%s/%04d%02d%02d_s%03d.ozo",
+	   cfg->data_dir, 1900 + tms->tm_year, tms->tm_mon + 1, tms->tm_mday,
+	   cfg->vsrt_num);
+
   if (fp != NULL) {
-    /* if currently open file is not the right one, close it */
-    if (current_day != wanted_day) {
+    /* if currently open file is not the right one (new day, or
+       DATADIR or VSRTNUM changed), close it and let the archive
+       worker deal with it */
+    if (strcmp(current_file, filename) != 0) {
       fclose(fp);
       fp = NULL;
+      if (qfp != NULL)
+	fclose(qfp);
+      qfp = NULL;
+      archive_kick(cfg);
     }
   }
 
   if (fp == NULL) {
     /* open the wanted file */
-    t = (time_t)wanted_day;
-    tms = gmtime(&t);
-    snprintf(filename, _POSIX_PATH_MAX, "%s/%04d%02d%02d_s%03d.ozo",
-	     data_dir, 1900 + tms->tm_year, tms->tm_mon + 1, tms->tm_mday,
-	     vsrt_num);
     fp = fopen(filename, "a");
     if (fp == NULL) {
       fprintf(stderr, "Could not open file %s\n", filename);
       return;
     }
     fprintf(stderr, "Opened file %s\n", filename);
-    current_day = wanted_day;
+    strcpy(current_file, filename);
+
+    /* Recording goes on without the sidecar if it cannot be opened */
+
+    summary_path(filename, qfilename, sizeof(qfilename));
+    qfp = fopen(qfilename, "a");
+    if (qfp == NULL)
+      fprintf(stderr, "Could not open file %s\n", qfilename);
   }
 
-  
+  out.fp = fp;
+  out.crc = 0;
+  out.len = 0;
+  out.incomplete = 0;
 
-  if (fwrite(&hdr_magic, sizeof(hdr_magic), 1, fp) != 1)
+  if (put(&hdr_magic, sizeof(hdr_magic), &out) != 1)
     fprintf(stderr, "WARNING: could not write out magic value\n");
 
-  if (fwrite(&hdr_version, sizeof(hdr_version), 1, fp) != 1)
+  if (put(&hdr_version, sizeof(hdr_version), &out) != 1)
     fprintf(stderr, "WARNING: could not write out header version\n");
 
   uint32_t rec_len = 3 * FFT_LEN * sizeof(float) + sizeof(hdr_magic)
@@ -90,55 +160,509 @@ void write_file(struct rec_thread_context *ctx, uint64_t time_stamp,
     + sizeof(time_stamp) + sizeof(freq_err)
     + 2 * sizeof(int) + sizeof(samp_rate)
     + sizeof(fft_len) + sizeof(ctx->channel) + MAX_SN_LEN
-    + sizeof(line_freq) + sizeof(vsrt_num) + MAX_STATION_NAME
-    + sizeof(max_sig_level);
+    + sizeof(cfg->line_freq) + sizeof(cfg->vsrt_num) + MAX_STATION_NAME
+    + sizeof(max_sig_level) + sizeof(out.crc);
 
-  if (fwrite(&rec_len, sizeof(rec_len), 1, fp) != 1)
+  for (int n = 0; n < num_blocks; n++)
+    rec_len += 2 * sizeof(uint32_t) + blocks[n].len;
+
+  if (put(&rec_len, sizeof(rec_len), &out) != 1)
     fprintf(stderr, "WARNING: could not write out record length\n");
 
-  if (fwrite(&time_stamp, sizeof(time_stamp), 1, fp) != 1)
+  if (put(&time_stamp, sizeof(time_stamp), &out) != 1)
     fprintf(stderr, "WARNING: could not write out timestamp\n");
 
-  if (fwrite(&freq_err, sizeof(freq_err), 1, fp) != 1)
+  if (put(&freq_err, sizeof(freq_err), &out) != 1)
     fprintf(stderr, "WARNING: could not write out freq err\n");
 
-  if (fwrite(spec_out_int, 2 * sizeof(int), 1, fp) != 1)
+  if (put(spec_out_int, 2 * sizeof(int), &out) != 1)
     fprintf(stderr, "WARNING: could not write out int factors\n");
 
-  if (fwrite(&samp_rate, sizeof(samp_rate), 1, fp) != 1)
+  if (put(&samp_rate, sizeof(samp_rate), &out) != 1)
     fprintf(stderr, "WARNING: could not write out sample rate\n");
 
-  if (fwrite(&fft_len, sizeof(fft_len), 1, fp) != 1)
+  if (put(&fft_len, sizeof(fft_len), &out) != 1)
     fprintf(stderr, "WARNING: could not write out FFT length\n");
 
-  if (fwrite(&ctx->channel, sizeof(ctx->channel), 1, fp) != 1)
+  if (put(&ctx->channel, sizeof(ctx->channel), &out) != 1)
     fprintf(stderr, "WARNING: could not write out channel number\n");
 
-  if (fwrite(ctx->dongle_sn, MAX_SN_LEN, 1, fp) != 1)
+  if (put(ctx->dongle_sn, MAX_SN_LEN, &out) != 1)
     fprintf(stderr, "WARNING: could not write out serial number\n");
 
-  if (fwrite(&line_freq, sizeof(line_freq), 1, fp) != 1)
+  if (put(&cfg->line_freq, sizeof(cfg->line_freq), &out) != 1)
     fprintf(stderr, "WARNING: could not write out line freq.\n");
  
-  if (fwrite(&vsrt_num, sizeof(vsrt_num), 1, fp) != 1)
+  if (put(&cfg->vsrt_num, sizeof(cfg->vsrt_num), &out) != 1)
     fprintf(stderr, "WARNING: could not write out VSRT number\n");
 
-  if (fwrite(station_name, MAX_STATION_NAME, 1, fp) != 1)
+  if (put(cfg->station_name, MAX_STATION_NAME, &out) != 1)
     fprintf(stderr, "WARNING: could not write out station name\n");
 
-  if (fwrite(&max_sig_level, sizeof(max_sig_level), 1, fp) != 1)
+  if (put(&max_sig_level, sizeof(max_sig_level), &out) != 1)
     fprintf(stderr, "WARNING: could not write out max sig level\n");
 
-  if (fwrite(cal_spec_buf, FFT_LEN * sizeof(float), 1, fp) != 1)
+  if (put(cal_spec_buf, FFT_LEN * sizeof(float), &out) != 1)
     fprintf(stderr, "WARNING: could not write out cal spectrum\n");
 
-  if (fwrite(spec_out_buf, 2 * FFT_LEN * sizeof(float), 1, fp) != 1)
+  if (put(spec_out_buf, 2 * FFT_LEN * sizeof(float), &out) != 1)
     fprintf(stderr, "WARNING: could not write out sig spectra\n");
 
+  for (int n = 0; n < num_blocks; n++) {
+    if ((put(&blocks[n].tag, sizeof(uint32_t), &out) != 1)
+	|| (put(&blocks[n].len, sizeof(uint32_t), &out) != 1)
+	|| (put(blocks[n].data, blocks[n].len, &out) != 1))
+      fprintf(stderr, "WARNING: could not write out block %u\n",
+	      blocks[n].tag);
+  }
+
+  /* CRC-32C of everything before it in the record */
+
+  crc = out.crc;
+  if (put(&crc, sizeof(crc), &out) != 1)
+    fprintf(stderr, "WARNING: could not write out CRC\n");
+
   fflush(fp);
   if (fdatasync(fileno(fp))) {
     perror("fdatasync()");
   }
+
+  /* Stream the record too, once it is safely on the card */
+
+  if (!out.incomplete)
+    export_record(out.copy, out.len);
+
+  /* The sidecar can be rebuilt from the day file, so it is not
+     synced */
+
+  if (qfp != NULL) {
+    memset(&summary, 0, sizeof(summary));
+    summary.magic = SUMMARY_MAGIC;
+    summary.channel = ctx->channel;
+    summary.time_stamp = time_stamp;
+    summary.freq_err = freq_err;
+    summary.max_sig_level = max_sig_level;
+    summarise_spectra(spec_out_buf, &summary);
+
+    if (fwrite(&summary, sizeof(summary), 1, qfp) != 1)
+      fprintf(stderr, "WARNING: could not write out summary\n");
+    fflush(qfp);
+  }
+}
+
+
+/* Derive the level statistics for the record from the histograms */
+
+static void summarise_stats(const struct sig_stats *s,
+			    struct ozo_sig_stats *out)
+{
+  double sum_i = 0, sum_q = 0, sum_sq = 0;
+  uint32_t n = 0;
+
+  memset(out, 0, sizeof(*out));
+
+  for (int v = 0; v < 256; v++) {
+    double x = ((double)v - 127.0) / 127.0; /* as convtab */
+
+    n += s->hist_i[v];
+    sum_i += x * s->hist_i[v];
+    sum_q += x * s->hist_q[v];
+    out->hist[v] = s->hist_i[v] + s->hist_q[v];
+    sum_sq += x * x * out->hist[v];
+
+    if ((out->hist[v] > 0) && (abs(v - 127) > out->peak))
+      out->peak = abs(v - 127);
+  }
+
+  out->num_samples = n;
+  out->clip_low = out->hist[0];
+  out->clip_high = out->hist[255];
+
+  if (n > 0) {
+    out->dc_i = sum_i / n;
+    out->dc_q = sum_q / n;
+    out->power = sum_sq / n;
+  }
+}
+
+/* A high-resolution block: the header and the window of spectra */
+
+struct hires_out {
+  struct ozo_hires h;
+  float spec[2 * MAX_HIRES_BINS];
+};
+
+/* Cut num_bins around the line out of a higher resolution's spectra
+ * and normalise them. Returns the length of the block.
+ */
+
+static uint32_t hires_window(const struct hires_accum *a, int len,
+			     int num_bins, const double line_pos[2],
+			     struct hires_out *out)
+{
+  if (num_bins > len)
+    num_bins = len;
+
+  out->h.fft_len = len;
+  out->h.num_bins = num_bins;
+
+  for (int k = 0; k < 2; k++) {
+    int first = (int)lround(line_pos[k] * len / FFT_LEN) - num_bins / 2;
+    float norm = 0;
+
+    if (a->spec_int[k] > 0)
+      norm = 1.0f / ((float)a->spec_int[k] * (float)len * (float)len);
+
+    out->h.first_bin[k] = first;
+    out->h.spec_int[k] = a->spec_int[k];
+
+    for (int j = 0; j < num_bins; j++) {
+      int b = ((first + j) % len + len) % len; /* FFT order */
+      out->spec[k * num_bins + j] = a->spec[k * len + b] * norm;
+    }
+  }
+
+  return sizeof(out->h) + 2 * num_bins * sizeof(float);
+}
+
+/* An extra target's block: the header and its normalised spectra */
+
+struct target_out {
+  struct ozo_target t;
+  float spec[2 * FFT_LEN];
+};
+
+static void target_block(const struct target *tg, const float *spec,
+			 const int spec_int[2], const uint32_t tuned[2],
+			 struct target_out *out)
+{
+  memset(&out->t, 0, sizeof(out->t));
+  strncpy(out->t.name, tg->name, sizeof(out->t.name));
+  out->t.freq = tg->freq;
+  out->t.role = tg->role;
+
+  for (int k = 0; k < 2; k++) {
+    float norm = 0;
+
+    if (spec_int[k] > 0) {
+      norm = 1.0f / ((float)spec_int[k] * (float)FFT_LEN * (float)FFT_LEN);
+      out->t.tuned_freq[k] = tuned[k];
+    }
+    out->t.spec_int[k] = spec_int[k];
+
+    for (int j = 0; j < FFT_LEN; j++)
+      out->spec[k * FFT_LEN + j] = spec[k * FFT_LEN + j] * norm;
+  }
+}
+
+/* Wait until settle_ms after the calibrator was switched on at t_on
+   (CLOCK_MONOTONIC ns). Tuning to it usually takes up some of that. */
+
+static void settle_until(int64_t t_on, int settle_ms)
+{
+  int64_t t = t_on + settle_ms * 1000000LL;
+  struct timespec ts = { t / 1000000000, t % 1000000000 };
+
+  if (settle_ms > 0)
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+}
+
+static void heartbeat(struct rec_thread_context *ctx)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  __atomic_store_n(&ctx->heartbeat, ts.tv_sec, __ATOMIC_RELEASE);
+}
+
+/* Read a block from the dongle, keeping the supervisor informed.
+ * Returns 0 on success.
+ */
+
+static int capture(struct rec_thread_context *ctx, uint8_t *buf, int len,
+		   int *n_read)
+{
+  int r, stalled;
+
+  heartbeat(ctx);
+  __atomic_store_n(&ctx->in_read, 1, __ATOMIC_RELEASE);
+
+  r = read_dongle(ctx->dev, buf, len, n_read);
+
+  /* The supervisor marks a channel stalled only while in_read is set
+     and under dev_mutex, so what is seen here is final */
+
+  pthread_mutex_lock(&ctx->dev_mutex);
+  __atomic_store_n(&ctx->in_read, 0, __ATOMIC_RELEASE);
+  stalled = __atomic_load_n(&ctx->stalled, __ATOMIC_ACQUIRE);
+  pthread_mutex_unlock(&ctx->dev_mutex);
+  heartbeat(ctx);
+
+  if (stalled) {
+    fprintf(stderr, "  rec_thread %d: read aborted by supervisor\n",
+	    ctx->channel);
+    return -1;
+  }
+
+  if (r < 0) {
+    fprintf(stderr, "WARNING: read_dongle() failed\n");
+    if (*n_read != len)
+      fprintf(stderr, "WARNING: received wrong number of samples (%d)\n", \
+	      *n_read);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Close and reopen this channel's dongle by serial number.
+ * Returns 0 on success.
+ */
+
+static int reopen_dongle(struct rec_thread_context *ctx)
+{
+  rtlsdr_dev_t *dev;
+
+  for (int attempt = 1; attempt <= MAX_REOPEN_ATTEMPTS; attempt++) {
+
+    pthread_mutex_lock(&ctx->dev_mutex);
+    if (ctx->dev != NULL)
+      close_dongle(ctx->dev);
+    ctx->dev = NULL;
+    pthread_mutex_unlock(&ctx->dev_mutex);
+
+    fprintf(stderr, "  rec_thread %d: reopening dongle %s (attempt %d)\n",
+	    ctx->channel, ctx->dongle_sn, attempt);
+
+    sleep(attempt * REOPEN_DELAY);
+
+    dev = init_dongle(ctx->dongle_sn);
+    if (dev != NULL) {
+      pthread_mutex_lock(&ctx->dev_mutex);
+      ctx->dev = dev;
+      pthread_mutex_unlock(&ctx->dev_mutex);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Carve an aligned region out of an arena */
+
+static void *carve(uint8_t **p, size_t size)
+{
+  void *r = *p;
+
+  *p += (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  return r;
+}
+
+/* Allocate all of a channel's buffers as a single arena and fault
+ * the pages in, so that this cost is paid during startup (in
+ * parallel with the other channels) rather than in the first cycle.
+ * Returns 0 on success.
+ */
+
+int rec_thread_alloc(struct rec_thread_context *ctx)
+{
+  struct rec_buffers *b = &ctx->bufs;
+  const struct cycle_shape *sh = &ctx->shape;
+  size_t sizes[7];
+  size_t arena_size = 0;
+  uint8_t *p;
+
+  /* Signal is integrated as each read arrives, so only the chunks in
+     flight are buffered, whatever the number of blocks and spectra */
+
+  sizes[0] = (size_t)sh->read_size * sh->in_queue_len;
+  sizes[1] = sh->in_queue_len * sizeof(int);
+  sizes[2] = sh->in_queue_len * sizeof(int);
+  sizes[3] = FFT_LEN * sizeof(float);
+  sizes[4] = sizeof(struct cycle_accum);
+  sizes[5] = MAX_HIRES_LEN * sizeof(fft_complex); /* a tile for all */
+  sizes[6] = MAX_HIRES_LEN * sizeof(fft_complex); /* resolutions */
+
+  for (int n = 0; n < 7; n++)
+    arena_size += (sizes[n] + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  /* fftwf_malloc() gives the alignment the FFT backends need */
+
+  b->arena = fftwf_malloc(arena_size);
+  if (b->arena == NULL) {
+    fprintf(stderr, "  rec_thread %d: failed to allocate %zu bytes\n",
+	    ctx->channel, arena_size);
+    return 1;
+  }
+  b->arena_size = arena_size;
+
+  /* 127 corresponds to zero signal */
+
+  memset(b->arena, 127, arena_size);
+
+  p = b->arena;
+  b->data_buf = carve(&p, sizes[0]);
+  b->chunk_len = carve(&p, sizes[1]);
+  b->chunk_flags = carve(&p, sizes[2]);
+  b->cal_spec_buf = carve(&p, sizes[3]);
+  b->accum = carve(&p, sizes[4]);
+  b->cfftin = carve(&p, sizes[5]);
+  b->cfftout = carve(&p, sizes[6]);
+
+  fprintf(stderr, "  rec_thread %d: %.1f MB of buffers\n", ctx->channel,
+	  arena_size / 1048576.0);
+
+  return 0;
+}
+
+void rec_thread_free(struct rec_thread_context *ctx)
+{
+  fftwf_free(ctx->bufs.arena);
+  ctx->bufs.arena = NULL;
+}
+
+/* Start the computational thread, working on the current buffers */
+
+static int start_comp_thread(struct rec_thread_context *ctx,
+			     struct comp_thread_context *cctx,
+			     pthread_t *cthread)
+{
+  int r;
+
+  cctx->max_in_queue_len = ctx->shape.in_queue_len;
+  cctx->chunk_size = ctx->shape.read_size;
+  cctx->data_buf = ctx->bufs.data_buf;
+  cctx->chunk_len = ctx->bufs.chunk_len;
+  cctx->chunk_flags = ctx->bufs.chunk_flags;
+  cctx->accum = ctx->bufs.accum;
+  cctx->cal_spec = ctx->bufs.cal_spec_buf;
+  cctx->fft_win = ctx->fft_win;
+  cctx->cfg = config_get();
+  cctx->fft = fft_get(cctx->cfg->fft_backend);
+  cctx->fftin = ctx->bufs.cfftin;
+  cctx->fftout = ctx->bufs.cfftout;
+  cctx->busy_time = 0;
+  cctx->quit = 0;
+
+  r = pthread_create(cthread, NULL, comp_thread, (void *)cctx);
+  if (r != 0) {
+    fprintf(stderr, "pthread_create(): %s", strerror(r));
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Stop the computational thread, which must be idle */
+
+static void stop_comp_thread(struct comp_thread_context *cctx,
+			     pthread_t cthread)
+{
+  pthread_mutex_lock(cctx->in_queue_mutex_p);
+  cctx->quit = 1;
+  pthread_mutex_unlock(cctx->in_queue_mutex_p);
+  pthread_cond_signal(cctx->in_queue_cond_p);
+
+  pthread_join(cthread, NULL);
+}
+
+/* Change the cycle shape: the buffers are reallocated to suit and the
+ * computational thread restarted. Called between cycles, when the
+ * queues are empty. Returns 0 on success.
+ */
+
+static int reshape(struct rec_thread_context *ctx,
+		   const struct cycle_shape *shape,
+		   struct comp_thread_context *cctx, pthread_t *cthread)
+{
+  struct cycle_shape old_shape = ctx->shape;
+
+  stop_comp_thread(cctx, *cthread);
+  rec_thread_free(ctx);
+
+  ctx->shape = *shape;
+  if (rec_thread_alloc(ctx) != 0) {
+    fprintf(stderr, "  rec_thread %d: reverting to previous cycle shape\n",
+	    ctx->channel);
+    ctx->shape = old_shape;
+    if (rec_thread_alloc(ctx) != 0)
+      return 1;
+  }
+
+  fprintf(stderr, "  rec_thread %d: cycle shape now %d x %d bytes, "
+	  "%d spectra per sideband, %d chunks in flight (%zu MB)\n",
+	  ctx->channel, ctx->shape.num_blocks, ctx->shape.read_size,
+	  ctx->shape.num_sig_spec, ctx->shape.in_queue_len,
+	  ctx->bufs.arena_size >> 20);
+
+  return start_comp_thread(ctx, cctx, cthread);
+}
+
+/* Wait until no more than max_len chunks are queued: 0 for the
+   computational thread to finish, the ring length less one for a free
+   slot. Returns 0 on success. */
+
+static int wait_queue(pthread_mutex_t *mutex, pthread_cond_t *cond,
+		      const int *len, int max_len)
+{
+  int r;
+
+  r = pthread_mutex_lock(mutex);
+  if (r != 0) {
+    fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(r));
+    return 1;
+  }
+
+  while (*len > max_len) {
+    r = pthread_cond_wait(cond, mutex);
+    if (r != 0) {
+      fprintf(stderr, "  rec_thread: pthread_cond_wait(in_queue): %s\n",
+	      strerror(r));
+      pthread_mutex_unlock(mutex);
+      return 1;
+    }
+  }
+
+  r = pthread_mutex_unlock(mutex);
+  if (r != 0) {
+    fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(r));
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Hand the chunk at *in_ptr to the computational thread. Returns 0 on
+   success. */
+
+static int queue_chunk(pthread_mutex_t *mutex, pthread_cond_t *cond,
+		       int *len, int *in_ptr, int ring_len)
+{
+  int r;
+
+  r = pthread_mutex_lock(mutex);
+  if (r != 0) {
+    fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(r));
+    return 1;
+  }
+
+  (*len)++;
+  *in_ptr = (*in_ptr + 1) % ring_len;
+
+  r = pthread_mutex_unlock(mutex);
+  if (r != 0) {
+    fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(r));
+    return 1;
+  }
+
+  r = pthread_cond_signal(cond);
+  if (r != 0) {
+    fprintf(stderr, "pthread_cond_signal: %s\n", strerror(r));
+    return 1;
+  }
+
+  return 0;
 }
 
 
@@ -147,86 +671,65 @@ void *rec_thread(void *ptarg)
 
   struct rec_thread_context *ctx;
   int n, r, n_read;
-  double freq_err;
-  uint32_t line_rx_freq;
+  double freq_err = 0, ft_sigma = 0;
+  double t_cal = 0, t_sig0 = 0, t_sig1 = 0;
+  int cal, cal_taken;
+  struct ozo_freq_track ftb;
+  struct ozo_cal cb;
+  uint32_t line_rx_freq, cur_freq = 0;
+  uint32_t tuned_freq[2];
+  uint32_t target_tuned[MAX_TARGETS][2] = { { 0 } };
+  struct target_out targets[MAX_TARGETS];
+  struct dwell *sched = NULL;
+  int sched_len = 0, num_dwells;
+  unsigned int sched_generation = 0;
   pthread_t cthread;
   struct comp_thread_context cctx;
-  int in_queue_in_ptr = 0, out_queue_out_ptr = 0;
-  fftwf_complex *fftin;
-  fftwf_complex *fftout;
-  fftwf_plan fplan;
+  int in_queue_in_ptr = 0;
   float spec_out_buf[2 * FFT_LEN];
   int spec_out_int[2];
   uint64_t time_stamp;
-  int data_buf_idx;
   pthread_mutex_t in_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
   pthread_cond_t in_queue_cond = PTHREAD_COND_INITIALIZER;
   int in_queue_len = 0;
-  pthread_mutex_t out_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_cond_t out_queue_cond = PTHREAD_COND_INITIALIZER;
-  int out_queue_len = 0;
   int32_t max_sig_level;
+  struct ozo_sig_stats level;
+  struct ozo_fold fold;
+  struct ozo_timing rt;
+  struct hires_out hires[MAX_HIRES];
+  double line_pos[2];
+  struct ozo_block blocks[6 + MAX_HIRES + MAX_TARGETS];
+  int64_t t_ns, last_ckpt = 0;
+  int num_blocks;
+  int cycle_ok;
+  int first_dwell, resumed, ckpt_saved = 0;
+  struct ckpt_state *ck;
+  const struct ozone_config *cfg;
+  const struct cycle_shape *sh;
+  struct cycle_accum *accum;
+  struct cycle_timing timing;
+  struct timespec cycle_start, t0;
 
   fprintf(stderr, "  rec_thread: thread started\n");
 
   ctx = (struct rec_thread_context *)ptarg;
+  sh = &ctx->shape;
 
-  if (READ_SIZE % (2 * FFT_LEN) != 0)
-    fprintf(stderr, "  rec_thread: WARNING: dongle read length is not a multiple of FFT length\n");
+  /* Buffers were set up by rec_thread_alloc() during startup */
 
-  if (SIG_SIZE % (2 * FFT_LEN) != 0)
-    fprintf(stderr, "  rec_thread: WARNING: signal length is not a multiple of FFT length\n");
-
-  /* Allocate data buffers */
-
-  uint8_t *data_buf = malloc(SIG_SIZE * MAX_IN_QUEUE_LEN);
-  if (data_buf == NULL)
-    return NULL;
-
-  int *data_buf_sig_len = malloc(MAX_IN_QUEUE_LEN * sizeof(int));
-  if (data_buf_sig_len == NULL)
-    return NULL;
-
-  uint8_t *cal_data_buf = malloc(READ_SIZE);
-  if (cal_data_buf == NULL)
-    return NULL;
-
-  float *cal_spec_buf = malloc(FFT_LEN * sizeof(float));
-  if (cal_spec_buf == NULL)
-    return NULL;
-
-  float *sig_spec_buf = malloc(FFT_LEN * NUM_SIG_SPEC * 2 * sizeof(float));
-  if (sig_spec_buf == NULL)
-    return NULL;
-
-  int *sig_spec_int = malloc(NUM_SIG_SPEC * 2 * sizeof(int));
-  if (sig_spec_int == NULL)
-    return NULL;
-
-  if ((fplan = init_fft(&fftin, &fftout)) == NULL)
-    return NULL;
+  uint8_t *data_buf = ctx->bufs.data_buf;
+  int *chunk_len = ctx->bufs.chunk_len;
+  int *chunk_flags = ctx->bufs.chunk_flags;
+  float *cal_spec_buf = ctx->bufs.cal_spec_buf;
 
   /* Create computational thread */
 
   cctx.in_queue_mutex_p = &in_queue_mutex;
   cctx.in_queue_cond_p = &in_queue_cond;
   cctx.in_queue_len_p = &in_queue_len;
-  cctx.out_queue_mutex_p = &out_queue_mutex;
-  cctx.out_queue_cond_p = &out_queue_cond;
-  cctx.out_queue_len = &out_queue_len;
-  cctx.max_in_queue_len = MAX_IN_QUEUE_LEN;
-  cctx.sig_size = SIG_SIZE;
-  cctx.data_buf = data_buf;
-  cctx.data_buf_sig_len = data_buf_sig_len;
-  cctx.num_sig_spec = NUM_SIG_SPEC;
-  cctx.sig_spec_buf = sig_spec_buf;
-  cctx.sig_spec_int = sig_spec_int;
-  
-  r = pthread_create(&cthread, NULL, comp_thread, (void *)&cctx);
-  if (r != 0) {
-    fprintf(stderr, "pthread_create(): %s", strerror(r));
+
+  if (start_comp_thread(ctx, &cctx, &cthread) != 0)
     return NULL;
-  }
 
   /* set RT scheduling for this thread */
 
@@ -240,209 +743,491 @@ void *rec_thread(void *ptarg)
 
   while (1) {
 
-    max_sig_level = 0;
+    if (!ctx->barrier_member) {
+
+      /* Dropped out of the cycle after a dongle failure: reopen the
+	 dongle and rejoin at the start of a cycle */
+
+      if (reopen_dongle(ctx) != 0) {
+	fprintf(stderr, "  rec_thread %d: could not reopen dongle %s. "
+		"Exiting.\n", ctx->channel, ctx->dongle_sn);
+	exit(EXIT_FAILURE);
+      }
 
-    set_frequency(ctx->dev, CALRXFREQ);
-    
-    /* Clear signal data buffer: 127 corresponds to zero signal */
+      __atomic_store_n(&ctx->stalled, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&ctx->cal_wanted, 1, __ATOMIC_RELEASE);
+      cur_freq = 0;
+      cycle_barrier_join(ctx->cycle_barrier, &ctx->barrier_member);
+      fprintf(stderr, "  rec_thread %d: rejoined cycle\n", ctx->channel);
+    }
 
-    memset(cal_data_buf, 127, READ_SIZE); 
+    cycle_ok = 1;
+    max_sig_level = 0;
+    memset(&timing, 0, sizeof(timing));
+    memset(&rt, 0, sizeof(rt));
+    cal_taken = 0;
+    t_sig0 = 0;
+    memset(&cb, 0, sizeof(cb));
 
     fprintf(stderr, "  rec_thread: waiting for cal on\n");
-    r = pthread_barrier_wait(ctx->cal_on_barrier);
+    heartbeat(ctx);
+    cycle_barrier_wait(ctx->cycle_barrier, PHASE_CAL_ON, &ctx->barrier_member);
 
-    fprintf(stderr, "  rec_thread: recording cal\n");
+    clock_gettime(CLOCK_MONOTONIC, &cycle_start);
 
-    time_stamp = *(ctx->time_stamp);
+    /* Pick up the current configuration at the cycle boundary. The main
+       thread publishes any change before cal on, so after it every
+       channel sees the same snapshot and hence the same cycle shape. */
 
-    rtlsdr_reset_buffer(ctx->dev); /* flush any old signal away */
+    cfg = config_get();
+    __atomic_store_n(&ctx->cfg_generation, cfg->generation, __ATOMIC_RELEASE);
 
-    r = rtlsdr_read_sync(ctx->dev, cal_data_buf, READ_SIZE, &n_read);
-    if (r < 0)
-      fprintf(stderr, "WARNING: rtlsdr_read_sync() failed\n");
-    if (n_read != READ_SIZE)
-      fprintf(stderr, "WARNING: received wrong number of samples (%d)\n", \
-	      n_read);
+    if (memcmp(&cfg->shape, &ctx->shape, sizeof(ctx->shape)) != 0) {
+      if (reshape(ctx, &cfg->shape, &cctx, &cthread) != 0) {
+	fprintf(stderr, "  rec_thread %d: could not change cycle shape. "
+		"Exiting.\n", ctx->channel);
+	exit(EXIT_FAILURE);
+      }
+      data_buf = ctx->bufs.data_buf;
+      chunk_len = ctx->bufs.chunk_len;
+      chunk_flags = ctx->bufs.chunk_flags;
+      cal_spec_buf = ctx->bufs.cal_spec_buf;
+      in_queue_in_ptr = 0;
+    }
 
-    fprintf(stderr, "  rec_thread: waiting for cal to finish\n");
-    r = pthread_barrier_wait(ctx->cal_rec_done_barrier);
-  
-    fprintf(stderr, "  Calculating spectrum... ");
-    calc_spectrum(cal_data_buf, READ_SIZE, cal_spec_buf, NULL, \
-		  ctx->fft_win, fplan, fftin, fftout);
-    fprintf(stderr, "Done.\n");
+    /* Start the cycle's integration afresh. The computational thread
+       is idle until the first chunk is queued; the FFT backend and SK
+       settings may have changed with a reload. */
 
-    freq_err = find_freq_error(cal_spec_buf, SAMPLERATE, CALRXFREQ, CALFREQ);
+    cctx.fft = fft_get(cfg->fft_backend);
+    cctx.cfg = cfg;
 
-    fprintf(stderr, "  rec_thread: waiting for cal off\n");
-    r = pthread_barrier_wait(ctx->cal_off_barrier);
+    cctx.num_hires = 0;
+    for (int k = 0; k < cfg->num_hires; k++) {
+      cctx.hires_fft[cctx.num_hires] = fft_get_hires(cfg->hires[k]);
+      if (cctx.hires_fft[cctx.num_hires] != NULL)
+	cctx.num_hires++;
+    }
 
-    for (int scount = 0; scount < 2 * NUM_SIG_SPEC; scount++) {
+    /* The schedule follows the configuration and the cycle shape */
 
-      if ((scount % 2) == 0) {
+    if (schedule_max_dwells(cfg) > sched_len) {
+      struct dwell *p = realloc(sched, schedule_max_dwells(cfg)
+				* sizeof(struct dwell));
 
-	/* tune above line frequency */
-	
-	line_rx_freq = (uint32_t)(line_freq + (double)(SAMPLERATE / 4)
-				  + freq_err);
-      } else {
-	/* tune below line frequency */
+      if (p == NULL) {
+	fprintf(stderr, "  rec_thread %d: cannot allocate schedule. "
+		"Exiting.\n", ctx->channel);
+	exit(EXIT_FAILURE);
+      }
+      sched = p;
+      sched_len = schedule_max_dwells(cfg);
+    }
+    num_dwells = schedule_build(cfg, sched);
+    if (num_dwells < 0) {
+      fprintf(stderr, "  rec_thread %d: cannot allocate schedule. "
+	      "Exiting.\n", ctx->channel);
+      exit(EXIT_FAILURE);
+    }
+    if ((cfg->generation != sched_generation) && (ctx->channel == 0))
+      schedule_print(cfg, sched, num_dwells);
+    sched_generation = cfg->generation;
+
+    accum = ctx->bufs.accum;
+    memset(accum, 0, sizeof(*accum));
+    accum->sk.mode = cfg->sk_mode;
+    accum->sk.sigma = cfg->sk_sigma;
 
-	line_rx_freq = (uint32_t)(line_freq - (double)(SAMPLERATE / 4)
-				 + freq_err);
+    time_stamp = *(ctx->time_stamp);
+    cal = *(ctx->cal_cycle); /* decided by the main thread before cal on */
+    cctx.busy_time = 0; /* computational thread is idle */
+
+    /* After a restart, carry on with the cycle that was in progress
+       from where it was last checkpointed. The main thread has taken
+       its time stamp and leaves the calibrator alone. */
+
+    first_dwell = 0;
+    resumed = ctx->resume != NULL;
+    if (resumed) {
+      ck = ctx->resume;
+      memcpy(accum, &ck->accum, sizeof(*accum));
+      memcpy(cal_spec_buf, ck->cal_spec, sizeof(ck->cal_spec));
+      time_stamp = ck->time_stamp;
+      cal = ck->cal;
+      cal_taken = ck->cal_taken;
+      t_cal = ck->t_cal;
+      t_sig0 = ck->t_sig0;
+      memcpy(tuned_freq, ck->tuned_freq, sizeof(tuned_freq));
+      memcpy(target_tuned, ck->target_tuned, sizeof(target_tuned));
+      rt = ck->rt;
+      cb = ck->cb;
+      first_dwell = ck->next_dwell;
+      ckpt_saved = 1;
+
+      fprintf(stderr, "  rec_thread %d: resuming cycle at dwell %d of %d\n",
+	      ctx->channel, first_dwell, num_dwells);
+      free(ctx->resume);
+      ctx->resume = NULL;
+    }
+    timing.calibrated = cal;
+
+    /* The cal is recorded into the next chunk of the (empty) ring and
+       queued like the signal, so that its spectrum and the frequency
+       error are computed while the signal is being captured. Clear
+       it: 127 corresponds to zero signal */
+
+    if (cal && !resumed) {
+      memset(&data_buf[in_queue_in_ptr * sh->read_size], 127, sh->read_size);
+
+      fprintf(stderr, "  rec_thread: recording cal\n");
+
+      set_frequency(ctx->dev, CALRXFREQ);
+      cur_freq = CALRXFREQ;
+      settle_until(ctx->cal_on->t_mono, cfg->cal_settle_ms);
+      reset_dongle(ctx->dev); /* flush any old signal away */
+
+      rt.cal_start = clock_ns(CLOCK_REALTIME);
+      t_ns = clock_ns(CLOCK_MONOTONIC);
+      t_cal = t_ns * 1.0E-9;
+      cb.on = ctx->cal_on->t_real;
+      cb.on_latency = ctx->cal_on->latency;
+      cb.settle = t_ns - ctx->cal_on->t_mono;
+
+      if (capture(ctx, &data_buf[in_queue_in_ptr * sh->read_size],
+		  sh->read_size, &n_read) != 0) {
+	cycle_ok = 0;
+	cycle_barrier_leave(ctx->cycle_barrier, &ctx->barrier_member);
       }
 
-      set_frequency(ctx->dev, line_rx_freq);
+      if (cycle_ok) {
+	chunk_len[in_queue_in_ptr] = sh->read_size;
+	chunk_flags[in_queue_in_ptr] = CHUNK_CAL;
+	if (queue_chunk(&in_queue_mutex, &in_queue_cond, &in_queue_len,
+			&in_queue_in_ptr, sh->in_queue_len) != 0)
+	  return NULL;
+      }
+    }
 
-      fprintf(stderr, "  rec_thread: recording signal %d, %d\n", scount,
-	      in_queue_in_ptr);
+    fprintf(stderr, "  rec_thread: waiting for cal to finish\n");
+    cycle_barrier_wait(ctx->cycle_barrier, PHASE_CAL_REC_DONE,
+		       &ctx->barrier_member);
 
-      rtlsdr_reset_buffer(ctx->dev); /* flush any cal signal away */
+    fprintf(stderr, "  rec_thread: waiting for cal off\n");
+    cycle_barrier_wait(ctx->cycle_barrier, PHASE_CAL_OFF, &ctx->barrier_member);
 
-      /* Check for space in queue, wait if full */
+    timing.cal = time_since(&cycle_start);
 
-      r = pthread_mutex_lock(&in_queue_mutex);
-      if (r != 0) {
-	fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(r));
-	return NULL;
-      }
+    /* Unless it stays on, the calibrator was switched off meanwhile */
+
+    if (!resumed && (ctx->cal_off->t_mono > ctx->cal_on->t_mono)) {
+      cb.off = ctx->cal_off->t_real;
+      cb.off_latency = ctx->cal_off->latency;
+    }
 
-      while (in_queue_len == MAX_IN_QUEUE_LEN) {
-	fprintf(stderr, "  rec_thread: waiting for space in queue\n");
-	r = pthread_cond_wait(&in_queue_cond, &in_queue_mutex);
-	if (r != 0) {
-	  fprintf(stderr, "  rec_thread: pthread_cond_wait(in_queue): %s\n",
-		  strerror(r));
+    for (int d = first_dwell; d < num_dwells; d++) {
+      const struct dwell *dw = &sched[d];
+      int sb = dw->sideband, line = dw->target == DWELL_LINE;
+
+      /* Tune with this cycle's frequency error as soon as the
+	 computational thread has it, and with the track's prediction
+	 until then or without a cal. With no track yet (the first
+	 cycle) wait for the cal. */
+
+      if (cal && cycle_ok && (ctx->ftrack.num_meas == 0)) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (wait_queue(&in_queue_mutex, &in_queue_cond, &in_queue_len, 0) != 0)
 	  return NULL;
-	}
+	timing.queue_wait += time_since(&t0);
       }
 
-      r = pthread_mutex_unlock(&in_queue_mutex);
-      if (r != 0) {
-	fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(r));
-	return NULL;
+      if (cal && !cal_taken
+	  && __atomic_load_n(&accum->cal_done, __ATOMIC_ACQUIRE)) {
+	freq_track_update(&ctx->ftrack, t_cal, accum->freq_err);
+	cal_taken = 1;
       }
 
-      /* Clear signal data buffer: 127 corresponds to zero signal */
+      if (cal_taken)
+	freq_err = accum->freq_err;
+      else
+	freq_err = freq_track_predict(&ctx->ftrack,
+				      clock_ns(CLOCK_MONOTONIC) * 1.0E-9, NULL);
 
-      memset(&data_buf[in_queue_in_ptr * SIG_SIZE], 127, SIG_SIZE);
+      /* above or below the line (or target) by a quarter of the sample
+	 rate, as the schedule says */
 
-      data_buf_sig_len[in_queue_in_ptr] = 0;
+      line_rx_freq = (uint32_t)(dwell_freq(cfg, dw) + freq_err);
 
-      data_buf_idx = 0;
+      if (line)
+	tuned_freq[sb] = line_rx_freq;
+      else
+	target_tuned[dw->target][sb] = line_rx_freq;
 
-      for(n = 0; n < NUM_BLOCKS; n++) {
+      /* A dwell tuned as the previous one carries straight on; the
+	 first of the cycle at least flushes what came in since the
+	 last */
 
-	r = rtlsdr_read_sync(ctx->dev, &data_buf[in_queue_in_ptr * SIG_SIZE
-			    + data_buf_idx], READ_SIZE, &n_read);
-	if (r < 0)
-	  fprintf(stderr, "WARNING: rtlsdr_read_sync() failed\n");
-	if (n_read != READ_SIZE)
-	  fprintf(stderr, "WARNING: received wrong number of samples (%d)\n", \
-		  n_read);
-	if ((n_read % 2) != 0) {
-	  fprintf(stderr, "WARNING: odd number of samples received!\n");
-	  n_read++; /* preserve real/imaginary alignment */
-	}
+      if ((line_rx_freq != cur_freq) || (d == 0)) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t_ns = clock_ns(CLOCK_MONOTONIC);
+
+	if (cycle_ok && (line_rx_freq != cur_freq))
+	  set_frequency(ctx->dev, line_rx_freq);
 
-	data_buf_idx += n_read;
-	data_buf_sig_len[in_queue_in_ptr] += n_read;
+	if (cycle_ok)
+	  reset_dongle(ctx->dev); /* flush any old signal away */
 
+	cur_freq = line_rx_freq;
+
+	if (line) {
+	  timing.tune += time_since(&t0);
+	  rt.retune += clock_ns(CLOCK_MONOTONIC) - t_ns;
+	}
       }
 
-      /* Use first part of recorded signal to monitor level */
+      fprintf(stderr, "  rec_thread: recording dwell %d, %d\n", d,
+	      in_queue_in_ptr);
 
-      int samps_to_check = data_buf_sig_len[in_queue_in_ptr] 
-                           > MAX_SIG_LEVEL_SAMPLES ? MAX_SIG_LEVEL_SAMPLES
-                           : data_buf_sig_len[in_queue_in_ptr];
+      /* Each read is queued as a chunk as soon as it is complete and
+	 integrated by the computational thread while the next one is
+	 captured. After a failure no more chunks are queued. Only the
+	 line's dwells are timed; the cycle model takes the extra
+	 targets as fixed overhead. */
 
-      for (n = 0; n < samps_to_check; n++) {
-	int32_t x = (int32_t)data_buf[in_queue_in_ptr * SIG_SIZE + n] - 127;
-        if (abs(x) > max_sig_level)
-	  max_sig_level = x;
-      }
-        
+      for(n = 0; (n < dw->reads) && cycle_ok; n++) {
 
-      r = pthread_mutex_lock(&in_queue_mutex);
-      if (r != 0) {
-	fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(r));
-	return NULL;
-      }
+	/* Check for space in queue, wait if full */
 
-      in_queue_len++;
-      in_queue_in_ptr = (in_queue_in_ptr + 1) % MAX_IN_QUEUE_LEN;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-      r = pthread_mutex_unlock(&in_queue_mutex);
-      if (r != 0) {
-	fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(r));
-	return NULL;
-      }
+	if (wait_queue(&in_queue_mutex, &in_queue_cond, &in_queue_len,
+		       sh->in_queue_len - 1) != 0)
+	  return NULL;
 
-      
-      r = pthread_cond_signal(&in_queue_cond);
-      if (r != 0) {
-	fprintf(stderr, "pthread_cond_signal: %s\n", strerror(r));
-	return NULL;
-      }
-      
+	timing.queue_wait += time_since(&t0);
 
-    }
+	if (rt.sig_start == 0) {
+	  rt.sig_start = clock_ns(CLOCK_REALTIME);
+	  t_sig0 = clock_ns(CLOCK_MONOTONIC) * 1.0E-9;
+	}
 
-    memset(spec_out_buf, 0, 2 * FFT_LEN * sizeof(float));
-    memset(spec_out_int, 0, 2 * sizeof(int));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t_ns = clock_ns(CLOCK_MONOTONIC);
+	if (capture(ctx, &data_buf[in_queue_in_ptr * sh->read_size],
+		    sh->read_size, &n_read) != 0) {
+	  cycle_ok = 0;
+	  cycle_barrier_leave(ctx->cycle_barrier, &ctx->barrier_member);
+	}
+	rt.sig_end = clock_ns(CLOCK_REALTIME);
+	t_sig1 = clock_ns(CLOCK_MONOTONIC) * 1.0E-9;
+
+	if (line) {
+	  timing.read += time_since(&t0);
+	  timing.bytes += n_read;
+
+	  rt.on_source[sb] += clock_ns(CLOCK_MONOTONIC) - t_ns;
+	  rt.samples[sb] += n_read / 2;
+	  rt.reads[sb]++;
+	  if (n_read < sh->read_size) {
+	    rt.short_reads[sb]++;
+	    rt.short_bytes[sb] += sh->read_size - n_read;
+	  }
+	}
 
-    /* Read signal spectra from queue and store them */
+	if ((n_read % 2) != 0) {
+	  fprintf(stderr, "WARNING: odd number of samples received!\n");
+	  n_read--; /* drop the unpaired sample */
+	}
 
-    for (int scount = 0; scount < 2 * NUM_SIG_SPEC; scount++) {
+	chunk_len[in_queue_in_ptr] = n_read;
+	if (line)
+	  chunk_flags[in_queue_in_ptr] = (sb ? CHUNK_LOWER : 0)
+	    | ((n == dw->reads - 1) ? CHUNK_END_BLOCK : 0);
+	else
+	  chunk_flags[in_queue_in_ptr] = (sb ? CHUNK_LOWER : 0)
+	    | CHUNK_TARGET(dw->target);
+
+	if (queue_chunk(&in_queue_mutex, &in_queue_cond, &in_queue_len,
+			&in_queue_in_ptr, sh->in_queue_len) != 0)
+	  return NULL;
 
-      r = pthread_mutex_lock(&out_queue_mutex);
-      if (r != 0) {
-	fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(r));
-	return NULL;
       }
 
-      while (out_queue_len == 0) {
-	fprintf(stderr, "  rec_thread: waiting for data\n");
-	r = pthread_cond_wait(&out_queue_cond, &out_queue_mutex);
-	if (r != 0) {
-	  fprintf(stderr, "pthread_cond_wait: %s\n", strerror(r));
+      /* Checkpoint between dwells now and then. The queue is drained
+	 first so that the accumulator is complete up to this dwell. */
+
+      if (cycle_ok && (cfg->ckpt_interval > 0) && (d < num_dwells - 1)
+	  && (clock_ns(CLOCK_MONOTONIC) - last_ckpt
+	      >= cfg->ckpt_interval * 1000000000LL)
+	  && ((ck = ckpt_begin(ctx->channel)) != NULL)) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (wait_queue(&in_queue_mutex, &in_queue_cond, &in_queue_len, 0)
+	    != 0)
 	  return NULL;
-	}
+	timing.queue_wait += time_since(&t0);
+
+	ck->time_stamp = time_stamp;
+	ck->next_dwell = d + 1;
+	ck->cal = cal;
+	ck->cal_taken = cal_taken;
+	ck->t_cal = t_cal;
+	ck->t_sig0 = t_sig0;
+	memcpy(ck->tuned_freq, tuned_freq, sizeof(ck->tuned_freq));
+	memcpy(ck->target_tuned, target_tuned, sizeof(ck->target_tuned));
+	ck->rt = rt;
+	ck->cb = cb;
+	ck->ftrack = ctx->ftrack;
+	memcpy(ck->cal_spec, cal_spec_buf, sizeof(ck->cal_spec));
+	memcpy(&ck->accum, accum, sizeof(ck->accum));
+	ckpt_commit(ctx->channel);
+
+	last_ckpt = clock_ns(CLOCK_MONOTONIC);
+	ckpt_saved = 1;
       }
 
-      out_queue_len--;
+    }
 
-      r = pthread_mutex_unlock(&out_queue_mutex);
-      if (r != 0) {
-	fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(r));
-	return NULL;
-      }
+    /* Wait for the computational thread to integrate the last chunks */
 
-      /* integrate spectra */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
-      int n = scount % 2;
-      spec_out_int[n] += sig_spec_int[out_queue_out_ptr];
-      for (int k = 0; k < FFT_LEN; k++) {
-	spec_out_buf[n * FFT_LEN + k] += \
-	  sig_spec_buf[FFT_LEN * out_queue_out_ptr + k];
-      }
+    if (wait_queue(&in_queue_mutex, &in_queue_cond, &in_queue_len, 0) != 0)
+      return NULL;
 
-      out_queue_out_ptr = (out_queue_out_ptr + 1) % (2 * NUM_SIG_SPEC);
+    timing.drain = time_since(&t0);
+    timing.compute = cctx.busy_time;
 
+    /* The record has the cal's measurement, or without one the
+       prediction for the middle of the signal capture */
 
+    if (cal && !cal_taken && accum->cal_done) {
+      freq_track_update(&ctx->ftrack, t_cal, accum->freq_err);
+      cal_taken = 1;
     }
 
-    /* normalise spectra */
+    if (cal_taken) {
+      freq_err = accum->freq_err;
+      freq_track_predict(&ctx->ftrack, t_cal, &ft_sigma);
+    } else
+      freq_err = freq_track_predict(&ctx->ftrack, 0.5 * (t_sig0 + t_sig1),
+				    &ft_sigma);
+
+    summarise_stats(&accum->stats, &level);
+    max_sig_level = level.peak;
+
+    blocks[0].tag = OZO_BLOCK_SIG_STATS;
+    blocks[0].len = sizeof(level);
+    blocks[0].data = &level;
+    num_blocks = 1;
+
+    if (cfg->sk_mode != SK_OFF) {
+      blocks[1].tag = OZO_BLOCK_SK;
+      blocks[1].len = sizeof(accum->sk);
+      blocks[1].data = &accum->sk;
+      num_blocks = 2;
+    }
+
+    memcpy(spec_out_int, accum->spec_int, sizeof(accum->spec_int));
+    memcpy(spec_out_buf, accum->spec, sizeof(accum->spec));
+
+    /* normalise spectra; excised bins have fewer frames */
     for (int k =0; k < 2; k++) {
       for (int n = 0; n < FFT_LEN; n++) {
-	spec_out_buf[k * FFT_LEN + n] /= 
-		((float)spec_out_int[k] * (float)FFT_LEN * (float)FFT_LEN);
+	int nint = spec_out_int[k];
+
+	if (cfg->sk_mode == SK_EXCISE)
+	  nint -= accum->sk.frames_flagged[k][n];
+
+	if (nint > 0)
+	  spec_out_buf[k * FFT_LEN + n] /= 
+	    ((float)nint * (float)FFT_LEN * (float)FFT_LEN);
+	else
+	  spec_out_buf[k * FFT_LEN + n] = 0;
       }
     }
 
 
+    /* Nothing left to resume. Marked before the record is written, so
+       that a crash in between loses the cycle rather than recording it
+       twice. */
+
+    if (ckpt_saved) {
+      ckpt_done(ctx->channel);
+      ckpt_saved = 0;
+    }
+
+    if (!cycle_ok) {
+      fprintf(stderr, "  rec_thread %d: dongle failed, discarding cycle\n",
+	      ctx->channel);
+      continue;
+    }
+
+    blocks[num_blocks].tag = OZO_BLOCK_TIMING;
+    blocks[num_blocks].len = sizeof(rt);
+    blocks[num_blocks].data = &rt;
+    num_blocks++;
+
+    ftb.calibrated = cal_taken;
+    ftb.num_meas = ctx->ftrack.num_meas;
+    ftb.sigma = ft_sigma;
+    ftb.rate = ctx->ftrack.rate;
+    blocks[num_blocks].tag = OZO_BLOCK_FREQ_TRACK;
+    blocks[num_blocks].len = sizeof(ftb);
+    blocks[num_blocks].data = &ftb;
+    num_blocks++;
+
+    if (cal) {
+      blocks[num_blocks].tag = OZO_BLOCK_CAL;
+      blocks[num_blocks].len = sizeof(cb);
+      blocks[num_blocks].data = &cb;
+      num_blocks++;
+    }
+
+    /* The line's position in each sideband spectrum; the frequency
+       error correction put it close to -/+ FFT_LEN / 4. tuned_freq is
+       that of the sideband's last dwell, which may have been tuned
+       with the predicted error; the record's is used here. */
+
+    for (int k = 0; k < 2; k++)
+      line_pos[k] = (cfg->line_freq + freq_err - (double)tuned_freq[k])
+	* FFT_LEN / SAMPLERATE;
+
+    /* Difference and fold the sidebands about the line */
+
+    if (cfg->fold_out) {
+      for (int k = 0; k < 2; k++)
+	fold.line_pos[k] = line_pos[k];
+
+      fold_spectra(spec_out_buf, line_pos, fold.fold, fold.ref);
+
+      blocks[num_blocks].tag = OZO_BLOCK_FOLD;
+      blocks[num_blocks].len = sizeof(fold);
+      blocks[num_blocks].data = &fold;
+      num_blocks++;
+    }
+
+    for (int k = 0; k < cctx.num_hires; k++) {
+      blocks[num_blocks].tag = OZO_BLOCK_HIRES;
+      blocks[num_blocks].len = hires_window(&accum->hires[k],
+					    cctx.hires_fft[k]->len,
+					    cfg->hires_bins, line_pos,
+					    &hires[k]);
+      blocks[num_blocks].data = &hires[k];
+      num_blocks++;
+    }
+
+    for (int k = 0; k < cfg->num_targets; k++) {
+      target_block(&cfg->targets[k], accum->target_spec[k],
+		   accum->target_int[k], target_tuned[k], &targets[k]);
+      blocks[num_blocks].tag = OZO_BLOCK_TARGET;
+      blocks[num_blocks].len = sizeof(targets[k]);
+      blocks[num_blocks].data = &targets[k];
+      num_blocks++;
+    }
+
     /*  writing to output file protected by mutex  */
 
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
     r = pthread_mutex_lock(ctx->outfile_mutex);
     if (r != 0) {
       fprintf(stderr, "pthread_mutex_lock(ctx->outfile_mutex): %s\n",
@@ -450,8 +1235,14 @@ void *rec_thread(void *ptarg)
       return NULL;
     }
 
-    write_file(ctx, time_stamp, freq_err, spec_out_int,
-	       cal_spec_buf, spec_out_buf, max_sig_level);
+    write_file(ctx, cfg, time_stamp, freq_err, spec_out_int,
+	       cal_spec_buf, spec_out_buf, max_sig_level, blocks, num_blocks);
+
+    if (!first_record_done) {
+      first_record_done = 1;
+      fprintf(stderr, "Startup: time to first record %.2f s (channel %d)\n",
+	      time_since(&startup_time), ctx->channel);
+    }
 
     r = pthread_mutex_unlock(ctx->outfile_mutex);
     if (r != 0) {
@@ -460,15 +1251,51 @@ void *rec_thread(void *ptarg)
       return NULL;
     }
 
-    fprintf(stderr, "  rec_thread %d: max signal level = %d\n",
-            ctx->channel, max_sig_level); 
+    timing.write = time_since(&t0);
+
+    live_publish(ctx->channel, time_stamp, freq_err, tuned_freq, spec_out_int,
+		 &level, cal_spec_buf, spec_out_buf);
+
+    fprintf(stderr, "  rec_thread %d: max signal level = %d, clipped %u/%u, "
+	    "DC %.4f/%.4f, power %.4f\n", ctx->channel, max_sig_level,
+	    level.clip_low, level.clip_high, level.dc_i, level.dc_q,
+	    level.power);
+
+    if (rt.short_reads[0] + rt.short_reads[1] > 0)
+      fprintf(stderr, "  rec_thread %d: %u short reads, %llu bytes missing\n",
+	      ctx->channel, rt.short_reads[0] + rt.short_reads[1],
+	      (unsigned long long)(rt.short_bytes[0] + rt.short_bytes[1]));
+
+    if (accum->sk.blocks_flagged[0] + accum->sk.blocks_flagged[1] > 0)
+      fprintf(stderr, "  rec_thread %d: RFI in %u/%u signal blocks\n",
+	      ctx->channel,
+	      accum->sk.blocks_flagged[0] + accum->sk.blocks_flagged[1],
+	      accum->sk.blocks[0] + accum->sk.blocks[1]);
+
+    /* Report this cycle's timing; the main thread reads it once the
+       cycle is complete */
+
+    timing.total = time_since(&cycle_start);
+    timing.valid = 1;
+    ctx->timing = timing;
+
+    /* Ask for a cal next cycle if the prediction would not last until
+       its end */
+
+    __atomic_store_n(&ctx->cal_wanted,
+		     !freq_track_ok(&ctx->ftrack, clock_ns(CLOCK_MONOTONIC)
+				    * 1.0E-9 + timing.total,
+				    cfg->cal_max_sigma), __ATOMIC_RELEASE);
 
-    r = pthread_barrier_wait(ctx->sig_rec_done_barrier);
+    heartbeat(ctx);
+    cycle_barrier_wait(ctx->cycle_barrier, PHASE_SIG_REC_DONE,
+		       &ctx->barrier_member);
 
   }
 
   
-  rtlsdr_close(ctx->dev);
+  free(sched);
+  close_dongle(ctx->dev);
 
   return NULL;
 }
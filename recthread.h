@@ -7,24 +7,67 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
 #include "rtl-sdr.h"
 #include "common.h"
+#include "cyclebarrier.h"
+#include "config.h"
+#include "autotune.h"
+#include "signalproc.h"
+#include "fftbackend.h"
+#include "compthread.h"
+#include "freqtrack.h"
+#include "calcontrol.h"
+#include "checkpoint.h"
+#include <stddef.h>
+
+/* Per-channel buffers, carved out of a single arena */
+
+struct rec_buffers {
+  void *arena;
+  size_t arena_size;
+  uint8_t *data_buf; /* ring of chunks, cal and signal */
+  int *chunk_len;
+  int *chunk_flags;
+  float *cal_spec_buf;
+  struct cycle_accum *accum; /* integrated by the computational thread */
+  fft_complex *cfftin, *cfftout; /* computational thread FFT buffers */
+};
 
 
 struct rec_thread_context {
   float *fft_win; /* FFT window coefficients */
+  struct cycle_shape shape; /* shape the buffers were allocated for */
+  struct rec_buffers bufs;
+  struct cycle_timing timing; /* timing of the last completed cycle */
   rtlsdr_dev_t *dev; /* librtlsdr device for dongle to use */
   int32_t channel; /* channel number */
   char dongle_sn[MAX_SN_LEN]; /* dongle serial number */
   uint64_t *time_stamp;
-  pthread_barrier_t *cal_on_barrier;
-  pthread_barrier_t *cal_rec_done_barrier;
-  pthread_barrier_t *cal_off_barrier;
-  pthread_barrier_t *sig_rec_done_barrier;
+  int *cal_cycle; /* set by the main thread if this cycle has a cal */
+  const struct cal_event *cal_on, *cal_off; /* the main thread's switches */
+  struct freq_track ftrack; /* frequency error, for cycles without one */
+  int cal_wanted; /* the track needs a cal next cycle */
+  struct ckpt_state *resume; /* checkpointed cycle to carry on, or NULL */
+  struct cycle_barrier *cycle_barrier;
+  int barrier_member; /* taking part in the cycle (see cycle_barrier) */
   pthread_mutex_t *outfile_mutex;
+  unsigned int cfg_generation; /* configuration snapshot in use */
+
+  /* Supervision: the recorder thread updates its heartbeat around every
+   * dongle read. The main thread aborts a read that makes no progress,
+   * removes the channel from the cycle and the dongle is then reopened.
+   * dev_mutex protects dev while it is being replaced.
+   */
+  pthread_mutex_t dev_mutex;
+  time_t heartbeat; /* CLOCK_MONOTONIC seconds */
+  int in_read;
+  int stalled;
 };
 
 
+int rec_thread_alloc(struct rec_thread_context *ctx);
+void rec_thread_free(struct rec_thread_context *ctx);
 void *rec_thread(void *ptarg);
 
 #endif /* _RECTHREAD_H */
@@ -90,7 +90,9 @@ if __name__ == '__main__':
         rsync.append('--dry-run')
 
 
-    rsync.append(spec['DATADIR'] + '/*' + spec['VSRTNUM'] + '.ozo')  
+    # Day files may have been compressed by ozonespec (COMPRESSAFTER);
+    # their .ozq summary sidecars are sent too
+    rsync.append(spec['DATADIR'] + '/*' + spec['VSRTNUM'] + '.oz[oq]*')  
     rsync.append(clock_filename)
 
     # Define remote location for transfer
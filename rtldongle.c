@@ -4,14 +4,174 @@
 
 #include "rtldongle.h"
 #include "common.h"
+#include "timeutil.h"
+#include "calcontrol.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 int dongle_debug = 1;
 
+/* Dongles may be opened from several threads at once. Looking up the
+   index by serial number opens every device in turn, so do that one
+   at a time. */
+
+static pthread_mutex_t lookup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SYNTH_TONE_FREQ 1320000000 /* the calibrator, while it is on */
+#define SYNTH_TONE_AMP 20.0 /* counts */
+#define SYNTH_PIECE 65536 /* bytes generated between pacing checks */
+
+/* Synthetic dongles stand in for rtlsdr_dev_t handles, which are only
+   ever passed back to these functions. They are told apart by being
+   on this list. */
+
+struct synth_dev {
+  uint32_t freq;
+  uint32_t rng; /* xorshift state */
+  double phase; /* of the tone, cycles */
+  volatile int cancel;
+  struct synth_dev *next;
+};
+
+static struct synth_dev *synth_devs = NULL;
+static pthread_mutex_t synth_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct synth_dev *synth_of(rtlsdr_dev_t *dev)
+{
+  struct synth_dev *s;
+
+  pthread_mutex_lock(&synth_mutex);
+  for (s = synth_devs; (s != NULL) && ((void *)s != (void *)dev); s = s->next)
+    ;
+  pthread_mutex_unlock(&synth_mutex);
+
+  return s;
+}
+
+static rtlsdr_dev_t *synth_open(const char *sernum)
+{
+  struct synth_dev *s = calloc(1, sizeof(*s));
+
+  if (s == NULL)
+    return NULL;
+
+  s->rng = 2463534242u;
+  for (const char *p = sernum; *p != '\0'; p++)
+    s->rng = s->rng * 31 + (uint8_t)*p;
+
+  pthread_mutex_lock(&synth_mutex);
+  s->next = synth_devs;
+  synth_devs = s;
+  pthread_mutex_unlock(&synth_mutex);
+
+  if (dongle_debug)
+    fprintf(stderr, "Using synthetic device %s\n", sernum);
+
+  return (rtlsdr_dev_t *)s;
+}
+
+static void synth_close(struct synth_dev *s)
+{
+  struct synth_dev **pp;
+
+  pthread_mutex_lock(&synth_mutex);
+  for (pp = &synth_devs; *pp != s; pp = &(*pp)->next)
+    ;
+  *pp = s->next;
+  pthread_mutex_unlock(&synth_mutex);
+
+  free(s);
+}
+
+/* Noise of about 12 counts RMS (triangular, from two random bytes per
+   component) plus the calibrator tone if it is on and in the band,
+   paced to SAMPLERATE */
+
+static int synth_read(struct synth_dev *s, uint8_t *buf, int len, int *n_read)
+{
+  double df = ((double)SYNTH_TONE_FREQ - s->freq) / SAMPLERATE;
+  int in_band = fabs(df) < 0.5;
+  struct timespec start;
+  int pos = 0;
+
+  s->cancel = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while ((pos < len) && !s->cancel) {
+    int n = len - pos < SYNTH_PIECE ? len - pos : SYNTH_PIECE;
+    double c = cos(2 * M_PI * s->phase), d = sin(2 * M_PI * s->phase);
+    double cr = cos(2 * M_PI * df), ci = sin(2 * M_PI * df);
+    int tone = in_band && cal_state();
+    double t;
+
+    for (int k = 0; k + 1 < n; k += 2) {
+      uint32_t x = s->rng;
+      int ni, nq;
+
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      s->rng = x;
+
+      ni = (int)(x & 0xff) + ((x >> 8) & 0xff) - 255;
+      nq = (int)((x >> 16) & 0xff) + (x >> 24) - 255;
+      ni = 127 + ni / 9;
+      nq = 127 + nq / 9;
+
+      if (tone) {
+	ni += (int)(SYNTH_TONE_AMP * c);
+	nq += (int)(SYNTH_TONE_AMP * d);
+	t = c * cr - d * ci;
+	d = c * ci + d * cr;
+	c = t;
+      }
+
+      buf[pos + k] = ni;
+      buf[pos + k + 1] = nq;
+    }
+
+    if (tone) {
+      s->phase += df * (n / 2);
+      s->phase -= floor(s->phase);
+    }
+
+    pos += n;
+
+    /* Deliver no faster than a real dongle */
+
+    t = pos / (2.0 * SAMPLERATE) - time_since(&start);
+    if (t > 0) {
+      struct timespec ts = { (time_t)t, (long)((t - floor(t)) * 1.0E9) };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  *n_read = pos;
+
+  return pos == len ? 0 : -1;
+}
+
+struct read_state {
+  rtlsdr_dev_t *dev;
+  uint8_t *buf;
+  int len;
+  int pos;
+};
+
 int set_frequency(rtlsdr_dev_t *dev, uint32_t freq)
 {
   int r;
   uint32_t actual_freq;
+  struct synth_dev *s = synth_of(dev);
+
+  if (s != NULL) {
+    s->freq = freq;
+    return 0;
+  }
 
   r = rtlsdr_set_center_freq(dev, freq);
   if (r < 0)
@@ -38,12 +198,19 @@ rtlsdr_dev_t *init_dongle(char *sernum)
 
     rtlsdr_dev_t *dev = NULL;
 
+    if (strncmp(sernum, SYNTH_PREFIX, strlen(SYNTH_PREFIX)) == 0)
+      return synth_open(sernum);
+
+    pthread_mutex_lock(&lookup_mutex);
+
     dev_index = rtlsdr_get_index_by_serial(sernum);
 
     if (dongle_debug)
       fprintf(stderr, "Using device %d: %s\n", dev_index, \
 	      rtlsdr_get_device_name(dev_index));
 
+    pthread_mutex_unlock(&lookup_mutex);
+
     r = rtlsdr_open(&dev, dev_index);
     if (r < 0) {
         fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
@@ -86,3 +253,85 @@ rtlsdr_dev_t *init_dongle(char *sernum)
     return dev;
 }
 
+static void read_callback(unsigned char *buf, uint32_t len, void *ptarg)
+{
+  struct read_state *rs = (struct read_state *)ptarg;
+  int n;
+
+  /* extra transfers may complete after cancellation has been requested */
+  if (rs->pos >= rs->len)
+    return;
+
+  n = rs->len - rs->pos;
+  if ((int)len < n)
+    n = len;
+
+  memcpy(rs->buf + rs->pos, buf, n);
+  rs->pos += n;
+
+  if (rs->pos >= rs->len)
+    rtlsdr_cancel_async(rs->dev);
+}
+
+/* Read a block of samples.
+ * This does the same job as rtlsdr_read_sync(), which blocks forever if
+ * the dongle stops delivering data. Using the asynchronous interface
+ * allows another thread to break a stuck read with abort_read().
+ * Returns 0 if the full block was read, negative otherwise.
+ */
+
+int read_dongle(rtlsdr_dev_t *dev, uint8_t *buf, int len, int *n_read)
+{
+  struct read_state rs;
+  struct synth_dev *s = synth_of(dev);
+  int r;
+
+  if (s != NULL)
+    return synth_read(s, buf, len, n_read);
+
+  rs.dev = dev;
+  rs.buf = buf;
+  rs.len = len;
+  rs.pos = 0;
+
+  r = rtlsdr_read_async(dev, read_callback, &rs, 0, 0);
+
+  *n_read = rs.pos;
+
+  if (r < 0)
+    return r;
+
+  return rs.pos == len ? 0 : -1;
+}
+
+/* Make a read_dongle() in progress on another thread return early */
+
+void abort_read(rtlsdr_dev_t *dev)
+{
+  struct synth_dev *s = synth_of(dev);
+
+  if (s != NULL)
+    s->cancel = 1;
+  else
+    rtlsdr_cancel_async(dev);
+}
+
+/* Drop samples buffered in the dongle */
+
+int reset_dongle(rtlsdr_dev_t *dev)
+{
+  if (synth_of(dev) != NULL)
+    return 0;
+
+  return rtlsdr_reset_buffer(dev);
+}
+
+void close_dongle(rtlsdr_dev_t *dev)
+{
+  struct synth_dev *s = synth_of(dev);
+
+  if (s != NULL)
+    synth_close(s);
+  else
+    rtlsdr_close(dev);
+}
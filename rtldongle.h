@@ -8,8 +8,17 @@
 #include "rtl-sdr.h"
 #include <stdint.h>
 
+/* A serial number starting with this gives a synthetic dongle: noise
+   and the calibrator tone, delivered in real time. For load tests. */
+
+#define SYNTH_PREFIX "SYNTH"
+
 int set_frequency(rtlsdr_dev_t *dev, uint32_t freq);
 rtlsdr_dev_t *init_dongle(char *sernum);
+int read_dongle(rtlsdr_dev_t *dev, uint8_t *buf, int len, int *n_read);
+void abort_read(rtlsdr_dev_t *dev);
+int reset_dongle(rtlsdr_dev_t *dev);
+void close_dongle(rtlsdr_dev_t *dev);
 
 #endif /* _RTLDONGLE_H */
 
@@ -0,0 +1,204 @@
+/*
+ * Observing schedule
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "schedule.h"
+#include "common.h"
+
+/* Dwells per sideband needed to reach a target's integration */
+
+static int dwells_per_sideband(const struct target *t)
+{
+  return (t->reads + t->dwell_reads - 1) / t->dwell_reads;
+}
+
+static int num_sidebands(const struct target *t)
+{
+  return t->role == ROLE_SWITCHED ? 2 : 1;
+}
+
+/* An upper sideband dwell is tuned above the target, a lower one
+   below, each by a quarter of the sample rate */
+
+static double sideband_offset(int sideband)
+{
+  return sideband ? -(double)(SAMPLERATE / 4) : (double)(SAMPLERATE / 4);
+}
+
+/* Upper bound on the number of dwells in a cycle */
+
+int schedule_max_dwells(const struct ozone_config *cfg)
+{
+  int n = 2 * cfg->shape.num_sig_spec;
+
+  for (int t = 0; t < cfg->num_targets; t++)
+    n += num_sidebands(&cfg->targets[t])
+      * dwells_per_sideband(&cfg->targets[t]);
+
+  return n;
+}
+
+double dwell_freq(const struct ozone_config *cfg, const struct dwell *d)
+{
+  if (d->target == DWELL_LINE)
+    return cfg->line_freq + d->offset;
+  return cfg->targets[d->target].freq + d->offset;
+}
+
+/* Frequencies given in MHz need not come out exact */
+
+static int same_tuning(double f1, double f2)
+{
+  return fabs(f1 - f2) < 1.0;
+}
+
+/* The next dwell on the extra targets, taking them in turn. pos[t]
+   counts the dwells made on target t so far. Returns 0 once all are
+   done. */
+
+static int next_target_dwell(const struct ozone_config *cfg, int pos[],
+			     int *turn, struct dwell *d)
+{
+  for (int k = 0; k < cfg->num_targets; k++) {
+    int t = (*turn + k) % cfg->num_targets;
+    const struct target *tg = &cfg->targets[t];
+    int nsb = num_sidebands(tg);
+    int done, left;
+
+    if (pos[t] == nsb * dwells_per_sideband(tg))
+      continue;
+
+    /* a switched target alternates sidebands like the line */
+
+    d->target = t;
+    d->sideband = tg->role == ROLE_LOWER ? 1
+      : (tg->role == ROLE_SWITCHED ? pos[t] % 2 : 0);
+    d->offset = tg->role == ROLE_CENTRE ? 0 : sideband_offset(d->sideband);
+    done = (pos[t] / nsb) * tg->dwell_reads;
+    left = tg->reads - done;
+    d->reads = left < tg->dwell_reads ? left : tg->dwell_reads;
+
+    pos[t]++;
+    *turn = (t + 1) % cfg->num_targets;
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Build a cycle's schedule into dwells, which must have room for
+ * schedule_max_dwells(). Target dwell i of total is placed after line
+ * dwell ceil((i + 1) * line_dwells / total) - 1, which spreads them
+ * evenly through the cycle, but a target dwell tuned as one of the
+ * line's sidebands is moved next to a dwell of that sideband. Within
+ * each slot the dwells are taken nearest tuning first and neighbours
+ * on the same target and sideband merged, so that alike tunings share
+ * one retune. Returns the number of dwells, or -1 if out of memory.
+ */
+
+int schedule_build(const struct ozone_config *cfg, struct dwell *dwells)
+{
+  int line_dwells = 2 * cfg->shape.num_sig_spec;
+  int total = schedule_max_dwells(cfg) - line_dwells;
+  int pos[MAX_TARGETS] = { 0 };
+  int turn = 0, n = 0;
+  struct dwell *td;
+  int *slot;
+
+  td = malloc(total * sizeof(*td) + 1);
+  slot = malloc(total * sizeof(*slot) + 1);
+  if ((td == NULL) || (slot == NULL)) {
+    free(td);
+    free(slot);
+    return -1;
+  }
+
+  for (int i = 0; i < total; i++) {
+    next_target_dwell(cfg, pos, &turn, &td[i]);
+    slot[i] = (int)(((long)(i + 1) * line_dwells + total - 1) / total) - 1;
+
+    for (int sb = 0; sb < 2; sb++)
+      if (same_tuning(dwell_freq(cfg, &td[i]),
+		      cfg->line_freq + sideband_offset(sb))
+	  && (slot[i] % 2 != sb))
+	slot[i] += slot[i] > 0 ? -1 : 1;
+  }
+
+  for (int j = 0; j < line_dwells; j++) {
+    int first;
+
+    dwells[n].target = DWELL_LINE;
+    dwells[n].sideband = j % 2;
+    dwells[n].offset = sideband_offset(j % 2);
+    dwells[n].reads = cfg->shape.num_blocks;
+    n++;
+
+    /* the slot's dwells, each nearest in tuning to the one before */
+
+    first = n;
+    for (;;) {
+      double prev = dwell_freq(cfg, &dwells[n - 1]), best_d = 0;
+      int best = -1;
+
+      for (int i = 0; i < total; i++) {
+	double d = fabs(dwell_freq(cfg, &td[i]) - prev);
+
+	if ((slot[i] == j) && ((best < 0) || (d < best_d))) {
+	  best = i;
+	  best_d = d;
+	}
+      }
+      if (best < 0)
+	break;
+
+      dwells[n++] = td[best];
+      slot[best] = -1;
+    }
+
+    /* merge neighbouring dwells on the same target and sideband */
+
+    for (int k = first + 1; k < n; ) {
+      if ((dwells[k].target == dwells[k - 1].target)
+	  && (dwells[k].sideband == dwells[k - 1].sideband)) {
+	dwells[k - 1].reads += dwells[k].reads;
+	for (int m = k + 1; m < n; m++)
+	  dwells[m - 1] = dwells[m];
+	n--;
+      } else
+	k++;
+    }
+  }
+
+  free(td);
+  free(slot);
+
+  /* The first dwell always retunes from the cal */
+
+  for (int k = 0; k < n; k++)
+    dwells[k].retune = (k == 0)
+      || !same_tuning(dwell_freq(cfg, &dwells[k]),
+		      dwell_freq(cfg, &dwells[k - 1]));
+
+  return n;
+}
+
+void schedule_print(const struct ozone_config *cfg,
+		    const struct dwell *dwells, int num_dwells)
+{
+  int retunes = 0;
+
+  for (int k = 0; k < num_dwells; k++)
+    retunes += dwells[k].retune;
+
+  fprintf(stderr, "Schedule: %d dwells, %d retunes:", num_dwells, retunes);
+  for (int k = 0; k < num_dwells; k++)
+    fprintf(stderr, " %s%s%s/%d", dwells[k].retune ? "" : "=",
+	    dwells[k].target == DWELL_LINE ? "line"
+	    : cfg->targets[dwells[k].target].name,
+	    dwells[k].offset == 0 ? "" : (dwells[k].sideband ? "-" : "+"),
+	    dwells[k].reads);
+  fprintf(stderr, "\n");
+}
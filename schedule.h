@@ -0,0 +1,32 @@
+/*
+ * Observing schedule
+ *
+ * A cycle is the cal followed by a list of dwells. The line's dwells
+ * alternate between the upper and lower sideband as always; the dwells
+ * on any extra targets (TARGET) are spread evenly among them, so that
+ * every target samples the whole cycle. Adjacent dwells that would be
+ * tuned to the same frequency are run back to back without a retune.
+ */
+
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+#include "config.h"
+
+#define DWELL_LINE (-1) /* target of the line's dwells */
+
+struct dwell {
+  int target; /* index into cfg->targets, or DWELL_LINE */
+  int sideband; /* 0 upper, 1 lower: which spectrum it is integrated in */
+  double offset; /* tuned minus target frequency, before correction */
+  int reads;
+  int retune; /* 0 if tuned as the previous dwell */
+};
+
+int schedule_max_dwells(const struct ozone_config *cfg);
+int schedule_build(const struct ozone_config *cfg, struct dwell *dwells);
+double dwell_freq(const struct ozone_config *cfg, const struct dwell *d);
+void schedule_print(const struct ozone_config *cfg,
+		    const struct dwell *dwells, int num_dwells);
+
+#endif /* _SCHEDULE_H */
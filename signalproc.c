@@ -6,13 +6,21 @@
 #include "common.h"
 #include <math.h>
 #include <string.h>
+#include <stdio.h>
 
 float convtab[256];
 
+/* Calculate the power spectrum of a block of signal, and optionally
+ * the per-bin sum of squared powers (for spectral kurtosis) and
+ * histograms of its sample values. Each frame is histogrammed straight
+ * after conversion, while it is still in cache, keeping the conversion
+ * loop itself free to vectorise.
+ */
+
 void calc_spectrum(uint8_t *signal, int sig_len, float *spec_buf,
-		   int *num_spec, float *win,
-		   fftwf_plan fplan, fftwf_complex *fftin,
-		   fftwf_complex *fftout)
+		   float *spec_sq_buf, int *num_spec, const float *win,
+		   const struct fft_backend *fft, fft_complex *fftin,
+		   fft_complex *fftout, struct sig_stats *stats)
 {
   int nspec, n, k, idx;
 
@@ -22,6 +30,12 @@ void calc_spectrum(uint8_t *signal, int sig_len, float *spec_buf,
 
   memset(spec_buf, 0, FFT_LEN * sizeof(float));
 
+  if (spec_sq_buf != NULL)
+    memset(spec_sq_buf, 0, FFT_LEN * sizeof(float));
+
+  if (stats != NULL)
+    memset(stats, 0, sizeof(struct sig_stats));
+
   for (n = 0; n < nspec; n++) {
 
     /* Copy signal into FFT buffer, converting format */
@@ -36,12 +50,29 @@ void calc_spectrum(uint8_t *signal, int sig_len, float *spec_buf,
       }
     }
 
-    fftwf_execute(fplan);
+    if (stats != NULL) {
+      const uint8_t *frame = &signal[2 * FFT_LEN * n];
+      for (k = 0; k < FFT_LEN; k++) {
+	stats->hist_i[frame[2 * k]]++;
+	stats->hist_q[frame[2 * k + 1]]++;
+      }
+    }
+
+    fft_execute(fft, fftin, fftout);
 
     /* Accumulate power spectrum */
 
-    for (k = 0; k < FFT_LEN; k++)
-      spec_buf[k] += fftout[k][0] * fftout[k][0] + fftout[k][1] * fftout[k][1];
+    if (spec_sq_buf == NULL) {
+      for (k = 0; k < FFT_LEN; k++)
+	spec_buf[k] += fftout[k][0] * fftout[k][0]
+	  + fftout[k][1] * fftout[k][1];
+    } else {
+      for (k = 0; k < FFT_LEN; k++) {
+	float p = fftout[k][0] * fftout[k][0] + fftout[k][1] * fftout[k][1];
+	spec_buf[k] += p;
+	spec_sq_buf[k] += p * p;
+      }
+    }
 
   }
 
@@ -50,27 +81,181 @@ void calc_spectrum(uint8_t *signal, int sig_len, float *spec_buf,
 
 }
 
+/* Add the power of an FFT output to spec (and its square to spec_sq) */
+
+static void add_power(const fft_complex *out, int len, float *spec,
+		      float *spec_sq)
+{
+  int k;
+
+  if (spec_sq == NULL) {
+    for (k = 0; k < len; k++)
+      spec[k] += out[k][0] * out[k][0] + out[k][1] * out[k][1];
+  } else {
+    for (k = 0; k < len; k++) {
+      float p = out[k][0] * out[k][0] + out[k][1] * out[k][1];
+      spec[k] += p;
+      spec_sq[k] += p * p;
+    }
+  }
+}
+
+/* Unwindowed spectra of a block of signal at FFT_LEN and at several
+ * higher resolutions, in one pass over the samples. The signal is
+ * converted a tile (one frame of the longest FFT) at a time into
+ * tile, which must hold that many points, and every FFT reads its
+ * frames straight from there. A last, partial tile gives whatever
+ * whole frames of each length fit in it. spec_buf, spec_sq_buf,
+ * num_spec and stats are as for calc_spectrum(); the higher
+ * resolutions are added to their spec buffers.
+ */
 
-fftwf_plan init_fft(fftwf_complex **inbuf, fftwf_complex **outbuf)
+void calc_spectra(uint8_t *signal, int sig_len, float *spec_buf,
+		  float *spec_sq_buf, int *num_spec,
+		  const struct fft_backend *fft, fft_complex *tile,
+		  fft_complex *fftout, struct sig_stats *stats,
+		  struct spec_res *res, int num_res)
 {
-  fftwf_plan fplan;
-  
-  *inbuf = fftwf_alloc_complex(FFT_LEN);
-  if(*inbuf == NULL) {
-    fprintf(stderr, "Failed to allocate FFT input buffer\n");
-    return NULL;
+  int tile_len = FFT_LEN, nsamp = sig_len / 2, nspec = 0, n, k, r;
+
+  for (r = 0; r < num_res; r++)
+    if (res[r].fft->len > tile_len)
+      tile_len = res[r].fft->len;
+
+  memset(spec_buf, 0, FFT_LEN * sizeof(float));
+
+  if (spec_sq_buf != NULL)
+    memset(spec_sq_buf, 0, FFT_LEN * sizeof(float));
+
+  if (stats != NULL)
+    memset(stats, 0, sizeof(struct sig_stats));
+
+  for (n = 0; n + FFT_LEN <= nsamp; n += tile_len) {
+    const uint8_t *s = &signal[2 * n];
+    int len = nsamp - n;
+
+    if (len > tile_len)
+      len = tile_len;
+    len -= len % FFT_LEN;
+
+    /* Convert once for every resolution */
+
+    for (k = 0; k < len; k++) {
+      tile[k][0] = convtab[s[2 * k]];
+      tile[k][1] = convtab[s[2 * k + 1]];
+    }
+
+    if (stats != NULL)
+      for (k = 0; k < len; k++) {
+	stats->hist_i[s[2 * k]]++;
+	stats->hist_q[s[2 * k + 1]]++;
+      }
+
+    for (k = 0; k < len; k += FFT_LEN) {
+      fft_execute(fft, &tile[k], fftout);
+      add_power(fftout, FFT_LEN, spec_buf, spec_sq_buf);
+      nspec++;
+    }
+
+    for (r = 0; r < num_res; r++) {
+      int rlen = res[r].fft->len;
+
+      for (k = 0; k + rlen <= len; k += rlen) {
+	fft_execute(res[r].fft, &tile[k], fftout);
+	add_power(fftout, rlen, res[r].spec, NULL);
+	res[r].num_spec++;
+      }
+    }
   }
 
-  *outbuf = fftwf_alloc_complex(FFT_LEN);
-  if(*outbuf == NULL) {
-   fprintf(stderr, "Failed to allocate FFT output buffer\n");
-   return NULL;
+  if (num_spec != NULL)
+    *num_spec = nspec;
+}
+
+
+/* Flag RFI with the spectral kurtosis estimator (Nita & Gary 2010)
+ * for num_spec frames, whose power sums are in spec and sums of
+ * squared power in spec_sq:
+ *
+ *   SK = (M + 1) / (M - 1) * (M * S2 / S1^2 - 1)
+ *
+ * SK is 1 for Gaussian noise, below 1 for continuous-wave signals and
+ * above 1 for impulsive interference. A bin is flagged if SK is more
+ * than sigma standard deviations from 1. Returns the number of bins
+ * flagged; flags[k] is set to 1 for flagged bins.
+ */
+
+int sk_flag(const float *spec, const float *spec_sq, int num_spec,
+	    float sigma, uint8_t *flags)
+{
+  double m = num_spec, sd, lo, hi;
+  int k, nflag = 0;
+
+  memset(flags, 0, FFT_LEN);
+
+  if (num_spec < 2)
+    return 0;
+
+  /* Variance of SK for Gaussian noise */
+
+  sd = sqrt(4.0 * m * m / ((m - 1) * (m + 2) * (m + 3)));
+  lo = 1.0 - sigma * sd;
+  hi = 1.0 + sigma * sd;
+
+  for (k = 0; k < FFT_LEN; k++) {
+    double s1 = spec[k], sk;
+
+    if (s1 <= 0)
+      continue;
+
+    sk = (m + 1) / (m - 1) * (m * spec_sq[k] / (s1 * s1) - 1);
+    if ((sk < lo) || (sk > hi)) {
+      flags[k] = 1;
+      nflag++;
+    }
   }
 
-  fplan = fftwf_plan_dft_1d(FFT_LEN, *inbuf, *outbuf, FFTW_FORWARD, \
-			    FFTW_MEASURE);
+  return nflag;
+}
+
+/* Power at a fractional bin position, interpolating linearly between
+   bins. Positions are frequencies in bins, wrapping like the FFT. */
+
+static double spec_at(const float *spec, double pos)
+{
+  double f = floor(pos);
+  int k = ((int)f % FFT_LEN + FFT_LEN) % FFT_LEN;
 
-  return fplan;
+  return spec[k] + (pos - f) * (spec[(k + 1) % FFT_LEN] - spec[k]);
+}
+
+/* Frequency-switched difference and fold. spec holds the two
+ * normalised sideband spectra, with the line at bin position
+ * line_pos[0] in the first and line_pos[1] in the second. Each
+ * sideband's spectrum at the other's line position is its reference,
+ * so
+ *
+ *   fold = ((s0 - s1) at line_pos[0] + (s1 - s0) at line_pos[1]) / 2
+ *   ref = (s1 at line_pos[0] + s0 at line_pos[1]) / 2
+ *
+ * giving FFT_LEN / 2 bins centred on the line: bin j is j - FFT_LEN / 4
+ * bins from line_freq.
+ */
+
+void fold_spectra(const float *spec, const double line_pos[2],
+		  float *fold, float *ref)
+{
+  const float *s0 = spec, *s1 = &spec[FFT_LEN];
+  int j;
+
+  for (j = 0; j < FFT_LEN / 2; j++) {
+    double d = j - FFT_LEN / 4;
+    double p0 = line_pos[0] + d, p1 = line_pos[1] + d;
+
+    fold[j] = 0.5 * (spec_at(s0, p0) - spec_at(s1, p0)
+		     + spec_at(s1, p1) - spec_at(s0, p1));
+    ref[j] = 0.5 * (spec_at(s1, p0) + spec_at(s0, p1));
+  }
 }
 
 void init_convtab(void)
@@ -5,15 +5,41 @@
 #ifndef _SIGNALPROC_H
 #define _SIGNALPROC_H
 
-#include <fftw3.h>
 #include <stdint.h>
+#include "fftbackend.h"
+
+/* Histograms of the raw 8-bit I and Q values of a block, from which
+   level statistics are derived */
+
+struct sig_stats {
+  uint32_t hist_i[256];
+  uint32_t hist_q[256];
+};
+
+/* A higher resolution computed alongside the FFT_LEN spectrum */
+
+struct spec_res {
+  const struct fft_backend *fft; /* of fft->len points */
+  float *spec; /* power, added to */
+  int num_spec; /* frames added */
+};
 
 void calc_spectrum(uint8_t *signal, int sig_len, float *spec_buf,
-		   int *num_spec, float *win,
-		   fftwf_plan fplan, fftwf_complex *fftin,
-		   fftwf_complex *fftout);
+		   float *spec_sq_buf, int *num_spec, const float *win,
+		   const struct fft_backend *fft, fft_complex *fftin,
+		   fft_complex *fftout, struct sig_stats *stats);
+
+void calc_spectra(uint8_t *signal, int sig_len, float *spec_buf,
+		  float *spec_sq_buf, int *num_spec,
+		  const struct fft_backend *fft, fft_complex *tile,
+		  fft_complex *fftout, struct sig_stats *stats,
+		  struct spec_res *res, int num_res);
+
+int sk_flag(const float *spec, const float *spec_sq, int num_spec,
+	    float sigma, uint8_t *flags);
 
-fftwf_plan init_fft(fftwf_complex **inbuf, fftwf_complex **outbuf);
+void fold_spectra(const float *spec, const double line_pos[2],
+		  float *fold, float *ref);
 
 void init_convtab(void);
 
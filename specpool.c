@@ -0,0 +1,251 @@
+/*
+ * Spectrum worker pools
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "specpool.h"
+
+/* Compute a part of the job into its partial sums */
+
+static void run_part(struct spec_pool *pool, struct spec_part *p,
+		     fft_complex *tile, fft_complex *out)
+{
+  struct spec_res res[MAX_HIRES];
+
+  for (int r = 0; r < pool->num_res; r++) {
+    res[r].fft = pool->res_fft[r];
+    res[r].spec = p->hires[r];
+    res[r].num_spec = 0;
+    memset(p->hires[r], 0, res[r].fft->len * sizeof(float));
+  }
+
+  if (pool->win != NULL)
+    calc_spectrum(&pool->signal[2 * p->start], 2 * p->len, p->spec,
+		  pool->want_sq ? p->sq : NULL, &p->num_spec, pool->win,
+		  pool->fft, tile, out, pool->want_stats ? &p->stats : NULL);
+  else
+    calc_spectra(&pool->signal[2 * p->start], 2 * p->len, p->spec,
+		 pool->want_sq ? p->sq : NULL, &p->num_spec, pool->fft, tile,
+		 out, pool->want_stats ? &p->stats : NULL, res, pool->num_res);
+
+  for (int r = 0; r < pool->num_res; r++)
+    p->hires_num_spec[r] = res[r].num_spec;
+}
+
+static void *helper_thread(void *arg)
+{
+  struct spec_part *p = arg;
+  struct spec_pool *pool = p->pool;
+  unsigned int job = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  for (;;) {
+    while ((pool->job == job) && !pool->quit)
+      pthread_cond_wait(&pool->start_cond, &pool->mutex);
+    if (pool->quit)
+      break;
+    job = pool->job;
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_part(pool, p, p->tile, p->out);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done_cond);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+/* Start num_threads - 1 helper threads, which inherit the caller's
+ * scheduling. With one thread the caller does all the work and no
+ * buffers are needed. Returns 0 on success; on failure the pool is
+ * left with one thread.
+ */
+
+int spec_pool_init(struct spec_pool *pool, int num_threads)
+{
+  int r;
+
+  memset(pool, 0, sizeof(*pool));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  pool->num_threads = 1;
+
+  if (num_threads > MAX_SPEC_THREADS)
+    num_threads = MAX_SPEC_THREADS;
+  if (num_threads < 2)
+    return 0;
+
+  for (int n = 0; n < num_threads; n++) {
+    struct spec_part *p = fftwf_malloc(sizeof(*p));
+
+    if (p == NULL)
+      goto fail;
+    memset(p, 0, sizeof(*p));
+    p->pool = pool;
+    pool->parts[n] = p;
+    if (n == 0)
+      continue;
+
+    p->tile = fftwf_alloc_complex(MAX_HIRES_LEN);
+    p->out = fftwf_alloc_complex(MAX_HIRES_LEN);
+    if ((p->tile == NULL) || (p->out == NULL))
+      goto fail;
+
+    r = pthread_create(&p->thread, NULL, helper_thread, p);
+    if (r != 0) {
+      fprintf(stderr, "spec_pool_init: pthread_create(): %s\n", strerror(r));
+      fftwf_free(p->tile);
+      fftwf_free(p->out);
+      fftwf_free(p);
+      pool->parts[n] = NULL;
+      goto fail;
+    }
+    pool->num_threads = n + 1;
+  }
+
+  return 0;
+
+ fail:
+  fprintf(stderr, "Cannot start %d spectrum threads\n", num_threads);
+  spec_pool_free(pool);
+  pool->num_threads = 1;
+  return 1;
+}
+
+void spec_pool_free(struct spec_pool *pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  pthread_mutex_unlock(&pool->mutex);
+  pthread_cond_broadcast(&pool->start_cond);
+
+  for (int n = 0; n < MAX_SPEC_THREADS; n++) {
+    struct spec_part *p = pool->parts[n];
+
+    if (p == NULL)
+      continue;
+    if ((n > 0) && (n < pool->num_threads))
+      pthread_join(p->thread, NULL);
+    fftwf_free(p->tile);
+    fftwf_free(p->out);
+    fftwf_free(p);
+    pool->parts[n] = NULL;
+  }
+
+  pool->num_threads = 1;
+  pool->quit = 0;
+}
+
+/* calc_spectrum() if win is given, calc_spectra() otherwise, with the
+ * block's frames split between the pool's threads. The split is at
+ * whole frames of the longest FFT, so each frame is computed exactly
+ * as in a single call; only the order of summation differs. tile and
+ * fftout are the caller's buffers, as for those functions.
+ */
+
+void spec_pool_spectra(struct spec_pool *pool, uint8_t *signal, int sig_len,
+		       float *spec_buf, float *spec_sq_buf, int *num_spec,
+		       const float *win, const struct fft_backend *fft,
+		       fft_complex *tile, fft_complex *fftout,
+		       struct sig_stats *stats, struct spec_res *res,
+		       int num_res)
+{
+  int nt = pool->num_threads, unit = FFT_LEN, nsamp = sig_len / 2, nunits;
+
+  if (nt == 1) {
+    if (win != NULL)
+      calc_spectrum(signal, sig_len, spec_buf, spec_sq_buf, num_spec, win,
+		    fft, tile, fftout, stats);
+    else
+      calc_spectra(signal, sig_len, spec_buf, spec_sq_buf, num_spec, fft,
+		   tile, fftout, stats, res, num_res);
+    return;
+  }
+
+  /* Hand each thread a run of whole tiles; the last also gets any
+     partial tile at the end */
+
+  if (win == NULL)
+    for (int r = 0; r < num_res; r++)
+      if (res[r].fft->len > unit)
+	unit = res[r].fft->len;
+  nunits = nsamp / unit;
+
+  for (int n = 0; n < nt; n++) {
+    struct spec_part *p = pool->parts[n];
+    int u0 = (int)((long)nunits * n / nt);
+    int u1 = (int)((long)nunits * (n + 1) / nt);
+
+    p->start = u0 * unit;
+    p->len = n == nt - 1 ? nsamp - p->start : (u1 - u0) * unit;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->signal = signal;
+  pool->win = win;
+  pool->fft = fft;
+  pool->num_res = win == NULL ? num_res : 0;
+  for (int r = 0; r < pool->num_res; r++)
+    pool->res_fft[r] = res[r].fft;
+  pool->want_sq = spec_sq_buf != NULL;
+  pool->want_stats = stats != NULL;
+  pool->pending = nt - 1;
+  pool->job++;
+  pthread_mutex_unlock(&pool->mutex);
+  pthread_cond_broadcast(&pool->start_cond);
+
+  run_part(pool, pool->parts[0], tile, fftout);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+
+  /* Add up the parts, always in the same order */
+
+  memcpy(spec_buf, pool->parts[0]->spec, FFT_LEN * sizeof(float));
+  if (spec_sq_buf != NULL)
+    memcpy(spec_sq_buf, pool->parts[0]->sq, FFT_LEN * sizeof(float));
+  if (stats != NULL)
+    *stats = pool->parts[0]->stats;
+
+  for (int n = 1; n < nt; n++) {
+    const struct spec_part *p = pool->parts[n];
+
+    for (int k = 0; k < FFT_LEN; k++)
+      spec_buf[k] += p->spec[k];
+    if (spec_sq_buf != NULL)
+      for (int k = 0; k < FFT_LEN; k++)
+	spec_sq_buf[k] += p->sq[k];
+    if (stats != NULL)
+      for (int k = 0; k < 256; k++) {
+	stats->hist_i[k] += p->stats.hist_i[k];
+	stats->hist_q[k] += p->stats.hist_q[k];
+      }
+  }
+
+  for (int r = 0; r < pool->num_res; r++) {
+    int len = res[r].fft->len;
+
+    for (int n = 0; n < nt; n++) {
+      const struct spec_part *p = pool->parts[n];
+
+      for (int k = 0; k < len; k++)
+	res[r].spec[k] += p->hires[r][k];
+      res[r].num_spec += p->hires_num_spec[r];
+    }
+  }
+
+  if (num_spec != NULL) {
+    *num_spec = 0;
+    for (int n = 0; n < nt; n++)
+      *num_spec += pool->parts[n]->num_spec;
+  }
+}
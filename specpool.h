@@ -0,0 +1,66 @@
+/*
+ * Spectrum worker pools
+ *
+ * A pool splits the frames of one block of signal between several
+ * threads: the caller and num_threads - 1 helpers. Each has its own
+ * FFT buffers and partial sums, and the partial sums are added up in
+ * thread order once all are done, so that a given number of threads
+ * always gives the same result.
+ */
+
+#ifndef _SPECPOOL_H
+#define _SPECPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "signalproc.h"
+#include "fftbackend.h"
+#include "config.h"
+#include "common.h"
+
+struct spec_pool;
+
+/* One thread's share of a block */
+
+struct spec_part {
+  pthread_t thread;
+  struct spec_pool *pool;
+  fft_complex *tile, *out; /* helpers only: the caller uses its own */
+  int start, len; /* samples */
+  float spec[FFT_LEN];
+  float sq[FFT_LEN];
+  float hires[MAX_HIRES][MAX_HIRES_LEN];
+  int num_spec;
+  int hires_num_spec[MAX_HIRES];
+  struct sig_stats stats;
+};
+
+struct spec_pool {
+  int num_threads;
+  struct spec_part *parts[MAX_SPEC_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond; /* a new job, or quit */
+  pthread_cond_t done_cond; /* the helpers have finished the job */
+  unsigned int job; /* counts the jobs handed out */
+  int pending; /* helpers still working on the job */
+  int quit;
+
+  /* the job */
+  uint8_t *signal;
+  const float *win;
+  const struct fft_backend *fft;
+  const struct fft_backend *res_fft[MAX_HIRES];
+  int num_res;
+  int want_sq, want_stats;
+};
+
+int spec_pool_init(struct spec_pool *pool, int num_threads);
+void spec_pool_free(struct spec_pool *pool);
+void spec_pool_spectra(struct spec_pool *pool, uint8_t *signal, int sig_len,
+		       float *spec_buf, float *spec_sq_buf, int *num_spec,
+		       const float *win, const struct fft_backend *fft,
+		       fft_complex *tile, fft_complex *fftout,
+		       struct sig_stats *stats, struct spec_res *res,
+		       int num_res);
+
+#endif /* _SPECPOOL_H */
@@ -0,0 +1,56 @@
+/*
+ * Quick-look summary sidecar (.ozq) files
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "summary.h"
+#include "common.h"
+
+/* Fill in the line power and baseline of both sidebands from the
+ * normalised signal spectra (2 * FFT_LEN bins, in FFT order). The
+ * frequency correction puts the line FFT_LEN / 4 bins below the
+ * tuned frequency in the upper sideband and as far above it in the
+ * lower.
+ */
+
+void summarise_spectra(const float *spec, struct ozo_summary *s)
+{
+  for (int k = 0; k < 2; k++) {
+    const float *p = &spec[k * FFT_LEN];
+    int line = k == 0 ? FFT_LEN - FFT_LEN / 4 : FFT_LEN / 4;
+    double base = 0, sum = 0;
+    int n;
+
+    for (n = BASE_INNER; n < BASE_OUTER; n++)
+      base += p[(line + n) % FFT_LEN] + p[(line - n + FFT_LEN) % FFT_LEN];
+    base /= 2 * (BASE_OUTER - BASE_INNER);
+
+    for (n = -LINE_HALF_WIDTH; n <= LINE_HALF_WIDTH; n++)
+      sum += p[(line + n + FFT_LEN) % FFT_LEN] - base;
+
+    s->line_power[k] = sum;
+    s->baseline[k] = base;
+  }
+}
+
+/* The sidecar's path: the day file's, with .ozq for .ozo (and any
+   .gz dropped). Returns 0 on success. */
+
+int summary_path(const char *ozo_path, char *path, size_t len)
+{
+  size_t n = strlen(ozo_path);
+
+  if ((n > 3) && (strcmp(&ozo_path[n - 3], ".gz") == 0))
+    n -= 3;
+
+  if ((n < 4) || (strncmp(&ozo_path[n - 4], ".ozo", 4) != 0)
+      || (n + 1 > len))
+    return 1;
+
+  memcpy(path, ozo_path, n);
+  path[n] = '\0';
+  path[n - 1] = 'q';
+
+  return 0;
+}
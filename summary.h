@@ -0,0 +1,45 @@
+/*
+ * Quick-look summary sidecar (.ozq) files
+ *
+ * Alongside each day file 20240101_s000.ozo the recorder appends one
+ * fixed-size summary per record to 20240101_s000.ozq, so that long
+ * stretches can be plotted without reading the spectra. The sidecar
+ * is not compressed, but the archive worker removes it with its day
+ * file. ozosummary rebuilds it from the day file.
+ */
+
+#ifndef _SUMMARY_H
+#define _SUMMARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SUMMARY_MAGIC 0x51535a4f /* "OZSQ" */
+
+/* Bins from the line over which the line power is integrated, and
+   the range of bins either side of it averaged for the baseline */
+
+#define LINE_HALF_WIDTH 16
+#define BASE_INNER 32
+#define BASE_OUTER 96
+
+/* Index 0 is the upper sideband, as in the record. line_power is the
+   sum over the line of the power above the baseline, in the units of
+   the normalised spectra; baseline is the mean off-line power per
+   bin. */
+
+struct ozo_summary {
+  uint32_t magic;
+  int32_t channel;
+  uint64_t time_stamp;
+  double freq_err;
+  int32_t max_sig_level;
+  uint32_t reserved;
+  float line_power[2];
+  float baseline[2];
+};
+
+void summarise_spectra(const float *spec, struct ozo_summary *s);
+int summary_path(const char *ozo_path, char *path, size_t len);
+
+#endif /* _SUMMARY_H */
@@ -0,0 +1,32 @@
+/*
+ * Time measurement helpers
+ */
+
+#include "timeutil.h"
+
+/* CLOCK_MONOTONIC time at which the program started */
+
+struct timespec startup_time;
+
+/* Seconds elapsed on CLOCK_MONOTONIC since t0 */
+
+double time_since(const struct timespec *t0)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double)(ts.tv_sec - t0->tv_sec)
+    + 1.0E-9 * (double)(ts.tv_nsec - t0->tv_nsec);
+}
+
+/* Current time on clk in nanoseconds */
+
+int64_t clock_ns(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,16 @@
+/*
+ * Time measurement helpers
+ */
+
+#ifndef _TIMEUTIL_H
+#define _TIMEUTIL_H
+
+#include <time.h>
+#include <stdint.h>
+
+extern struct timespec startup_time;
+
+double time_since(const struct timespec *t0);
+int64_t clock_ns(clockid_t clk);
+
+#endif /* _TIMEUTIL_H */